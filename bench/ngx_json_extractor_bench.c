@@ -0,0 +1,1198 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/**
+ * Offline benchmark of the extraction path.
+ *
+ * The module is compiled into the driver and linked with objects of a
+ * built nginx tree, so documents go through the same code as in a
+ * worker: the DOM walk, the stream engine and the variable descriptor
+ * called with a request made by hand. Documents are generated from a
+ * fixed seed, every run parses the same bytes. Values of every mode are
+ * compared with the DOM walk before timing.
+ *
+ * Document memory is what the jansson tree or the tape keeps after the
+ * parse, walk modes time the lookup only on a document parsed once.
+ *
+ *   ngx_json_extractor_bench [-t msec] [-f filter] [-d dir] [-c]
+ */
+
+// Static helpers of the module are called directly
+#include "../ngx_json_extractor_module.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef BENCH_WRAP
+#define BENCH_WRAP      0           // Allocations are not counted
+#endif
+
+#define BENCH_SEED      0x2545f4914f6cdd1dULL
+#define BENCH_TIME      300         // Milliseconds of one case and mode
+#define BENCH_POOL      4096        // request_pool_size
+#define BENCH_SKIP_RUNS 200000      // Random buffers of the skip check
+#define BENCH_SKIP_BUF  512
+
+// Variables of the request made by hand
+#define BENCH_SOURCE    0
+#define BENCH_DESC      1
+#define BENCH_VARS      2
+
+// Modules of the request made by hand, context indexes are never set
+// outside of nginx
+#define BENCH_CORE      0
+#define BENCH_MODULE    1
+#define BENCH_MODULES   2
+
+typedef struct {
+    char        *name;
+    size_t       size;
+} bench_size_t;
+
+typedef struct {
+    ngx_str_t    name;              // "16k/d8/k8/s8"
+    size_t       size;
+    ngx_uint_t   depth;             // Nested objects of one record
+    ngx_uint_t   keys;              // Leaves of every object
+    ngx_uint_t   selectors;
+} bench_case_t;
+
+typedef struct {
+    u_char      *data;
+    size_t       len;
+    size_t       size;
+    uint64_t     rnd;
+} bench_doc_t;
+
+typedef ngx_int_t (*bench_run_pt)(je_item_t *it, ngx_str_t *doc,
+    ngx_pool_t *pool, ngx_str_t *out);
+
+typedef struct {
+    char           *name;
+    bench_run_pt    run;
+    ngx_uint_t      engine;
+    ngx_uint_t      lru;
+} bench_mode_t;
+
+// Size of jansson allocations while the document memory is counted
+typedef union {
+    size_t       size;
+    u_char       align[2 * sizeof(void *)];
+} bench_chunk_t;
+
+// Documents of the case parsed once
+typedef struct {
+    json_t         *json;
+    size_t          json_size;
+    je_tape_t      *tape;
+    size_t          tape_size;
+} bench_parsed_t;
+
+static ngx_int_t bench_dom(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool,
+    ngx_str_t *out);
+static ngx_int_t bench_stream(je_item_t *it, ngx_str_t *doc,
+    ngx_pool_t *pool, ngx_str_t *out);
+static ngx_int_t bench_tape(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool,
+    ngx_str_t *out);
+static ngx_int_t bench_desc(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool,
+    ngx_str_t *out);
+static ngx_int_t bench_walk_dom(je_item_t *it, ngx_str_t *doc,
+    ngx_pool_t *pool, ngx_str_t *out);
+static ngx_int_t bench_walk_tape(je_item_t *it, ngx_str_t *doc,
+    ngx_pool_t *pool, ngx_str_t *out);
+
+static bench_size_t  bench_sizes[] = {
+    { "1k",     1024 },
+    { "16k",    16 * 1024 },
+    { "256k",   256 * 1024 },
+    { "5m",     5 * 1024 * 1024 },
+    { NULL,     0 }
+};
+
+static ngx_uint_t  bench_depths[] = { 2, 8, 32, 0 };
+static ngx_uint_t  bench_keys[] = { 8, 64, 0 };
+static ngx_uint_t  bench_selectors[] = { 1, 8, 0 };
+
+// The first mode is the reference of values
+static bench_mode_t  bench_modes[] = {
+    { "dom",         bench_dom,       NGX_JSON_EXTRACTOR_ENGINE_DOM,    0 },
+    { "stream",      bench_stream,    NGX_JSON_EXTRACTOR_ENGINE_STREAM, 0 },
+    { "tape",        bench_tape,      NGX_JSON_EXTRACTOR_ENGINE_TAPE,   0 },
+    { "desc-dom",    bench_desc,      NGX_JSON_EXTRACTOR_ENGINE_DOM,    0 },
+    { "desc-stream", bench_desc,      NGX_JSON_EXTRACTOR_ENGINE_STREAM, 0 },
+    { "desc-tape",   bench_desc,      NGX_JSON_EXTRACTOR_ENGINE_TAPE,   0 },
+    { "desc-lru",    bench_desc,      NGX_JSON_EXTRACTOR_ENGINE_STREAM, 64 },
+    { "walk-dom",    bench_walk_dom,  NGX_JSON_EXTRACTOR_ENGINE_DOM,    0 },
+    { "walk-tape",   bench_walk_tape, NGX_JSON_EXTRACTOR_ENGINE_TAPE,   0 },
+    { NULL,          NULL,            0,                                0 }
+};
+
+static ngx_log_t                   bench_log;
+static ngx_open_file_t             bench_file;
+static ngx_cycle_t                 bench_cycle;
+static ngx_http_core_main_conf_t   bench_cmcf;
+static ngx_uint_t                  bench_allocs;
+static bench_parsed_t              bench_parsed;
+static size_t                      bench_json_live;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#if (BENCH_WRAP)
+
+/**
+ * Allocations of nginx and the module, linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign
+ */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+int __real_posix_memalign(void **p, size_t alignment, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+    bench_allocs++;
+    return __real_realloc(p, size);
+}
+
+int
+__wrap_posix_memalign(void **p, size_t alignment, size_t size)
+{
+    bench_allocs++;
+    return __real_posix_memalign(p, alignment, size);
+}
+
+#endif
+
+/**
+ * Monotonic time
+ * @return nanoseconds
+ */
+static uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Next number of the document generator, xorshift64*
+ * @param d
+ * @return random number
+ */
+static uint64_t
+bench_rand(bench_doc_t *d)
+{
+    d->rnd ^= d->rnd >> 12;
+    d->rnd ^= d->rnd << 25;
+    d->rnd ^= d->rnd >> 27;
+    return d->rnd * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Append bytes to the document
+ * @param d
+ * @param s
+ * @param len
+ */
+static void
+bench_put(bench_doc_t *d, const char *s, size_t len)
+{
+    u_char *p;
+
+    if (d->len + len > d->size) {
+        d->size = ngx_max(d->size * 2, d->len + len);
+
+        p = realloc(d->data, d->size);
+        if (NULL==p) {
+            fprintf(stderr, "Invalid memory alloc\n");
+            exit(2);
+        }
+        d->data = p;
+    }
+
+    ngx_memcpy(d->data + d->len, s, len);
+    d->len += len;
+}
+
+/**
+ * Append one object of depth levels, every level has keys leaves
+ * "k0".."kN" and the next level "c"
+ * @param d
+ * @param depth
+ * @param keys
+ */
+static void
+bench_record(bench_doc_t *d, ngx_uint_t depth, ngx_uint_t keys)
+{
+    u_char      buf[64], *p;
+    uint64_t    r;
+    ngx_uint_t  i, k, n;
+
+    bench_put(d, "{", 1);
+
+    for (i=0 ; i<keys ; i++) {
+        p = ngx_sprintf(buf, "%s\"k%ui\":", i ? "," : "", i);
+        bench_put(d, (char *) buf, p - buf);
+
+        r = bench_rand(d);
+
+        switch (r % 4) {
+
+        case 0:
+            n = 4 + (r >> 8) % 24;
+            buf[0] = '"';
+            for (k=1 ; k<=n ; k++)
+                buf[k] = "abcdefghijklmnopqrstuvwxyz0123456789 -"[
+                             (r >> (k + 8)) % 38];
+            buf[k] = '"';
+            bench_put(d, (char *) buf, n + 2);
+            break;
+
+        case 1:
+            p = ngx_sprintf(buf, "%L", (int64_t) ((r >> 8) % 2000000)
+                                       - 1000000);
+            bench_put(d, (char *) buf, p - buf);
+            break;
+
+        case 2:
+            if ((r >> 8) & 1) {
+                bench_put(d, "true", 4);
+            } else {
+                bench_put(d, "false", 5);
+            }
+            break;
+
+        default:
+            bench_put(d, "null", 4);
+            break;
+        }
+    }
+
+    if (depth>1) {
+        bench_put(d, ",\"c\":", 5);
+        bench_record(d, depth - 1, keys);
+    }
+
+    bench_put(d, "}", 1);
+}
+
+/**
+ * Generate the document of the case: records of the same shape fill
+ * the array which goes before the selected one, so the stream engine
+ * skips all of them and stops on the last key
+ * {"items":[{..},..],"meta":{..}}
+ * @param bc
+ * @param d
+ */
+static void
+bench_corpus(bench_case_t *bc, bench_doc_t *d)
+{
+    size_t  last;
+
+    ngx_memzero(d, sizeof(bench_doc_t));
+    d->rnd = BENCH_SEED ^ bc->size ^ (bc->depth << 32) ^ (bc->keys << 48);
+
+    bench_put(d, "{\"items\":[", sizeof("{\"items\":[") - 1);
+
+    for (last=0 ; d->len + (d->len - last) < bc->size ; ) {
+        if (last)
+            bench_put(d, ",", 1);
+        last = d->len;
+        bench_record(d, bc->depth, bc->keys);
+    }
+
+    bench_put(d, "],\"meta\":", sizeof("],\"meta\":") - 1);
+    bench_record(d, bc->depth, bc->keys);
+    bench_put(d, "}", 1);
+}
+
+/**
+ * Selector names of the case, spread over levels of the "meta" record
+ * "b_meta__k0", "b_meta__c__k1", ..
+ * @param pool
+ * @param bc
+ * @return names or NULL
+ */
+static ngx_str_t *
+bench_names(ngx_pool_t *pool, bench_case_t *bc)
+{
+    u_char      *p;
+    ngx_str_t   *names;
+    ngx_uint_t   i, k, level;
+
+    names = ngx_pcalloc(pool, bc->selectors * sizeof(ngx_str_t));
+    if (NULL==names)
+        return NULL;
+
+    for (i=0 ; i<bc->selectors ; i++) {
+        level = bc->selectors>1
+              ? i * (bc->depth - 1) / (bc->selectors - 1) : 0;
+
+        names[i].data = ngx_pnalloc(pool, sizeof("b_meta__k") - 1
+                                    + level * 3 + NGX_INT_T_LEN);
+        if (NULL==names[i].data)
+            return NULL;
+
+        p = ngx_cpymem(names[i].data, "b_meta", sizeof("b_meta") - 1);
+        for (k=0 ; k<level ; k++)
+            p = ngx_cpymem(p, "__c", 3);
+        p = ngx_sprintf(p, "__k%ui", i % bc->keys);
+
+        names[i].len = p - names[i].data;
+    }
+
+    return names;
+}
+
+/**
+ * Build json_extract of the selectors as the postconfiguration does
+ * @param pool
+ * @param m
+ * @param names
+ * @param n - selectors count
+ * @return item or NULL
+ */
+static je_item_t *
+bench_item(ngx_pool_t *pool, bench_mode_t *m, ngx_str_t *names, ngx_uint_t n)
+{
+    ngx_uint_t                 i;
+    je_item_t                 *it;
+    je_path_t                 *path, **pp;
+    ngx_json_extractor_loc_t  *lc;
+
+    lc = ngx_pcalloc(pool, sizeof(ngx_json_extractor_loc_t));
+    if (NULL==lc)
+        return NULL;
+
+    ngx_str_set(&lc->prefix, "b_");
+    lc->stat = NGX_CONF_UNSET_UINT;
+
+    it = add_json_item(lc, BENCH_DESC, BENCH_SOURCE, 0, pool);
+    if (NULL==it)
+        return NULL;
+
+    it->source = NGX_JSON_EXTRACTOR_SOURCE_VARIABLE;
+    it->format = NGX_JSON_EXTRACTOR_FORMAT_JSON;
+    it->engine = m->engine;
+    it->lru_size = m->lru;
+
+    if (NGX_OK!=ngx_array_init(&it->paths, pool, n, sizeof(je_path_t *)))
+        return NULL;
+
+    for (i=0 ; i<n ; i++) {
+        path = ngx_pcalloc(pool, sizeof(je_path_t));
+        pp = ngx_array_push(&it->paths);
+        if (NULL==path || NULL==pp)
+            return NULL;
+
+        path->item = it;
+        path->name = names[i];
+        path->index = BENCH_VARS + i;
+        *pp = path;
+
+        if (NGX_OK!=compile_json_path(pool, path, &lc->prefix)
+            || NGX_OK!=ngx_json_extractor_trie_add(pool, path))
+            return NULL;
+    }
+
+    it->slots = ngx_pcalloc(pool, it->nslots * sizeof(je_path_t *));
+    if (NULL==it->slots)
+        return NULL;
+
+    pp = it->paths.elts;
+    for (i=0 ; i<n ; i++)
+        it->slots[pp[i]->slot] = pp[i];
+
+    return it;
+}
+
+/**
+ * Copy values of the selectors in declaration order
+ * @param it
+ * @param values - by slot
+ * @param out
+ */
+static void
+bench_values(je_item_t *it, ngx_str_t *values, ngx_str_t *out)
+{
+    ngx_uint_t   i;
+    je_path_t  **pp;
+
+    pp = it->paths.elts;
+    for (i=0 ; NULL!=out && i<it->paths.nelts ; i++)
+        out[i] = values[pp[i]->slot];
+}
+
+/**
+ * Allocation of jansson counted as live document memory
+ * @param size
+ * @return memory or NULL
+ */
+static void *
+bench_json_malloc(size_t size)
+{
+    bench_chunk_t *c;
+
+    c = malloc(sizeof(bench_chunk_t) + size);
+    if (NULL==c)
+        return NULL;
+
+    c->size = size;
+    bench_json_live += size;
+    return c + 1;
+}
+
+/**
+ * Release of bench_json_malloc memory
+ * @param ptr
+ */
+static void
+bench_json_free(void *ptr)
+{
+    bench_chunk_t *c;
+
+    if (NULL==ptr)
+        return;
+
+    c = (bench_chunk_t *) ptr - 1;
+    bench_json_live -= c->size;
+    free(c);
+}
+
+/**
+ * Parse the document of the case by jansson and into a tape, memory
+ * of both is what is kept after the parse
+ * @param doc
+ * @param pool - memory of the tape
+ * @param bp
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_parse(ngx_str_t *doc, ngx_pool_t *pool, bench_parsed_t *bp)
+{
+    size_t        pos;
+    json_error_t  error;
+
+    bench_json_live = 0;
+    json_set_alloc_funcs(bench_json_malloc, bench_json_free);
+
+    bp->json = json_loadb((char *) doc->data, doc->len, JSON_DECODE_ANY,
+                          &error);
+    bp->json_size = bench_json_live;
+
+    json_set_alloc_funcs(malloc, free);
+
+    if (NULL==bp->json
+        || NGX_OK!=ngx_json_extractor_tape_parse(pool, doc, &bp->tape, &pos))
+        return NGX_ERROR;
+
+    bp->tape_size = ngx_json_extractor_tape_size(bp->tape);
+    return NGX_OK;
+}
+
+/**
+ * Release the jansson document of the case, the tape goes with its pool
+ * @param bp
+ */
+static void
+bench_parsed_free(bench_parsed_t *bp)
+{
+    if (NULL==bp->json)
+        return;
+
+    json_set_alloc_funcs(bench_json_malloc, bench_json_free);
+    json_decref(bp->json);
+    json_set_alloc_funcs(malloc, free);
+
+    bp->json = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Modes /////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Document built by libjansson in the arena and walked by the trie
+ * @param it
+ * @param doc
+ * @param pool - request pool
+ * @param out - values or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_dom(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool, ngx_str_t *out)
+{
+    json_t        *json;
+    je_arena_t    *arena;
+    je_stream_t   *st;
+    json_error_t   error;
+
+    st = get_json_values(pool, it);
+    if (NULL==st)
+        return NGX_ERROR;
+
+    arena = ngx_json_extractor_arena_create(pool);
+    if (NULL==arena)
+        return NGX_ERROR;
+
+    ngx_json_extractor_alloc_begin(arena);
+
+    json = json_loadb((char *) doc->data, doc->len, JSON_DECODE_ANY, &error);
+    if (NULL!=json)
+        walk_json_item(st, &it->root, json);
+
+    ngx_json_extractor_alloc_end();
+
+    if (NULL==json)
+        return NGX_ERROR;
+
+    bench_values(it, st->values, out);
+    return NGX_OK;
+}
+
+/**
+ * Document read once by the stream engine
+ * @param it
+ * @param doc
+ * @param pool - request pool
+ * @param out - values or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_stream(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool,
+    ngx_str_t *out)
+{
+    je_stream_t  *st;
+
+    st = ngx_json_extractor_stream_create(pool, it);
+    if (NULL==st)
+        return NGX_ERROR;
+
+    st->inplace = 1;
+    st->rc = ngx_json_extractor_stream_feed(st, doc->data,
+                                            doc->data + doc->len);
+    if (NGX_AGAIN==st->rc)
+        st->rc = ngx_json_extractor_stream_finish(st);
+
+    if (NGX_OK!=st->rc)
+        return NGX_ERROR;
+
+    bench_values(it, st->values, out);
+    return NGX_OK;
+}
+
+/**
+ * Document parsed into a tape and walked forward by the trie
+ * @param it
+ * @param doc
+ * @param pool - request pool
+ * @param out - values or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_tape(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool, ngx_str_t *out)
+{
+    size_t        pos;
+    je_tape_t    *tape;
+    je_stream_t  *st;
+
+    st = get_json_values(pool, it);
+    if (NULL==st)
+        return NGX_ERROR;
+
+    if (NGX_OK!=ngx_json_extractor_tape_parse(pool, doc, &tape, &pos))
+        return NGX_ERROR;
+
+    ngx_json_extractor_tape_walk(st, &it->root, tape);
+
+    bench_values(it, st->values, out);
+    return NGX_OK;
+}
+
+/**
+ * Variable descriptor with the source already evaluated, as
+ * json_extract $http_x_doc does, variables are read by their getter
+ * @param it
+ * @param doc
+ * @param pool - request pool
+ * @param out - values or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_desc(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool, ngx_str_t *out)
+{
+    ngx_uint_t                   i;
+    je_path_t                  **pp;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_variable_value_t    v, val, *src;
+
+    r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+    c = ngx_pcalloc(pool, sizeof(ngx_connection_t));
+    if (NULL==r || NULL==c)
+        return NGX_ERROR;
+
+    r->ctx = ngx_pcalloc(pool, BENCH_MODULES * sizeof(void *));
+    r->main_conf = ngx_pcalloc(pool, BENCH_MODULES * sizeof(void *));
+    r->loc_conf = ngx_pcalloc(pool, BENCH_MODULES * sizeof(void *));
+    r->variables = ngx_pcalloc(pool, (BENCH_VARS + it->paths.nelts)
+                                     * sizeof(ngx_http_variable_value_t));
+    if (NULL==r->ctx || NULL==r->main_conf || NULL==r->loc_conf
+        || NULL==r->variables)
+        return NGX_ERROR;
+
+    c->log = pool->log;
+    r->connection = c;
+    r->pool = pool;
+    r->main = r;
+    r->main_conf[BENCH_CORE] = &bench_cmcf;
+    r->loc_conf[BENCH_MODULE] = it->conf;
+
+    src = &r->variables[BENCH_SOURCE];
+    src->data = doc->data;
+    src->len = doc->len;
+    src->valid = 1;
+
+    if (NGX_OK!=ngx_http_json_desc(r, &v, (uintptr_t) it))
+        return NGX_ERROR;
+
+    r->variables[BENCH_DESC] = v;
+
+    pp = it->paths.elts;
+    for (i=0 ; NULL!=out && i<it->paths.nelts ; i++) {
+        if (NGX_OK!=ngx_http_json_extract_var(r, &val, (uintptr_t) pp[i]))
+            return NGX_ERROR;
+
+        out[i].data = val.data;
+        out[i].len = val.len;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Lookup in the jansson document parsed once
+ * @param it
+ * @param doc - unused, the document of the case is walked
+ * @param pool - request pool
+ * @param out - values or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_walk_dom(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool,
+    ngx_str_t *out)
+{
+    je_arena_t  *arena;
+    je_stream_t *st;
+
+    st = get_json_values(pool, it);
+    arena = ngx_json_extractor_arena_create(pool);
+    if (NULL==st || NULL==arena)
+        return NGX_ERROR;
+
+    // Serialized objects and arrays go to the arena as in a request
+    ngx_json_extractor_alloc_begin(arena);
+    walk_json_item(st, &it->root, bench_parsed.json);
+    ngx_json_extractor_alloc_end();
+
+    bench_values(it, st->values, out);
+    return NGX_OK;
+}
+
+/**
+ * Lookup in the tape parsed once
+ * @param it
+ * @param doc - unused, the document of the case is walked
+ * @param pool - request pool
+ * @param out - values or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_walk_tape(je_item_t *it, ngx_str_t *doc, ngx_pool_t *pool,
+    ngx_str_t *out)
+{
+    je_stream_t *st;
+
+    st = get_json_values(pool, it);
+    if (NULL==st)
+        return NGX_ERROR;
+
+    ngx_json_extractor_tape_walk(st, &it->root, bench_parsed.tape);
+
+    bench_values(it, st->values, out);
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Checks ////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Source over the limits with the worker cache enabled, variables
+ * get default values
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_check_limits(void)
+{
+    ngx_int_t      rc;
+    ngx_uint_t     i, n;
+    ngx_str_t      doc, *names, *out;
+    ngx_pool_t    *cpool, *pool;
+    je_item_t     *it;
+    je_limits_t    lm;
+    bench_doc_t    d;
+    bench_case_t   bc;
+    bench_mode_t   m = { "limits-lru", bench_desc,
+                         NGX_JSON_EXTRACTOR_ENGINE_DOM, 64 };
+
+    cpool = ngx_create_pool(BENCH_POOL, &bench_log);
+    if (NULL==cpool)
+        return NGX_ERROR;
+
+    rc = NGX_ERROR;
+    d.data = NULL;
+
+    ngx_memzero(&bc, sizeof(bench_case_t));
+    bc.size = 1024;
+    bc.depth = 2;
+    bc.keys = 8;
+    bc.selectors = 8;
+
+    names = bench_names(cpool, &bc);
+    out = ngx_pcalloc(cpool, bc.selectors * sizeof(ngx_str_t));
+    it = NULL==names ? NULL : bench_item(cpool, &m, names, bc.selectors);
+    if (NULL==out || NULL==it)
+        goto done;
+
+    ngx_memzero(&lm, sizeof(je_limits_t));
+    bench_corpus(&bc, &d);
+    doc.data = d.data;
+    doc.len = d.len;
+
+    // Size, then depth: the first is checked before the cache lookup
+    for (n=0 ; n<2 ; n++) {
+        lm.size = 0==n ? 16 : 0;
+        lm.depth = 0==n ? 0 : 1;
+        it->limits = &lm;
+
+        pool = ngx_create_pool(BENCH_POOL, &bench_log);
+        if (NULL==pool)
+            goto done;
+
+        rc = bench_desc(it, &doc, pool, out);
+        ngx_destroy_pool(pool);
+
+        for (i=0 ; NGX_OK==rc && i<bc.selectors ; i++) {
+            if (0!=out[i].len)
+                rc = NGX_ERROR;
+        }
+
+        if (NGX_OK!=rc) {
+            fprintf(stderr, "%s: source over the limits is not default\n",
+                    m.name);
+            goto done;
+        }
+    }
+
+done:
+
+    free(d.data);
+    ngx_destroy_pool(cpool);
+    return rc;
+}
+
+/**
+ * Skip versions of the CPU stop on the same byte with the same state,
+ * buffers and initial states are random
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_check_skip(void)
+{
+    static u_char        set[] = "\"\\{}[]:, a";
+    u_char               buf[BENCH_SKIP_BUF + 64], *p, *last, *e[2];
+    uint64_t             r;
+    ngx_uint_t           i, k, n, off;
+    bench_doc_t          d;
+    je_stream_t          init, st[2];
+    je_skip_version_t    v[NGX_JSON_EXTRACTOR_SKIP_VERSIONS];
+
+    n = ngx_json_extractor_simd_versions(v);
+    d.rnd = BENCH_SEED;
+
+    for (i=0 ; i<BENCH_SKIP_RUNS ; i++) {
+        r = bench_rand(&d);
+        off = r % 64;
+        p = buf + off;
+        last = p + (r >> 8) % BENCH_SKIP_BUF;
+
+        // Specials are frequent enough to end values in every block
+        for (e[0]=p ; e[0]<last ; e[0]++)
+            *e[0] = set[bench_rand(&d) % (sizeof(set) - 1)];
+
+        // Inside of a string or a container, escape only in a string
+        ngx_memzero(&init, sizeof(je_stream_t));
+        init.depth = (r >> 24) % 4;
+        init.instr = 0==init.depth ? 1 : (r >> 32) & 1;
+        init.esc = init.instr ? (r >> 33) & 1 : 0;
+
+        st[0] = init;
+        e[0] = v[0].skip(&st[0], p, last);
+
+        for (k=1 ; k<n ; k++) {
+            st[1] = init;
+            e[1] = v[k].skip(&st[1], p, last);
+
+            if (e[0]!=e[1] || st[0].depth!=st[1].depth
+                || st[0].instr!=st[1].instr || st[0].esc!=st[1].esc)
+            {
+                fprintf(stderr, "skip: %s differs from %s, run %lu: "
+                        "stop %ld/%ld depth %lu/%lu instr %u/%u esc %u/%u\n",
+                        v[k].name, v[0].name, (unsigned long) i,
+                        (long) (e[0] - p), (long) (e[1] - p),
+                        (unsigned long) st[0].depth,
+                        (unsigned long) st[1].depth,
+                        st[0].instr, st[1].instr, st[0].esc, st[1].esc);
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    for (k=0 ; k<n ; k++)
+        printf("skip: %s\n", v[k].name);
+
+    return NGX_OK;
+}
+
+/**
+ * Run every check
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_check(void)
+{
+    if (NGX_OK!=bench_check_limits() || NGX_OK!=bench_check_skip())
+        return NGX_ERROR;
+
+    printf("checks passed\n");
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Runner ////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Check values of the mode against the reference ones
+ * @param bc
+ * @param m
+ * @param names
+ * @param ref
+ * @param out
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_verify(bench_case_t *bc, bench_mode_t *m, ngx_str_t *names,
+    ngx_str_t *ref, ngx_str_t *out)
+{
+    ngx_uint_t  i;
+
+    for (i=0 ; i<bc->selectors ; i++) {
+        if (ref[i].len==out[i].len
+            && (0==ref[i].len
+                || 0==ngx_memcmp(ref[i].data, out[i].data, ref[i].len)))
+            continue;
+
+        fprintf(stderr, "%.*s %s: $%.*s is [%.*s], expected [%.*s]\n",
+                (int) bc->name.len, bc->name.data, m->name,
+                (int) names[i].len, names[i].data,
+                (int) out[i].len, out[i].data,
+                (int) ref[i].len, ref[i].data);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Run one case in every mode matched by the filter
+ * @param bc
+ * @param msec - time of one mode
+ * @param filter - part of "case mode" or NULL
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_case(bench_case_t *bc, ngx_msec_t msec, char *filter)
+{
+    char          label[128];
+    double        size;
+    uint64_t      start, elapsed;
+    ngx_int_t     rc;
+    ngx_uint_t    ops, allocs;
+    ngx_str_t     doc, *names, *ref, *out;
+    ngx_pool_t   *cpool, *pool;
+    je_item_t    *it;
+    bench_doc_t   d;
+    bench_mode_t *m;
+
+    cpool = ngx_create_pool(BENCH_POOL, &bench_log);
+    if (NULL==cpool)
+        return NGX_ERROR;
+
+    rc = NGX_ERROR;
+    d.data = NULL;
+    ngx_memzero(&bench_parsed, sizeof(bench_parsed_t));
+
+    names = bench_names(cpool, bc);
+    ref = ngx_pcalloc(cpool, bc->selectors * sizeof(ngx_str_t));
+    out = ngx_pcalloc(cpool, bc->selectors * sizeof(ngx_str_t));
+    if (NULL==names || NULL==ref || NULL==out)
+        goto done;
+
+    bench_corpus(bc, &d);
+    doc.data = d.data;
+    doc.len = d.len;
+
+    if (NGX_OK!=bench_parse(&doc, cpool, &bench_parsed)) {
+        fprintf(stderr, "%.*s: invalid document\n",
+                (int) bc->name.len, bc->name.data);
+        goto done;
+    }
+
+    for (m=bench_modes ; m->name ; m++) {
+        snprintf(label, sizeof(label), "%.*s %s",
+                 (int) bc->name.len, bc->name.data, m->name);
+
+        it = bench_item(cpool, m, names, bc->selectors);
+        if (NULL==it)
+            goto done;
+
+        // Every mode is checked, the first one gives the reference
+        pool = ngx_create_pool(BENCH_POOL, &bench_log);
+        if (NULL==pool)
+            goto done;
+
+        rc = m->run(it, &doc, pool, m==bench_modes ? ref : out);
+
+        if (NGX_OK==rc && m!=bench_modes)
+            rc = bench_verify(bc, m, names, ref, out);
+
+        ngx_destroy_pool(pool);
+
+        if (NGX_OK!=rc) {
+            fprintf(stderr, "%s: failed\n", label);
+            goto done;
+        }
+
+        if (NULL!=filter && NULL==strstr(label, filter))
+            continue;
+
+        start = bench_now();
+        allocs = bench_allocs;
+
+        for (ops=0 ; ; ) {
+            pool = ngx_create_pool(BENCH_POOL, &bench_log);
+            if (NULL==pool)
+                goto done;
+
+            rc = m->run(it, &doc, pool, NULL);
+            ngx_destroy_pool(pool);
+
+            if (NGX_OK!=rc)
+                goto done;
+
+            ops++;
+            elapsed = bench_now() - start;
+            if (ops>=3 && elapsed>=msec * 1000000)
+                break;
+        }
+
+        allocs = bench_allocs - allocs;
+
+        // Memory of the document the mode keeps
+        if (bench_dom==m->run || bench_walk_dom==m->run) {
+            size = bench_parsed.json_size;
+        } else if (bench_tape==m->run || bench_walk_tape==m->run) {
+            size = bench_parsed.tape_size;
+        } else {
+            size = -1.0;
+        }
+
+        printf("%-20.*s %9zu  %-12s %12.0f %10.1f %10.2f %10.0f\n",
+               (int) bc->name.len, bc->name.data, doc.len, m->name,
+               (double) elapsed / ops,
+               (double) doc.len * ops * 1000 / elapsed,
+               BENCH_WRAP ? (double) allocs / ops : -1.0, size);
+        fflush(stdout);
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    bench_parsed_free(&bench_parsed);
+    free(d.data);
+    ngx_destroy_pool(cpool);
+    return rc;
+}
+
+/**
+ * Write documents of the end-to-end benchmark, the shape of
+ * bench/nginx.conf selectors: depth 8 and 8 keys
+ * @param dir
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+bench_dump(char *dir)
+{
+    char          path[NGX_MAX_PATH];
+    FILE         *f;
+    bench_doc_t   d;
+    bench_case_t  bc;
+    bench_size_t *bs;
+
+    for (bs=bench_sizes ; bs->name ; bs++) {
+        ngx_memzero(&bc, sizeof(bench_case_t));
+        bc.size = bs->size;
+        bc.depth = 8;
+        bc.keys = 8;
+
+        bench_corpus(&bc, &d);
+
+        snprintf(path, sizeof(path), "%s/doc-%s.json", dir, bs->name);
+
+        f = fopen(path, "w");
+        if (NULL==f || d.len!=fwrite(d.data, 1, d.len, f)) {
+            perror(path);
+            return NGX_ERROR;
+        }
+
+        fclose(f);
+        free(d.data);
+    }
+
+    return NGX_OK;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int            i, check;
+    char          *filter, *dir;
+    u_char         name[64];
+    ngx_uint_t    *dp, *kp, *sp;
+    ngx_msec_t     msec;
+    bench_size_t  *bs;
+    bench_case_t   bc;
+
+    msec = BENCH_TIME;
+    filter = NULL;
+    dir = NULL;
+    check = 0;
+
+    for (i=1 ; i<argc ; i++) {
+        if (0==strcmp(argv[i], "-t") && i+1<argc) {
+            msec = atoi(argv[++i]);
+        } else if (0==strcmp(argv[i], "-f") && i+1<argc) {
+            filter = argv[++i];
+        } else if (0==strcmp(argv[i], "-d") && i+1<argc) {
+            dir = argv[++i];
+        } else if (0==strcmp(argv[i], "-c")) {
+            check = 1;
+        } else {
+            fprintf(stderr,
+                "usage: %s [-t msec] [-f filter] [-d dir] [-c]\n"
+                "  -t  time of one case and mode, %d by default\n"
+                "  -f  run cases and modes containing the text, \"16k\"\n"
+                "  -d  write documents of the end-to-end benchmark\n"
+                "  -c  run checks of the extraction path and exit\n",
+                argv[0], BENCH_TIME);
+            return 2;
+        }
+    }
+
+    if (NULL!=dir)
+        return NGX_OK==bench_dump(dir) ? 0 : 1;
+
+    // Worker state nginx sets up before modules run
+    ngx_pagesize = getpagesize();
+    for (ngx_pagesize_shift=0 ; (ngx_uint_t) 1<<ngx_pagesize_shift
+                                < ngx_pagesize ; ngx_pagesize_shift++) {
+        /* void */
+    }
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    ngx_time_init();
+
+    bench_file.fd = ngx_stderr;
+    bench_log.file = &bench_file;
+    bench_log.log_level = NGX_LOG_WARN;
+    bench_cycle.log = &bench_log;
+    ngx_cycle = &bench_cycle;
+
+    ngx_http_core_module.ctx_index = BENCH_CORE;
+    ngx_json_extractor_module.ctx_index = BENCH_MODULE;
+    bench_cmcf.variables.nelts = BENCH_VARS;
+
+    ngx_json_extractor_simd_init();
+
+    if (check)
+        return NGX_OK==bench_check() ? 0 : 1;
+
+    printf("%-20s %9s  %-12s %12s %10s %10s %10s\n",
+           "case", "bytes", "mode", "ns/op", "MB/s", "allocs/op", "doc/B");
+
+    for (bs=bench_sizes ; bs->name ; bs++) {
+        for (dp=bench_depths ; *dp ; dp++) {
+            for (kp=bench_keys ; *kp ; kp++) {
+                for (sp=bench_selectors ; *sp ; sp++) {
+                    bc.size = bs->size;
+                    bc.depth = *dp;
+                    bc.keys = *kp;
+                    bc.selectors = *sp;
+
+                    bc.name.data = name;
+                    bc.name.len = ngx_snprintf(name, sizeof(name),
+                                      "%s/d%ui/k%ui/s%ui", bs->name,
+                                      *dp, *kp, *sp) - name;
+
+                    if (NGX_OK!=bench_case(&bc, msec, filter))
+                        return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the module with wrk.
+#
+#   bench/run.sh <nginx> [seconds] [connections]
+#
+# nginx is the binary built with the module, documents are written by
+# ngx_json_extractor_bench next to this script.
+
+set -e
+
+NGINX=${1:?usage: $0 <nginx> [seconds] [connections]}
+DURATION=${2:-10}
+CONNECTIONS=${3:-32}
+BENCH=$(cd "$(dirname "$0")" && pwd)
+URL=http://127.0.0.1:8080
+
+command -v wrk >/dev/null || { echo "$0: wrk is not found" >&2; exit 1; }
+
+DIR=$(mktemp -d)
+mkdir "$DIR/logs"
+
+cleanup() {
+    [ -f "$DIR/logs/nginx.pid" ] && "$NGINX" -p "$DIR" -c "$BENCH/nginx.conf" -s stop
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+"$BENCH/ngx_json_extractor_bench" -d "$DIR"
+"$NGINX" -p "$DIR" -c "$BENCH/nginx.conf"
+sleep 1
+
+# Document of the file goes in the header or the body of every request
+script() {
+    cat > "$DIR/$1.lua" <<END
+local f = io.open("$DIR/doc-$2.json", "rb")
+local doc = f:read("*a")
+f:close()
+wrk.method = "$3"
+if wrk.method == "POST" then
+    wrk.body = doc
+    wrk.headers["Content-Type"] = "application/json"
+else
+    wrk.headers["X-Doc"] = doc
+end
+END
+}
+
+run() {
+    echo "== $1 $2"
+    wrk -t2 -c"$CONNECTIONS" -d"$DURATION"s -s "$DIR/$3.lua" "$URL$1" \
+        | grep -E 'Latency|Requests/sec|Transfer/sec|Non-2xx'
+}
+
+for size in 1k 16k; do
+    script "header-$size" "$size" GET
+    for engine in dom stream lru; do
+        run "/header/$engine" "$size" "header-$size"
+    done
+done
+
+for size in 1k 16k 256k 5m; do
+    script "body-$size" "$size" POST
+    run /body "$size" "body-$size"
+done
+
+curl -s "$URL/status" 2>/dev/null | grep -v '^#' || true
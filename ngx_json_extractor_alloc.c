@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Memory of libjansson.
+ *
+ * Documents of a request are allocated from its arena, the arena takes
+ * slabs from the worker free list and gives them back when the request
+ * pool is destroyed, so nothing is released value by value. Without an
+ * active arena (configuration) the libc heap is used. Allocation
+ * functions are process-wide: they are set only while the module calls
+ * libjansson, so memory of other modules never reaches je_free.
+ */
+
+typedef struct je_slab_s je_slab_t;
+
+struct je_slab_s {
+    je_slab_t  *next;
+    u_char     *pos;
+    u_char     *last;
+};
+
+struct je_arena_s {
+    ngx_pool_t *pool;
+    je_slab_t  *slabs;
+};
+
+// Every chunk knows its owner, NULL is the heap
+typedef union {
+    je_arena_t *arena;
+    u_char      align[2 * sizeof(void *)];
+} je_chunk_t;
+
+static void *je_malloc(size_t size);
+static void je_free(void *ptr);
+static je_slab_t *je_slab_get(void);
+static void je_arena_cleanup(void *data);
+
+static je_arena_t    *je_arena;           // Active arena or NULL
+static ngx_uint_t     je_active;
+static json_malloc_t  je_prev_malloc;
+static json_free_t    je_prev_free;
+
+static je_slab_t  *je_free_slabs;
+static ngx_uint_t  je_nfree_slabs;
+
+/**
+ * Route libjansson allocations of the module to the arena
+ * @param a - arena or NULL for the heap
+ */
+void
+ngx_json_extractor_alloc_begin(je_arena_t *a)
+{
+    if (!je_active) {
+        json_get_alloc_funcs(&je_prev_malloc, &je_prev_free);
+        json_set_alloc_funcs(je_malloc, je_free);
+        je_active = 1;
+    }
+
+    je_arena = a;
+}
+
+/**
+ * Give libjansson allocations back to the functions set before
+ */
+void
+ngx_json_extractor_alloc_end(void)
+{
+    if (je_active) {
+        json_set_alloc_funcs(je_prev_malloc, je_prev_free);
+        je_active = 0;
+    }
+
+    je_arena = NULL;
+}
+
+/**
+ * Create arena released with the pool
+ * @param pool
+ * @return arena or NULL
+ */
+je_arena_t *
+ngx_json_extractor_arena_create(ngx_pool_t *pool)
+{
+    je_arena_t          *a;
+    ngx_pool_cleanup_t  *cln;
+
+    a = ngx_palloc(pool, sizeof(je_arena_t));
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (NULL==a || NULL==cln)
+        return NULL;
+
+    a->pool = pool;
+    a->slabs = NULL;
+
+    cln->handler = je_arena_cleanup;
+    cln->data = a;
+
+    return a;
+}
+
+/**
+ * Allocate from the active arena
+ * @param size
+ * @return memory or NULL
+ */
+static void *
+je_malloc(size_t size)
+{
+    je_arena_t  *a;
+    je_slab_t   *s;
+    je_chunk_t  *c;
+
+    a = je_arena;
+
+    if (NULL==a) {
+        c = malloc(sizeof(je_chunk_t) + size);
+        if (NULL==c)
+            return NULL;
+
+        c->arena = NULL;
+        return c + 1;
+    }
+
+    size = ngx_align(sizeof(je_chunk_t) + size, sizeof(je_chunk_t));
+
+    // Big strings and tables go to the pool itself
+    if (size>NGX_JSON_EXTRACTOR_ARENA_SLAB / 4) {
+        c = ngx_palloc(a->pool, size);
+        if (NULL==c)
+            return NULL;
+
+        c->arena = a;
+        return c + 1;
+    }
+
+    s = a->slabs;
+
+    if (NULL==s || (size_t) (s->last - s->pos)<size) {
+        s = je_slab_get();
+        if (NULL==s)
+            return NULL;
+
+        s->next = a->slabs;
+        a->slabs = s;
+    }
+
+    c = (je_chunk_t *) s->pos;
+    s->pos += size;
+
+    c->arena = a;
+    return c + 1;
+}
+
+/**
+ * Release heap memory, arena memory lives until the arena is destroyed
+ * @param ptr
+ */
+static void
+je_free(void *ptr)
+{
+    je_chunk_t  *c;
+
+    if (NULL==ptr)
+        return;
+
+    c = (je_chunk_t *) ptr - 1;
+
+    if (NULL==c->arena)
+        free(c);
+}
+
+/**
+ * Take a slab from the worker free list or allocate the new one
+ * @return slab or NULL
+ */
+static je_slab_t *
+je_slab_get(void)
+{
+    je_slab_t  *s;
+
+    s = je_free_slabs;
+
+    if (NULL!=s) {
+        je_free_slabs = s->next;
+        je_nfree_slabs--;
+
+    } else {
+        s = ngx_alloc(NGX_JSON_EXTRACTOR_ARENA_SLAB, ngx_cycle->log);
+        if (NULL==s)
+            return NULL;
+
+        s->last = (u_char *) s + NGX_JSON_EXTRACTOR_ARENA_SLAB;
+    }
+
+    s->pos = (u_char *) ngx_align_ptr(s + 1, sizeof(je_chunk_t));
+    return s;
+}
+
+/**
+ * Give slabs of the arena back to the free list
+ * @param data je_arena_t*
+ */
+static void
+je_arena_cleanup(void *data)
+{
+    je_arena_t  *a = data;
+    je_slab_t   *s, *next;
+    ngx_uint_t   n;
+
+    for (n=0, s=a->slabs ; s ; s=next, n++) {
+        next = s->next;
+
+        if (je_nfree_slabs>=NGX_JSON_EXTRACTOR_ARENA_KEEP) {
+            ngx_free(s);
+            continue;
+        }
+
+        s->next = je_free_slabs;
+        je_free_slabs = s;
+        je_nfree_slabs++;
+    }
+
+    a->slabs = NULL;
+
+    if (NULL!=ngx_json_extractor_status) {
+        (void) ngx_atomic_fetch_add(&ngx_json_extractor_status->cleanups, 1);
+        (void) ngx_atomic_fetch_add(&ngx_json_extractor_status->slabs, n);
+    }
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,1024 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * MessagePack and CBOR documents.
+ *
+ * The document is walked by the selector trie when it is complete,
+ * lengths are known from item heads, so unrelated items are skipped
+ * without looking into them and array lengths are known for indexes
+ * from the end. Values are converted as JSON ones: strings as is,
+ * true "1", false "0", null "", numbers as text, maps and arrays
+ * are written as JSON.
+ */
+
+#define JE_BIN_DEPTH    512                 // Deepest nested item
+
+enum {
+    je_bin_nil = 0,
+    je_bin_true,
+    je_bin_false,
+    je_bin_uint,                            // n
+    je_bin_nint,                            // -1 - n
+    je_bin_real,                            // d
+    je_bin_str,                             // n bytes
+    je_bin_bin,                             // n bytes
+    je_bin_array,                           // n items
+    je_bin_map,                             // n pairs
+    je_bin_tag,                             // CBOR tag of the next item
+    je_bin_break                            // CBOR end of indefinite item
+};
+
+typedef struct {
+    ngx_uint_t  type;
+    uint64_t    n;
+    double      d;
+    unsigned    indef:1;                    // CBOR indefinite length
+} je_bin_head_t;
+
+typedef struct {
+    je_stream_t  *st;
+    u_char       *last;
+    ngx_uint_t    depth;
+    ngx_uint_t    tokens;
+    je_limits_t  *limits;                   // NULL if not limited
+    char         *over;                     // Exceeded limit
+    u_char       *pos;                      // Item over the limit
+} je_bin_t;
+
+// JSON text is measured without pos, then written
+typedef struct {
+    u_char       *pos;
+    size_t        len;
+} je_bin_out_t;
+
+static u_char *je_bin_walk(je_bin_t *b, je_node_t *node, u_char *p);
+static u_char *je_bin_count(je_bin_t *b, u_char *p, uint64_t *n);
+static u_char *je_bin_over(je_bin_t *b, char *limit, u_char *p);
+static u_char *je_bin_head(je_bin_t *b, u_char *p, je_bin_head_t *h);
+static u_char *je_msgpack_head(je_bin_t *b, u_char *p, je_bin_head_t *h);
+static u_char *je_cbor_head(je_bin_t *b, u_char *p, je_bin_head_t *h);
+static u_char *je_bin_string(je_bin_t *b, u_char *p, je_bin_head_t *h,
+    ngx_str_t *s);
+static ngx_int_t je_bin_scalar(je_bin_t *b, je_bin_head_t *h, ngx_str_t *s,
+    ngx_str_t *val);
+static u_char *je_bin_number(u_char *buf, je_bin_head_t *h);
+static u_char *je_bin_json(je_bin_t *b, u_char *p, je_bin_out_t *o);
+static void je_bin_out(je_bin_out_t *o, u_char *s, size_t len);
+static void je_bin_out_str(je_bin_out_t *o, ngx_str_t *s);
+static uint64_t je_bin_be(u_char *p, ngx_uint_t n);
+static double je_bin_half(uint16_t h);
+
+/**
+ * Collect next part of the document, the buffer living as long as
+ * the values is not copied
+ * @param st
+ * @param p - buffer start
+ * @param last - buffer end
+ * @return NGX_AGAIN or NGX_ERROR
+ */
+ngx_int_t
+ngx_json_extractor_binary_feed(je_stream_t *st, u_char *p, u_char *last)
+{
+    u_char  *buf;
+    size_t   n, size;
+
+    n = last - p;
+    st->offset += n;
+
+    if (0==n)
+        return NGX_AGAIN;
+
+    if (st->inplace && NULL==st->bin.data) {
+        st->bin.data = p;
+        st->bin.len = n;
+        return NGX_AGAIN;
+    }
+
+    if (st->bin.len + n > st->binsize) {
+        size = ngx_max(st->binsize * 2, st->bin.len + n);
+
+        buf = ngx_pnalloc(st->pool, size);
+        if (NULL==buf)
+            return NGX_ERROR;
+
+        if (st->bin.len>0)
+            ngx_memcpy(buf, st->bin.data, st->bin.len);
+
+        st->bin.data = buf;
+        st->binsize = size;
+    }
+
+    ngx_memcpy(st->bin.data + st->bin.len, p, n);
+    st->bin.len += n;
+
+    return NGX_AGAIN;
+}
+
+/**
+ * Walk the collected document
+ * @param st
+ * @return NGX_OK, NGX_DECLINED if the document is over the limits
+ *         or NGX_ERROR on invalid document
+ */
+ngx_int_t
+ngx_json_extractor_binary_finish(je_stream_t *st)
+{
+    je_bin_t  b;
+
+    if (0==st->bin.len)
+        return NGX_ERROR;
+
+    b.st = st;
+    b.last = st->bin.data + st->bin.len;
+    b.depth = 0;
+    b.tokens = 0;
+    b.limits = st->item->limits;
+    b.over = NULL;
+
+    if (NULL==je_bin_walk(&b, &st->item->root, st->bin.data)) {
+        if (NULL!=b.over)
+            return ngx_json_extractor_limits_over(st, b.over,
+                                                  b.pos - st->bin.data);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Walk one item, values of the trie nodes are set on the way
+ * @param b
+ * @param node - trie node of the item or NULL to skip it
+ * @param p - item start
+ * @return item end or NULL on invalid document
+ */
+static u_char *
+je_bin_walk(je_bin_t *b, je_node_t *node, u_char *p)
+{
+    u_char         *start, *end, *kstart;
+    u_char          kbuf[NGX_JSON_EXTRACTOR_REAL_LEN];
+    uint64_t        k;
+    ngx_str_t       s, key, *val;
+    ngx_uint_t      i, descend, indef;
+    je_node_t      *child, *children;
+    je_bin_head_t   h, kh;
+    je_bin_out_t    o;
+
+    if (++b->depth>JE_BIN_DEPTH)
+        return NULL;
+
+    start = p;
+    indef = 0;
+
+    do {
+        p = je_bin_head(b, p, &h);
+        if (NULL==p)
+            return NULL;
+    } while (je_bin_tag==h.type);
+
+    // Lengths are known ahead, long containers are not walked at all
+    if (NULL!=b->limits) {
+        if (b->limits->tokens && ++b->tokens>b->limits->tokens)
+            return je_bin_over(b, "tokens", start);
+
+        if (je_bin_array==h.type || je_bin_map==h.type) {
+            if (b->limits->depth && b->depth>b->limits->depth)
+                return je_bin_over(b, "depth", start);
+
+            if (b->limits->elements && h.n>b->limits->elements)
+                return je_bin_over(b, "elements", start);
+        }
+    }
+
+    val = NULL;
+    if (NULL!=node && node->slot>=0) {
+        val = &b->st->values[node->slot];
+        if (NULL!=val->data)
+            val = NULL;
+    }
+
+    descend = NULL!=node && node->children.nelts>0;
+    children = descend ? node->children.elts : NULL;
+
+    switch (h.type) {
+
+    case je_bin_array:
+        // Indexes from the end need the length of indefinite array
+        for (i=0 ; h.indef && descend && i<node->children.nelts ; i++) {
+            if (children[i].isindex && children[i].index<0) {
+                if (NULL==je_bin_count(b, p, &h.n))
+                    return NULL;
+                h.indef = 0;
+                indef = 1;
+                break;
+            }
+        }
+
+        for (k=0 ; h.indef || k<h.n ; k++) {
+            if (h.indef) {
+                if (p>=b->last)
+                    return NULL;
+                if (0xff==*p) {
+                    p++;
+                    break;
+                }
+                if (NULL!=b->limits && b->limits->elements
+                    && k>=b->limits->elements)
+                    return je_bin_over(b, "elements", start);
+            }
+
+            end = NULL;
+
+            for (i=0 ; descend && i<node->children.nelts ; i++) {
+                if (!children[i].any
+                    && !(children[i].isindex && children[i].index>=0
+                         && (uint64_t) children[i].index==k)
+                    && !(children[i].isindex && children[i].index<0
+                         && h.n - (uint64_t) -children[i].index==k))
+                    continue;
+
+                end = je_bin_walk(b, &children[i], p);
+                if (NULL==end)
+                    return NULL;
+            }
+
+            if (NULL==end) {
+                end = je_bin_walk(b, NULL, p);
+                if (NULL==end)
+                    return NULL;
+            }
+
+            p = end;
+
+            // Every selector is resolved, the tail is not needed
+            if (b->st->found==b->st->item->nslots)
+                goto done;
+        }
+
+        if (indef) {
+            if (p>=b->last || 0xff!=*p)
+                return NULL;
+            p++;
+        }
+        break;
+
+    case je_bin_map:
+        for (k=0 ; h.indef || k<h.n ; k++) {
+            if (h.indef) {
+                if (p>=b->last)
+                    return NULL;
+                if (0xff==*p) {
+                    p++;
+                    break;
+                }
+                if (NULL!=b->limits && b->limits->elements
+                    && k>=b->limits->elements)
+                    return je_bin_over(b, "elements", start);
+            }
+
+            kstart = p;
+            child = NULL;
+
+            do {
+                p = je_bin_head(b, p, &kh);
+                if (NULL==p)
+                    return NULL;
+            } while (je_bin_tag==kh.type);
+
+            // Other keys are counted by the walk
+            if ((je_bin_str==kh.type || je_bin_uint==kh.type
+                 || je_bin_nint==kh.type)
+                && NULL!=b->limits && b->limits->tokens
+                && ++b->tokens>b->limits->tokens)
+                return je_bin_over(b, "tokens", kstart);
+
+            // String and integer keys are matched, others are skipped
+            if (je_bin_str==kh.type) {
+                p = je_bin_string(b, p, &kh, descend ? &key : NULL);
+                if (NULL==p)
+                    return NULL;
+
+                if (descend)
+                    child = ngx_json_extractor_node_find(node, key.data,
+                                                         key.len);
+
+            } else if (je_bin_uint==kh.type || je_bin_nint==kh.type) {
+                if (descend)
+                    child = ngx_json_extractor_node_find(node, kbuf,
+                                je_bin_number(kbuf, &kh) - kbuf);
+
+            } else {
+                p = je_bin_walk(b, NULL, kstart);
+                if (NULL==p)
+                    return NULL;
+            }
+
+            p = je_bin_walk(b, child, p);
+            if (NULL==p)
+                return NULL;
+
+            if (b->st->found==b->st->item->nslots)
+                goto done;
+        }
+        break;
+
+    case je_bin_str:
+    case je_bin_bin:
+        p = je_bin_string(b, p, &h, NULL!=val ? &s : NULL);
+        if (NULL==p)
+            return NULL;
+        /* fall through */
+
+    default:
+        if (je_bin_break==h.type)
+            return NULL;
+
+        if (NULL!=val) {
+            if (NGX_OK!=je_bin_scalar(b, &h, &s, val))
+                return NULL;
+            b->st->found++;
+        }
+
+        b->depth--;
+        return p;
+    }
+
+    // Maps and arrays are written as JSON
+    if (NULL!=val) {
+        o.pos = NULL;
+        o.len = 0;
+
+        if (NULL==je_bin_json(b, start, &o))
+            return NULL;
+
+        val->data = ngx_pnalloc(b->st->pool, o.len);
+        if (NULL==val->data)
+            return NULL;
+
+        o.pos = val->data;
+        o.len = 0;
+
+        (void) je_bin_json(b, start, &o);
+
+        val->len = o.len;
+        b->st->found++;
+    }
+
+done:
+
+    b->depth--;
+    return p;
+}
+
+/**
+ * Count elements of CBOR indefinite array
+ * @param b
+ * @param p - first element
+ * @param n - elements count
+ * @return the break byte or NULL on invalid document
+ */
+static u_char *
+je_bin_count(je_bin_t *b, u_char *p, uint64_t *n)
+{
+    ngx_uint_t  tokens;
+
+    // Elements are walked again after counting
+    tokens = b->tokens;
+
+    for (*n=0 ; ; (*n)++) {
+        if (p>=b->last)
+            return NULL;
+        if (0xff==*p)
+            break;
+        if (NULL!=b->limits && b->limits->elements
+            && *n>=b->limits->elements)
+            return je_bin_over(b, "elements", p);
+        p = je_bin_walk(b, NULL, p);
+        if (NULL==p)
+            return NULL;
+    }
+
+    b->tokens = tokens;
+    return p;
+}
+
+/**
+ * Stop the walk on exceeded limit
+ * @param b
+ * @param limit - name of the limit
+ * @param p - item over the limit
+ * @return NULL
+ */
+static u_char *
+je_bin_over(je_bin_t *b, char *limit, u_char *p)
+{
+    b->over = limit;
+    b->pos = p;
+    return NULL;
+}
+
+static u_char *
+je_bin_head(je_bin_t *b, u_char *p, je_bin_head_t *h)
+{
+    if (p>=b->last)
+        return NULL;
+
+    h->n = 0;
+    h->indef = 0;
+
+    if (NGX_JSON_EXTRACTOR_FORMAT_CBOR==b->st->item->format)
+        return je_cbor_head(b, p, h);
+
+    return je_msgpack_head(b, p, h);
+}
+
+/**
+ * Read MessagePack item head, payload of strings is not read
+ * @param b
+ * @param p
+ * @param h
+ * @return position after the head or NULL
+ */
+static u_char *
+je_msgpack_head(je_bin_t *b, u_char *p, je_bin_head_t *h)
+{
+    u_char      c;
+    float       r;
+    uint32_t    f;
+    uint64_t    v;
+    ngx_uint_t  n;
+
+    c = *p++;
+
+    if (c<=0x7f) {
+        h->type = je_bin_uint;
+        h->n = c;
+        return p;
+    }
+
+    if (c>=0xe0) {
+        h->type = je_bin_nint;
+        h->n = 0xff - c;
+        return p;
+    }
+
+    if (c<=0x8f || (c>=0xde && c<=0xdf)) {
+        h->type = je_bin_map;
+    } else if (c<=0x9f || (c>=0xdc && c<=0xdd)) {
+        h->type = je_bin_array;
+    } else if (c<=0xbf || (c>=0xd9 && c<=0xdb)) {
+        h->type = je_bin_str;
+    } else {
+        h->type = je_bin_bin;
+    }
+
+    // Fixed sizes are in the first byte
+    if (c<=0xbf) {
+        h->n = c & (c<=0x9f ? 0x0f : 0x1f);
+        return p;
+    }
+
+    switch (c) {
+    case 0xc0: h->type = je_bin_nil;   return p;
+    case 0xc2: h->type = je_bin_false; return p;
+    case 0xc3: h->type = je_bin_true;  return p;
+
+    case 0xc4: case 0xd9: n = 1; break;
+    case 0xc5: case 0xda: case 0xdc: case 0xde: n = 2; break;
+    case 0xc6: case 0xdb: case 0xdd: case 0xdf: n = 4; break;
+
+    // Extension is type byte and data, it is returned as binary
+    case 0xc7: case 0xc8: case 0xc9:
+        n = 1 << (c - 0xc7);
+        if (b->last - p<(ssize_t) n + 1)
+            return NULL;
+        h->n = je_bin_be(p, n);
+        return p + n + 1;
+
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+        if (p>=b->last)
+            return NULL;
+        h->n = 1 << (c - 0xd4);
+        return p + 1;
+
+    case 0xca:
+        if (b->last - p<4)
+            return NULL;
+        f = (uint32_t) je_bin_be(p, 4);
+        h->type = je_bin_real;
+        ngx_memcpy(&r, &f, 4);
+        h->d = r;
+        return p + 4;
+
+    case 0xcb:
+        if (b->last - p<8)
+            return NULL;
+        v = je_bin_be(p, 8);
+        h->type = je_bin_real;
+        ngx_memcpy(&h->d, &v, 8);
+        return p + 8;
+
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        n = 1 << (c - 0xcc);
+        if (b->last - p<(ssize_t) n)
+            return NULL;
+        h->type = je_bin_uint;
+        h->n = je_bin_be(p, n);
+        return p + n;
+
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+        n = 1 << (c - 0xd0);
+        if (b->last - p<(ssize_t) n)
+            return NULL;
+
+        // Sign is extended from the top bit of the value
+        v = je_bin_be(p, n);
+        if (n<8 && (v >> (n * 8 - 1)))
+            v |= ~(uint64_t) 0 << (n * 8);
+
+        if ((int64_t) v<0) {
+            h->type = je_bin_nint;
+            h->n = ~v;
+        } else {
+            h->type = je_bin_uint;
+            h->n = v;
+        }
+        return p + n;
+
+    default:
+        return NULL;
+    }
+
+    if (b->last - p<(ssize_t) n)
+        return NULL;
+
+    h->n = je_bin_be(p, n);
+    return p + n;
+}
+
+/**
+ * Read CBOR item head, payload of strings is not read
+ * @param b
+ * @param p
+ * @param h
+ * @return position after the head or NULL
+ */
+static u_char *
+je_cbor_head(je_bin_t *b, u_char *p, je_bin_head_t *h)
+{
+    u_char      c, major, ai;
+    float       r;
+    uint32_t    f;
+    uint64_t    v;
+    ngx_uint_t  n;
+
+    static ngx_uint_t  types[] = {
+        je_bin_uint, je_bin_nint, je_bin_bin, je_bin_str,
+        je_bin_array, je_bin_map, je_bin_tag
+    };
+
+    c = *p++;
+    major = c >> 5;
+    ai = c & 0x1f;
+
+    if (ai<24) {
+        v = ai;
+        n = 0;
+    } else if (ai<=27) {
+        n = 1 << (ai - 24);
+        if (b->last - p<(ssize_t) n)
+            return NULL;
+        v = je_bin_be(p, n);
+    } else if (31==ai) {
+        v = 0;
+        n = 0;
+    } else {
+        return NULL;
+    }
+
+    p += n;
+
+    if (7!=major) {
+        if (31==ai) {
+            if (major<2 || 6==major)
+                return NULL;
+            h->indef = 1;
+        }
+
+        h->type = types[major];
+        h->n = v;
+        return p;
+    }
+
+    switch (ai) {
+    case 20: h->type = je_bin_false; break;
+    case 21: h->type = je_bin_true;  break;
+    case 25: h->type = je_bin_real; h->d = je_bin_half((uint16_t) v); break;
+
+    case 26:
+        f = (uint32_t) v;
+        h->type = je_bin_real;
+        ngx_memcpy(&r, &f, 4);
+        h->d = r;
+        break;
+
+    case 27:
+        h->type = je_bin_real;
+        ngx_memcpy(&h->d, &v, 8);
+        break;
+
+    case 31: h->type = je_bin_break; break;
+
+    // Undefined and other simple values
+    default: h->type = je_bin_nil;
+    }
+
+    return p;
+}
+
+/**
+ * Read payload of the string, chunks of CBOR indefinite string are
+ * joined in the pool
+ * @param b
+ * @param p - position after the head
+ * @param h
+ * @param s - string or NULL to skip it
+ * @return position after the string or NULL
+ */
+static u_char *
+je_bin_string(je_bin_t *b, u_char *p, je_bin_head_t *h, ngx_str_t *s)
+{
+    u_char         *q, *d;
+    size_t          len;
+    je_bin_head_t   ch;
+
+    if (!h->indef) {
+        if ((uint64_t) (b->last - p)<h->n)
+            return NULL;
+
+        if (NULL!=s) {
+            s->data = p;
+            s->len = (size_t) h->n;
+        }
+        return p + h->n;
+    }
+
+    // Chunks are counted first
+    for (q=p, len=0 ; ; len+=ch.n, q+=ch.n) {
+        if (q>=b->last)
+            return NULL;
+
+        if (0xff==*q)
+            break;
+
+        q = je_bin_head(b, q, &ch);
+        if (NULL==q || ch.type!=h->type || ch.indef
+            || (uint64_t) (b->last - q)<ch.n)
+            return NULL;
+    }
+
+    if (NULL==s)
+        return q + 1;
+
+    d = ngx_pnalloc(b->st->pool, len + 1);
+    if (NULL==d)
+        return NULL;
+
+    s->data = d;
+    s->len = len;
+
+    for ( ; 0xff!=*p ; p+=ch.n) {
+        p = je_bin_head(b, p, &ch);
+        d = ngx_cpymem(d, p, (size_t) ch.n);
+    }
+
+    return p + 1;
+}
+
+/**
+ * Convert scalar item to the variable value
+ * @param b
+ * @param h
+ * @param s - payload of the string
+ * @param val
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_bin_scalar(je_bin_t *b, je_bin_head_t *h, ngx_str_t *s, ngx_str_t *val)
+{
+    u_char  *p;
+
+    switch (h->type) {
+    case je_bin_true:
+        ngx_str_set(val, "1");
+        return NGX_OK;
+
+    case je_bin_false:
+        ngx_str_set(val, "0");
+        return NGX_OK;
+
+    case je_bin_str:
+    case je_bin_bin:
+        *val = *s;
+        return NGX_OK;
+
+    case je_bin_uint:
+    case je_bin_nint:
+    case je_bin_real:
+        p = ngx_pnalloc(b->st->pool, NGX_JSON_EXTRACTOR_REAL_LEN);
+        if (NULL==p)
+            return NGX_ERROR;
+
+        val->data = p;
+        p = je_bin_number(p, h);
+
+        // NaN and infinity have no JSON form
+        if (NULL==p) {
+            ngx_str_set(val, "");
+            return NGX_OK;
+        }
+
+        val->len = p - val->data;
+        return NGX_OK;
+
+    default:
+        ngx_str_set(val, "");
+        return NGX_OK;
+    }
+}
+
+/**
+ * Format number item
+ * @param buf - NGX_JSON_EXTRACTOR_REAL_LEN bytes
+ * @param h
+ * @return end of the number or NULL for NaN and infinity
+ */
+static u_char *
+je_bin_number(u_char *buf, je_bin_head_t *h)
+{
+    if (je_bin_real==h->type)
+        return ngx_json_extractor_dtoa(buf, h->d);
+
+    if (je_bin_uint==h->type)
+        return ngx_sprintf(buf, "%uL", h->n);
+
+    // -1 - n does not fit into int64 for the largest CBOR n
+    if (h->n==~(uint64_t) 0)
+        return ngx_cpymem(buf, "-18446744073709551616",
+                          sizeof("-18446744073709551616") - 1);
+
+    return ngx_sprintf(buf, "-%uL", h->n + 1);
+}
+
+/**
+ * Write item as JSON text
+ * @param b
+ * @param p - item start
+ * @param o
+ * @return item end or NULL
+ */
+static u_char *
+je_bin_json(je_bin_t *b, u_char *p, je_bin_out_t *o)
+{
+    u_char         *e, buf[NGX_JSON_EXTRACTOR_REAL_LEN];
+    uint64_t        k;
+    ngx_str_t       s, enc;
+    je_bin_head_t   h, kh;
+
+    do {
+        p = je_bin_head(b, p, &h);
+        if (NULL==p)
+            return NULL;
+    } while (je_bin_tag==h.type);
+
+    switch (h.type) {
+    case je_bin_nil:
+        je_bin_out(o, (u_char *) "null", 4);
+        return p;
+
+    case je_bin_true:
+        je_bin_out(o, (u_char *) "true", 4);
+        return p;
+
+    case je_bin_false:
+        je_bin_out(o, (u_char *) "false", 5);
+        return p;
+
+    case je_bin_uint:
+    case je_bin_nint:
+    case je_bin_real:
+        e = je_bin_number(buf, &h);
+        if (NULL==e)
+            je_bin_out(o, (u_char *) "null", 4);
+        else
+            je_bin_out(o, buf, e - buf);
+        return p;
+
+    case je_bin_str:
+        p = je_bin_string(b, p, &h, &s);
+        if (NULL!=p)
+            je_bin_out_str(o, &s);
+        return p;
+
+    // JSON has no binary strings, they are written in base64
+    case je_bin_bin:
+        p = je_bin_string(b, p, &h, &s);
+        if (NULL==p)
+            return NULL;
+
+        je_bin_out(o, (u_char *) "\"", 1);
+
+        if (NULL!=o->pos) {
+            enc.data = o->pos;
+            ngx_encode_base64(&enc, &s);
+            o->pos += enc.len;
+        }
+        o->len += ngx_base64_encoded_length(s.len);
+
+        je_bin_out(o, (u_char *) "\"", 1);
+        return p;
+
+    case je_bin_array:
+    case je_bin_map:
+        je_bin_out(o, (u_char *) (je_bin_map==h.type ? "{" : "["), 1);
+
+        for (k=0 ; h.indef || k<h.n ; k++) {
+            if (h.indef) {
+                if (p>=b->last)
+                    return NULL;
+                if (0xff==*p) {
+                    p++;
+                    break;
+                }
+            }
+
+            if (k>0)
+                je_bin_out(o, (u_char *) ",", 1);
+
+            // Keys are strings in JSON, integer keys are quoted
+            if (je_bin_map==h.type) {
+                e = p;
+                do {
+                    e = je_bin_head(b, e, &kh);
+                    if (NULL==e)
+                        return NULL;
+                } while (je_bin_tag==kh.type);
+
+                if (je_bin_uint==kh.type || je_bin_nint==kh.type) {
+                    je_bin_out(o, (u_char *) "\"", 1);
+                    je_bin_out(o, buf, je_bin_number(buf, &kh) - buf);
+                    je_bin_out(o, (u_char *) "\"", 1);
+                    p = e;
+
+                } else if (je_bin_str==kh.type) {
+                    p = je_bin_json(b, p, o);
+
+                } else {
+                    return NULL;
+                }
+
+            } else {
+                p = je_bin_json(b, p, o);
+            }
+
+            if (NULL==p)
+                return NULL;
+
+            if (je_bin_map==h.type) {
+                je_bin_out(o, (u_char *) ":", 1);
+
+                p = je_bin_json(b, p, o);
+                if (NULL==p)
+                    return NULL;
+            }
+        }
+
+        je_bin_out(o, (u_char *) (je_bin_map==h.type ? "}" : "]"), 1);
+        return p;
+
+    default:
+        return NULL;
+    }
+}
+
+static void
+je_bin_out(je_bin_out_t *o, u_char *s, size_t len)
+{
+    if (NULL!=o->pos)
+        o->pos = ngx_cpymem(o->pos, s, len);
+
+    o->len += len;
+}
+
+/**
+ * Write JSON string with escapes
+ * @param o
+ * @param s
+ */
+static void
+je_bin_out_str(je_bin_out_t *o, ngx_str_t *s)
+{
+    u_char       *p, *last, esc[6];
+    size_t        n;
+
+    static u_char  hex[] = "0123456789abcdef";
+
+    je_bin_out(o, (u_char *) "\"", 1);
+
+    for (p=s->data, last=p + s->len ; p<last ; p++) {
+        if ('"'!=*p && '\\'!=*p && *p>=0x20) {
+            je_bin_out(o, p, 1);
+            continue;
+        }
+
+        esc[0] = '\\';
+        n = 2;
+
+        switch (*p) {
+        case '"':  esc[1] = '"';  break;
+        case '\\': esc[1] = '\\'; break;
+        case '\b': esc[1] = 'b';  break;
+        case '\f': esc[1] = 'f';  break;
+        case '\n': esc[1] = 'n';  break;
+        case '\r': esc[1] = 'r';  break;
+        case '\t': esc[1] = 't';  break;
+        default:
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[*p >> 4];
+            esc[5] = hex[*p & 0xf];
+            n = 6;
+        }
+
+        je_bin_out(o, esc, n);
+    }
+
+    je_bin_out(o, (u_char *) "\"", 1);
+}
+
+/**
+ * Read big endian unsigned number
+ * @param p
+ * @param n - 1, 2, 4 or 8 bytes
+ * @return value
+ */
+static uint64_t
+je_bin_be(u_char *p, ngx_uint_t n)
+{
+    uint64_t  v;
+
+    for (v=0 ; n>0 ; n--)
+        v = v << 8 | *p++;
+
+    return v;
+}
+
+/**
+ * Convert IEEE 754 half precision number
+ * @param h
+ * @return value
+ */
+static double
+je_bin_half(uint16_t h)
+{
+    double      d;
+    ngx_uint_t  exp, mant;
+
+    exp = (h >> 10) & 0x1f;
+    mant = h & 0x3ff;
+
+    if (0==exp) {
+        d = mant / 16777216.0;
+    } else if (31!=exp) {
+        d = (mant + 1024) * (double) (1 << exp) / 33554432.0;
+    } else {
+        d = 0==mant ? 1.0 / 0.0 : 0.0 / 0.0;
+    }
+
+    return (h & 0x8000) ? -d : d;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
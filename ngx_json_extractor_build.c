@@ -0,0 +1,662 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Documents of json_build.
+ *
+ * The block is compiled into a flat program: text ops keep punctuation,
+ * escaped keys and constant values, value ops keep a complex value and
+ * its type. The first pass evaluates values and sums the length, the
+ * second one writes the document into one pool buffer. Only string
+ * values are escaped, numbers, booleans and JSON values are copied
+ * when their grammar is checked, invalid ones are written as null.
+ */
+
+#define JE_BUILD_TEXT       0
+#define JE_BUILD_STRING     1
+#define JE_BUILD_NUMBER     2
+#define JE_BUILD_BOOL       3
+#define JE_BUILD_JSON       4
+#define JE_BUILD_OBJECT     5                   // Config tree only
+
+#define JE_BUILD_NEST       64                  // Levels of JSON values on stack
+
+typedef struct {
+    ngx_uint_t                  type;
+    ngx_str_t                   text;           // JE_BUILD_TEXT
+    ngx_http_complex_value_t   *value;
+} je_build_op_t;
+
+struct je_build_s {
+    ngx_array_t                 ops;            // je_build_op_t
+    ngx_uint_t                  nvalues;
+};
+
+typedef struct je_build_node_s je_build_node_t;
+
+struct je_build_node_s {
+    ngx_str_t                   key;            // Escaped
+    ngx_uint_t                  type;
+    ngx_array_t                 children;       // je_build_node_t, objects
+    ngx_http_complex_value_t   *value;
+};
+
+typedef struct {
+    je_build_t                 *build;
+    je_build_node_t             root;
+    ngx_array_t                 text;           // u_char, pending text op
+} je_build_conf_t;
+
+static ngx_conf_enum_t je_build_types[] = {
+    { ngx_string("string"), JE_BUILD_STRING },
+    { ngx_string("number"), JE_BUILD_NUMBER },
+    { ngx_string("bool"),   JE_BUILD_BOOL },
+    { ngx_string("json"),   JE_BUILD_JSON },
+    { ngx_null_string, 0 }
+};
+
+static char *je_build_conf(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
+static je_build_node_t *je_build_child(ngx_pool_t *pool,
+    je_build_node_t *node, ngx_str_t *key);
+static ngx_int_t je_build_compile(je_build_conf_t *bc, ngx_pool_t *pool,
+    je_build_node_t *node);
+static ngx_int_t je_build_text(je_build_conf_t *bc, u_char *p, size_t len);
+static ngx_int_t je_build_flush(je_build_conf_t *bc, ngx_pool_t *pool);
+static ngx_int_t je_build_value(ngx_pool_t *pool, ngx_uint_t type,
+    ngx_str_t *val);
+static size_t je_build_len(ngx_uint_t type, ngx_str_t *val);
+static u_char *je_build_write(u_char *p, ngx_uint_t type, ngx_str_t *val);
+static ngx_int_t je_build_is_json(ngx_pool_t *pool, u_char *p, u_char *last);
+
+/**
+ * Compile json_build block, "key $value [type];" lines, nested keys
+ * are separated by "__"
+ * @param cf - arguments of json_build, block follows
+ * @return program or NULL
+ */
+je_build_t *
+ngx_json_extractor_build_block(ngx_conf_t *cf)
+{
+    char              *rv;
+    ngx_conf_t         save;
+    je_build_conf_t    bc;
+
+    ngx_memzero(&bc, sizeof(je_build_conf_t));
+    bc.root.type = JE_BUILD_OBJECT;
+
+    bc.build = ngx_pcalloc(cf->pool, sizeof(je_build_t));
+    if (NULL==bc.build)
+        return NULL;
+
+    if (NGX_OK!=ngx_array_init(&bc.build->ops, cf->pool, 4,
+                               sizeof(je_build_op_t))
+        || NGX_OK!=ngx_array_init(&bc.root.children, cf->temp_pool, 4,
+                                  sizeof(je_build_node_t))
+        || NGX_OK!=ngx_array_init(&bc.text, cf->temp_pool, 64,
+                                  sizeof(u_char)))
+        return NULL;
+
+    save = *cf;
+    cf->handler = je_build_conf;
+    cf->handler_conf = (char *) &bc;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (NGX_CONF_OK!=rv)
+        return NULL;
+
+    if (NGX_OK!=je_build_compile(&bc, cf->pool, &bc.root)
+        || NGX_OK!=je_build_flush(&bc, cf->pool))
+        return NULL;
+
+    return bc.build;
+}
+
+/**
+ * Write document of the request
+ * @param r
+ * @param b
+ * @param out - document in the request pool
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_build(ngx_http_request_t *r, je_build_t *b, ngx_str_t *out)
+{
+    u_char          *p;
+    size_t           len;
+    ngx_uint_t       i, k;
+    ngx_str_t       *vals;
+    je_build_op_t   *ops;
+
+    ops = b->ops.elts;
+
+    vals = ngx_palloc(r->pool, (b->nvalues + 1) * sizeof(ngx_str_t));
+    if (NULL==vals)
+        return NGX_ERROR;
+
+    // Sizes, values are normalized to what is written
+    for (i=0, k=0, len=0 ; i<b->ops.nelts ; i++) {
+        if (JE_BUILD_TEXT==ops[i].type) {
+            len += ops[i].text.len;
+            continue;
+        }
+
+        if (NGX_OK!=ngx_http_complex_value(r, ops[i].value, &vals[k]))
+            return NGX_ERROR;
+
+        if (NGX_OK!=je_build_value(r->pool, ops[i].type, &vals[k]))
+            return NGX_ERROR;
+
+        len += je_build_len(ops[i].type, &vals[k]);
+        k++;
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+    if (NULL==p)
+        return NGX_ERROR;
+
+    out->data = p;
+    out->len = len;
+
+    for (i=0, k=0 ; i<b->ops.nelts ; i++) {
+        if (JE_BUILD_TEXT==ops[i].type) {
+            p = ngx_cpymem(p, ops[i].text.data, ops[i].text.len);
+        } else {
+            p = je_build_write(p, ops[i].type, &vals[k++]);
+        }
+    }
+
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Add one line of the block to the tree
+ * @param cf - "key value [type]"
+ * @param dummy
+ * @param conf - je_build_conf_t
+ * @return nginx state
+ */
+static char *
+je_build_conf(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    u_char                             *p, *start, *last;
+    ngx_str_t                          *value, key;
+    ngx_uint_t                          type;
+    ngx_conf_enum_t                    *e;
+    je_build_node_t                    *node;
+    je_build_conf_t                    *bc = conf;
+    ngx_http_compile_complex_value_t    ccv;
+
+    value = cf->args->elts;
+
+    if (2!=cf->args->nelts && 3!=cf->args->nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid json_build line: [%V]", &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    type = JE_BUILD_STRING;
+
+    if (3==cf->args->nelts) {
+        for (e=je_build_types ; e->name.len ; e++) {
+            if (e->name.len==value[2].len
+                && 0==ngx_strncmp(e->name.data, value[2].data, value[2].len))
+                break;
+        }
+
+        if (0==e->name.len) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Invalid json_build type: [%V]", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        type = e->value;
+    }
+
+    // Objects of the key prefix are created on the way
+    node = &bc->root;
+    last = value[0].data + value[0].len;
+
+    for (start=p=value[0].data ; ; p++) {
+        if (p<last && (p+1==last || '_'!=p[0] || '_'!=p[1]))
+            continue;
+
+        key.data = start;
+        key.len = p - start;
+
+        if (0==key.len || JE_BUILD_OBJECT!=node->type) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Invalid json_build key: [%V]", &value[0]);
+            return NGX_CONF_ERROR;
+        }
+
+        node = je_build_child(cf->temp_pool, node, &key);
+        if (NULL==node)
+            return NGX_CONF_ERROR;
+
+        if (p==last)
+            break;
+
+        if (0==node->type) {
+            node->type = JE_BUILD_OBJECT;
+            if (NGX_OK!=ngx_array_init(&node->children, cf->temp_pool, 2,
+                                       sizeof(je_build_node_t)))
+                return NGX_CONF_ERROR;
+        }
+
+        start = ++p + 1;
+    }
+
+    if (0!=node->type) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Duplicate json_build key: [%V]", &value[0]);
+        return NGX_CONF_ERROR;
+    }
+
+    node->type = type;
+    node->value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (NULL==node->value)
+        return NGX_CONF_ERROR;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = node->value;
+
+    if (NGX_OK!=ngx_http_compile_complex_value(&ccv))
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Find child of the object, it is added with type 0 if not found
+ * @param pool
+ * @param node
+ * @param key - unescaped key
+ * @return child or NULL
+ */
+static je_build_node_t *
+je_build_child(ngx_pool_t *pool, je_build_node_t *node, ngx_str_t *key)
+{
+    ngx_str_t         esc;
+    ngx_uint_t        i;
+    je_build_node_t  *child;
+
+    esc.len = key->len + ngx_escape_json(NULL, key->data, key->len);
+    esc.data = ngx_pnalloc(pool, esc.len);
+    if (NULL==esc.data)
+        return NULL;
+
+    ngx_escape_json(esc.data, key->data, key->len);
+
+    child = node->children.elts;
+    for (i=0 ; i<node->children.nelts ; i++) {
+        if (child[i].key.len==esc.len
+            && 0==ngx_memcmp(child[i].key.data, esc.data, esc.len))
+            return &child[i];
+    }
+
+    child = ngx_array_push(&node->children);
+    if (NULL==child)
+        return NULL;
+
+    ngx_memzero(child, sizeof(je_build_node_t));
+    child->key = esc;
+
+    return child;
+}
+
+/**
+ * Flatten the object into program ops, constants become text
+ * @param bc
+ * @param pool
+ * @param node - object
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_build_compile(je_build_conf_t *bc, ngx_pool_t *pool, je_build_node_t *node)
+{
+    u_char           *p;
+    size_t            len;
+    ngx_str_t         val;
+    ngx_uint_t        i;
+    je_build_op_t    *op;
+    je_build_node_t  *child;
+
+    if (NGX_OK!=je_build_text(bc, (u_char *) "{", 1))
+        return NGX_ERROR;
+
+    child = node->children.elts;
+
+    for (i=0 ; i<node->children.nelts ; i++) {
+        if ((i>0 && NGX_OK!=je_build_text(bc, (u_char *) ",", 1))
+            || NGX_OK!=je_build_text(bc, (u_char *) "\"", 1)
+            || NGX_OK!=je_build_text(bc, child[i].key.data, child[i].key.len)
+            || NGX_OK!=je_build_text(bc, (u_char *) "\":", 2))
+            return NGX_ERROR;
+
+        if (JE_BUILD_OBJECT==child[i].type) {
+            if (NGX_OK!=je_build_compile(bc, pool, &child[i]))
+                return NGX_ERROR;
+            continue;
+        }
+
+        // Constant is written once
+        if (NULL==child[i].value->lengths) {
+            val = child[i].value->value;
+            if (NGX_OK!=je_build_value(pool, child[i].type, &val))
+                return NGX_ERROR;
+
+            len = je_build_len(child[i].type, &val);
+
+            p = ngx_pnalloc(pool, len);
+            if (NULL==p)
+                return NGX_ERROR;
+
+            je_build_write(p, child[i].type, &val);
+
+            if (NGX_OK!=je_build_text(bc, p, len))
+                return NGX_ERROR;
+            continue;
+        }
+
+        if (NGX_OK!=je_build_flush(bc, pool))
+            return NGX_ERROR;
+
+        op = ngx_array_push(&bc->build->ops);
+        if (NULL==op)
+            return NGX_ERROR;
+
+        op->type = child[i].type;
+        op->value = child[i].value;
+        ngx_str_null(&op->text);
+
+        bc->build->nvalues++;
+    }
+
+    return je_build_text(bc, (u_char *) "}", 1);
+}
+
+/**
+ * Append text to the pending text op
+ * @param bc
+ * @param p
+ * @param len
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_build_text(je_build_conf_t *bc, u_char *p, size_t len)
+{
+    u_char *dst;
+
+    if (0==len)
+        return NGX_OK;
+
+    dst = ngx_array_push_n(&bc->text, len);
+    if (NULL==dst)
+        return NGX_ERROR;
+
+    ngx_memcpy(dst, p, len);
+    return NGX_OK;
+}
+
+/**
+ * Move pending text into the program
+ * @param bc
+ * @param pool
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_build_flush(je_build_conf_t *bc, ngx_pool_t *pool)
+{
+    je_build_op_t *op;
+
+    if (0==bc->text.nelts)
+        return NGX_OK;
+
+    op = ngx_array_push(&bc->build->ops);
+    if (NULL==op)
+        return NGX_ERROR;
+
+    op->type = JE_BUILD_TEXT;
+    op->value = NULL;
+    op->text.len = bc->text.nelts;
+    op->text.data = ngx_pnalloc(pool, op->text.len);
+    if (NULL==op->text.data)
+        return NGX_ERROR;
+
+    ngx_memcpy(op->text.data, bc->text.elts, op->text.len);
+    bc->text.nelts = 0;
+
+    return NGX_OK;
+}
+
+/**
+ * Replace value by the literal of its type if it is written as is
+ * @param pool
+ * @param type
+ * @param val
+ * @return NGX_OK or NGX_ERROR
+ */
+static ngx_int_t
+je_build_value(ngx_pool_t *pool, ngx_uint_t type, ngx_str_t *val)
+{
+    ngx_int_t rc;
+
+    switch (type) {
+
+    // Extracted booleans are "1" and "0"
+    case JE_BUILD_BOOL:
+        if (0==val->len
+            || (1==val->len && '0'==val->data[0])
+            || (5==val->len && 0==ngx_strncmp(val->data, "false", 5)))
+        {
+            ngx_str_set(val, "false");
+        } else {
+            ngx_str_set(val, "true");
+        }
+        break;
+
+    case JE_BUILD_NUMBER:
+        if (0==val->len || val->data + val->len
+            !=ngx_json_extractor_number(val->data, val->data + val->len))
+        {
+            ngx_str_set(val, "null");
+        }
+        break;
+
+    // Extracted objects and arrays are JSON already, any other value
+    // could break out of its place in the document
+    case JE_BUILD_JSON:
+        rc = je_build_is_json(pool, val->data, val->data + val->len);
+        if (NGX_ERROR==rc)
+            return NGX_ERROR;
+
+        if (NGX_DECLINED==rc) {
+            ngx_str_set(val, "null");
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Length of the written value
+ * @param type
+ * @param val
+ * @return bytes
+ */
+static size_t
+je_build_len(ngx_uint_t type, ngx_str_t *val)
+{
+    if (JE_BUILD_STRING==type)
+        return val->len + 2 + ngx_escape_json(NULL, val->data, val->len);
+
+    return val->len;
+}
+
+/**
+ * Write value
+ * @param p
+ * @param type
+ * @param val
+ * @return end of the written value
+ */
+static u_char *
+je_build_write(u_char *p, ngx_uint_t type, ngx_str_t *val)
+{
+    if (JE_BUILD_STRING!=type)
+        return ngx_cpymem(p, val->data, val->len);
+
+    *p++ = '"';
+    p = (u_char *) ngx_escape_json(p, val->data, val->len);
+    *p++ = '"';
+
+    return p;
+}
+
+/**
+ * Check JSON value grammar, the same one the tape parser accepts
+ * @param pool - for the nesting of deep values
+ * @param p
+ * @param last
+ * @return NGX_OK, NGX_DECLINED for invalid value or NGX_ERROR
+ */
+static ngx_int_t
+je_build_is_json(ngx_pool_t *pool, u_char *p, u_char *last)
+{
+    u_char      *close, buf[JE_BUILD_NEST];
+    size_t       n;
+    ngx_uint_t   esc;
+
+    // Every level is opened by one byte at least
+    close = buf;
+    if ((size_t) (last - p)>JE_BUILD_NEST) {
+        close = ngx_pnalloc(pool, last - p);
+        if (NULL==close)
+            return NGX_ERROR;
+    }
+
+    n = 0;
+
+value:
+
+    p = ngx_json_extractor_space(p, last);
+    if (p==last)
+        return NGX_DECLINED;
+
+    switch (*p) {
+
+    case '{':
+    case '[':
+        close[n++] = '{'==*p ? '}' : ']';
+
+        p = ngx_json_extractor_space(p + 1, last);
+        if (p<last && close[n-1]==*p) {
+            p++;
+            n--;
+            goto after;
+        }
+
+        if (']'==close[n-1])
+            goto value;
+
+        goto key;
+
+    case '"':
+        p = ngx_json_extractor_string(p + 1, last, &esc);
+        if (NULL==p)
+            return NGX_DECLINED;
+        goto after;
+
+    case 't':
+    case 'n':
+        if (last - p<4
+            || 0!=ngx_strncmp(p, ('t'==*p ? "true" : "null"), 4))
+            return NGX_DECLINED;
+        p += 4;
+        goto after;
+
+    case 'f':
+        if (last - p<5 || 0!=ngx_strncmp(p, "false", 5))
+            return NGX_DECLINED;
+        p += 5;
+        goto after;
+
+    default:
+        p = ngx_json_extractor_number(p, last);
+        if (NULL==p)
+            return NGX_DECLINED;
+        goto after;
+    }
+
+key:
+
+    if (p==last || '"'!=*p)
+        return NGX_DECLINED;
+
+    p = ngx_json_extractor_string(p + 1, last, &esc);
+    if (NULL==p)
+        return NGX_DECLINED;
+
+    p = ngx_json_extractor_space(p, last);
+    if (p==last || ':'!=*p)
+        return NGX_DECLINED;
+
+    p++;
+    goto value;
+
+after:
+
+    p = ngx_json_extractor_space(p, last);
+
+    // Nothing may follow the value
+    if (0==n)
+        return p==last ? NGX_OK : NGX_DECLINED;
+
+    if (p==last)
+        return NGX_DECLINED;
+
+    if (','==*p) {
+        p = ngx_json_extractor_space(p + 1, last);
+        if (']'==close[n-1])
+            goto value;
+        goto key;
+    }
+
+    if (close[n-1]!=*p)
+        return NGX_DECLINED;
+
+    p++;
+    n--;
+    goto after;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
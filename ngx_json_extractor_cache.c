@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Shared cache of extracted values.
+ *
+ * Entry is keyed by the hash of the source and of the selector set, it
+ * keeps the source to exclude collisions and the values of all slots.
+ * Lookups hold the zone lock only to find and copy the entry, stores
+ * and evictions are skipped when the lock is busy.
+ */
+
+#define JE_CACHE_ABSENT  0xffffffff         // Value is not found
+#define JE_CACHE_EVICT   16                 // Evicted entries per store
+
+typedef struct {
+    ngx_rbtree_node_t   node;
+    ngx_queue_t         queue;
+    uint64_t            hash;
+    time_t              expire;
+    uint32_t            slen;
+    uint32_t            nslots;
+    uint32_t            vlen[1];            // nslots lengths, source, values
+} je_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t        rbtree;
+    ngx_rbtree_node_t   sentinel;
+    ngx_queue_t         lru;
+    ngx_atomic_t        hits;
+    ngx_atomic_t        misses;
+} je_cache_sh_t;
+
+struct je_cache_s {
+    je_cache_sh_t      *sh;
+    ngx_slab_pool_t    *shpool;
+};
+
+static ngx_int_t je_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static je_cache_node_t *je_cache_lookup(je_cache_t *cache, uint64_t hash);
+static void je_cache_delete(je_cache_t *cache, je_cache_node_t *cn);
+
+/**
+ * MurmurHash64A of the source
+ * @param p
+ * @param len
+ * @param seed
+ * @return hash
+ */
+uint64_t
+ngx_json_extractor_hash(u_char *p, size_t len, uint64_t seed)
+{
+    uint64_t  h, k;
+    u_char   *last;
+
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+
+    h = seed ^ (len * m);
+
+    for (last=p + (len & ~(size_t) 7) ; p<last ; p+=8) {
+        ngx_memcpy(&k, p, 8);
+
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t) p[6] << 48;
+    /* fall through */
+    case 6: h ^= (uint64_t) p[5] << 40;
+    /* fall through */
+    case 5: h ^= (uint64_t) p[4] << 32;
+    /* fall through */
+    case 4: h ^= (uint64_t) p[3] << 24;
+    /* fall through */
+    case 3: h ^= (uint64_t) p[2] << 16;
+    /* fall through */
+    case 2: h ^= (uint64_t) p[1] << 8;
+    /* fall through */
+    case 1: h ^= (uint64_t) p[0];
+            h *= m;
+    }
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+
+    return h;
+}
+
+/**
+ * Add cache zone
+ * @param cf
+ * @param name
+ * @param size - 0 to reference the zone declared elsewhere
+ * @return zone or NULL
+ */
+ngx_shm_zone_t *
+ngx_json_extractor_cache_zone(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    je_cache_t      *cache;
+    ngx_shm_zone_t  *shm_zone;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size,
+                                     &ngx_json_extractor_module);
+    if (NULL==shm_zone)
+        return NULL;
+
+    if (NULL==shm_zone->data) {
+        cache = ngx_pcalloc(cf->pool, sizeof(je_cache_t));
+        if (NULL==cache)
+            return NULL;
+
+        shm_zone->init = je_cache_init_zone;
+        shm_zone->data = cache;
+    }
+
+    return shm_zone;
+}
+
+/**
+ * Fill values of the stream from the cache
+ * @param shm_zone
+ * @param hash
+ * @param src
+ * @param st - stream with empty values
+ * @return NGX_OK on hit, NGX_DECLINED on miss, NGX_ERROR
+ */
+ngx_int_t
+ngx_json_extractor_cache_get(ngx_shm_zone_t *shm_zone, uint64_t hash,
+    ngx_str_t *src, je_stream_t *st)
+{
+    size_t            size;
+    u_char           *p, *v;
+    ngx_uint_t        i;
+    je_cache_t       *cache;
+    je_cache_node_t  *cn;
+
+    cache = shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = je_cache_lookup(cache, hash);
+
+    if (NULL!=cn && cn->expire<ngx_time()) {
+        je_cache_delete(cache, cn);
+        cn = NULL;
+    }
+
+    if (NULL==cn || cn->slen!=src->len || cn->nslots!=st->item->nslots
+        || 0!=ngx_memcmp(cn->vlen + cn->nslots, src->data, src->len))
+    {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        (void) ngx_atomic_fetch_add(&cache->sh->misses, 1);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->lru, &cn->queue);
+
+    p = (u_char *) (cn->vlen + cn->nslots) + cn->slen;
+
+    for (size=0, i=0 ; i<cn->nslots ; i++) {
+        if (JE_CACHE_ABSENT!=cn->vlen[i])
+            size += cn->vlen[i];
+    }
+
+    v = ngx_pnalloc(st->pool, size + 1);
+    if (NULL==v) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    for (i=0 ; i<cn->nslots ; i++) {
+        if (JE_CACHE_ABSENT==cn->vlen[i])
+            continue;
+
+        st->values[i].data = v;
+        st->values[i].len = cn->vlen[i];
+        v = ngx_cpymem(v, p, cn->vlen[i]);
+        p += cn->vlen[i];
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    (void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
+    st->found = st->item->nslots;
+    st->rc = NGX_OK;
+
+    return NGX_OK;
+}
+
+/**
+ * Store values of the finished stream, nothing is stored
+ * if the zone is locked by another worker
+ * @param shm_zone
+ * @param ttl
+ * @param hash
+ * @param src
+ * @param st
+ */
+void
+ngx_json_extractor_cache_put(ngx_shm_zone_t *shm_zone, time_t ttl,
+    uint64_t hash, ngx_str_t *src, je_stream_t *st)
+{
+    size_t            size;
+    u_char           *p;
+    ngx_uint_t        i, n;
+    ngx_queue_t      *q;
+    je_cache_t       *cache;
+    je_cache_node_t  *cn;
+
+    cache = shm_zone->data;
+
+    size = offsetof(je_cache_node_t, vlen)
+         + st->item->nslots * sizeof(uint32_t) + src->len;
+
+    for (i=0 ; i<st->item->nslots ; i++)
+        size += st->values[i].len;
+
+    if (!ngx_shmtx_trylock(&cache->shpool->mutex))
+        return;
+
+    // Stored by another worker or collision
+    cn = je_cache_lookup(cache, hash);
+    if (NULL!=cn)
+        je_cache_delete(cache, cn);
+
+    cn = ngx_slab_alloc_locked(cache->shpool, size);
+
+    for (n=0 ; NULL==cn && n<JE_CACHE_EVICT ; n++) {
+        if (ngx_queue_empty(&cache->sh->lru))
+            break;
+
+        q = ngx_queue_last(&cache->sh->lru);
+        je_cache_delete(cache, ngx_queue_data(q, je_cache_node_t, queue));
+
+        cn = ngx_slab_alloc_locked(cache->shpool, size);
+    }
+
+    if (NULL==cn) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    cn->node.key = (ngx_rbtree_key_t) hash;
+    cn->hash = hash;
+    cn->expire = ngx_time() + ttl;
+    cn->slen = (uint32_t) src->len;
+    cn->nslots = (uint32_t) st->item->nslots;
+
+    p = ngx_cpymem(cn->vlen + cn->nslots, src->data, src->len);
+
+    for (i=0 ; i<cn->nslots ; i++) {
+        if (NULL==st->values[i].data) {
+            cn->vlen[i] = JE_CACHE_ABSENT;
+            continue;
+        }
+
+        cn->vlen[i] = (uint32_t) st->values[i].len;
+        p = ngx_cpymem(p, st->values[i].data, st->values[i].len);
+    }
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->sh->lru, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/**
+ * Get hit and miss counters of the zone
+ * @param shm_zone
+ * @param hits
+ * @param misses
+ */
+void
+ngx_json_extractor_cache_stat(ngx_shm_zone_t *shm_zone,
+    ngx_atomic_uint_t *hits, ngx_atomic_uint_t *misses)
+{
+    je_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    *hits = cache->sh->hits;
+    *misses = cache->sh->misses;
+}
+
+/**
+ * Init shared memory of the zone, the tree of the previous
+ * configuration is kept on reload
+ * @param shm_zone
+ * @param data - cache of the previous configuration
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    je_cache_t       *ocache = data;
+    je_cache_t       *cache;
+    size_t            len;
+
+    cache = shm_zone->data;
+
+    if (NULL!=ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(je_cache_sh_t));
+    if (NULL==cache->sh)
+        return NGX_ERROR;
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->lru);
+
+    len = sizeof(" in json_extract_cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (NULL==cache->shpool->log_ctx)
+        return NGX_ERROR;
+
+    ngx_sprintf(cache->shpool->log_ctx, " in json_extract_cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/**
+ * Find entry, the zone is locked
+ * @param cache
+ * @param hash
+ * @return entry or NULL
+ */
+static je_cache_node_t *
+je_cache_lookup(je_cache_t *cache, uint64_t hash)
+{
+    ngx_rbtree_key_t    key;
+    ngx_rbtree_node_t  *node, *sentinel;
+    je_cache_node_t    *cn;
+
+    key = (ngx_rbtree_key_t) hash;
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node!=sentinel) {
+        if (key<node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key>node->key) {
+            node = node->right;
+            continue;
+        }
+
+        cn = (je_cache_node_t *) node;
+        return hash==cn->hash ? cn : NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Remove entry, the zone is locked
+ * @param cache
+ * @param cn
+ */
+static void
+je_cache_delete(je_cache_t *cache, je_cache_node_t *cn)
+{
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(cache->shpool, cn);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Documents of json_extract_file.
+ *
+ * The file is read and parsed into a tape by the master while the
+ * configuration is loaded, workers share the version copy-on-write.
+ * Values are slices of the source kept in memory: a mapped file
+ * truncated in place would kill workers reading it. Every worker
+ * checks the file by a timer once in the interval, out of the request
+ * path, and loads a new version when its mtime, size or inode is
+ * changed. The check and the load run in a task of the thread pool,
+ * the file is touched only by the task until it is done, then the
+ * event loop takes the new version and adds the timer again. Requests
+ * see the new version when it is parsed completely, the previous one
+ * is released when requests holding its values are over.
+ */
+
+static je_file_doc_t *je_file_load(je_file_t *f, ngx_uint_t level,
+    ngx_log_t *log);
+static je_file_doc_t *je_file_check(je_file_t *f, ngx_log_t *log);
+static void je_file_swap(je_file_t *f, je_file_doc_t *doc, ngx_log_t *log);
+static void je_file_timer(ngx_event_t *ev);
+#if (NGX_THREADS)
+static void je_file_thread_handler(void *data, ngx_log_t *log);
+static void je_file_thread_event_handler(ngx_event_t *ev);
+#endif
+static void je_file_cleanup(void *data);
+static void je_file_release(void *data);
+static void je_file_free(void *data);
+
+/**
+ * Load the file once for all directives naming it
+ * @param cf
+ * @param files - je_file_t * of the configuration
+ * @param name - path, relative to the configuration prefix
+ * @return file or NULL
+ */
+je_file_t *
+ngx_json_extractor_file_open(ngx_conf_t *cf, ngx_array_t *files,
+    ngx_str_t *name)
+{
+    ngx_str_t            full;
+    ngx_uint_t           i;
+    je_file_t           *f, **fp;
+    ngx_pool_cleanup_t  *cln;
+
+    full = *name;
+    if (NGX_OK!=ngx_conf_full_name(cf->cycle, &full, 1))
+        return NULL;
+
+    fp = files->elts;
+    for (i=0 ; i<files->nelts ; i++) {
+        if (fp[i]->name.len==full.len
+            && 0==ngx_strncmp(fp[i]->name.data, full.data, full.len))
+            return fp[i];
+    }
+
+    f = ngx_pcalloc(cf->pool, sizeof(je_file_t));
+    fp = ngx_array_push(files);
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (NULL==f || NULL==fp || NULL==cln)
+        return NULL;
+
+    f->name = full;
+
+    f->doc = je_file_load(f, NGX_LOG_EMERG, cf->log);
+    if (NULL==f->doc)
+        return NULL;
+
+    *fp = f;
+
+    cln->handler = je_file_cleanup;
+    cln->data = f;
+
+    return f;
+}
+
+/**
+ * Start checks of the files in the worker
+ * @param cycle
+ * @return NGX_OK
+ */
+ngx_int_t
+ngx_json_extractor_file_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  i;
+    je_file_t                 **files;
+    ngx_json_extractor_main_t  *jmcf;
+#if (NGX_THREADS)
+    ngx_thread_task_t          *task;
+#endif
+
+    if (NULL==ngx_get_conf(cycle->conf_ctx, ngx_http_module))
+        return NGX_OK;
+
+    jmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_json_extractor_module);
+    if (NULL==jmcf)
+        return NGX_OK;
+
+    files = jmcf->files.elts;
+    for (i=0 ; i<jmcf->files.nelts ; i++) {
+        if (0==files[i]->check)
+            continue;
+
+        files[i]->event.handler = je_file_timer;
+        files[i]->event.data = files[i];
+        files[i]->event.log = cycle->log;
+        files[i]->event.cancelable = 1;
+
+#if (NGX_THREADS)
+        if (NULL!=files[i]->thread_pool) {
+            task = ngx_thread_task_alloc(cycle->pool, 0);
+            if (NULL==task)
+                return NGX_ERROR;
+
+            task->ctx = files[i];
+            task->handler = je_file_thread_handler;
+            task->event.handler = je_file_thread_event_handler;
+            task->event.data = files[i];
+            files[i]->task = task;
+        }
+#endif
+
+        ngx_add_timer(&files[i]->event, files[i]->check);
+    }
+
+    return NGX_OK;
+}
+
+/**
+ * Current version of the file
+ * @param f
+ * @param pool - holds the version while values are used, NULL if none
+ * @return version or NULL
+ */
+je_file_doc_t *
+ngx_json_extractor_file_get(je_file_t *f, ngx_pool_t *pool)
+{
+    je_file_doc_t       *doc;
+    ngx_pool_cleanup_t  *cln;
+
+    doc = f->doc;
+
+    if (NULL==pool)
+        return doc;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (NULL==cln)
+        return NULL;
+
+    cln->handler = je_file_release;
+    cln->data = doc;
+    doc->refs++;
+
+    return doc;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Read and parse new version of the file
+ * @param f
+ * @param level - of errors
+ * @param log
+ * @return version held by the file or NULL
+ */
+static je_file_doc_t *
+je_file_load(je_file_t *f, ngx_uint_t level, ngx_log_t *log)
+{
+    u_char              *p;
+    size_t               pos;
+    ssize_t              n;
+    ngx_int_t            rc;
+    ngx_str_t            src;
+    ngx_file_t           file;
+    ngx_pool_t          *pool;
+    je_file_doc_t       *doc;
+    ngx_pool_cleanup_t  *cln;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = f->name;
+    file.log = log;
+
+    file.fd = ngx_open_file(f->name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (NGX_INVALID_FILE==file.fd) {
+        ngx_log_error(level, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &f->name);
+        return NULL;
+    }
+
+    doc = NULL;
+    pool = NULL;
+
+    if (NGX_FILE_ERROR==ngx_fd_info(file.fd, &file.info)) {
+        ngx_log_error(level, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &f->name);
+        goto done;
+    }
+
+    pool = ngx_create_pool(NGX_JSON_EXTRACTOR_FILE_POOL, log);
+    if (NULL==pool)
+        goto done;
+
+    src.len = ngx_file_size(&file.info);
+
+    doc = ngx_pcalloc(pool, sizeof(je_file_doc_t));
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (NULL==doc || NULL==cln)
+        goto failed;
+
+    // Freed by the cleanup with the pool from now on
+    src.data = ngx_alloc(src.len + 1, log);
+    if (NULL==src.data)
+        goto failed;
+
+    cln->handler = je_file_free;
+    cln->data = src.data;
+
+    // The file is read as it was when it was opened
+    for (p=src.data ; p<src.data + src.len ; p+=n) {
+        n = ngx_read_file(&file, p, src.data + src.len - p,
+                          p - src.data);
+        if (NGX_ERROR==n)
+            goto failed;
+
+        if (0==n) {
+            ngx_log_error(level, log, 0,
+                          "JSON file \"%V\" is truncated", &f->name);
+            goto failed;
+        }
+    }
+
+    rc = ngx_json_extractor_tape_parse(pool, &src, &doc->tape, &pos);
+
+    if (NGX_DECLINED==rc) {
+        ngx_log_error(level, log, 0,
+                      "JSON file \"%V\" parse error: position[%uz]",
+                      &f->name, pos);
+        goto failed;
+    }
+
+    if (NGX_OK!=rc)
+        goto failed;
+
+    doc->pool = pool;
+    doc->gen = ++f->gen;
+    doc->refs = 1;
+
+    f->mtime = ngx_file_mtime(&file.info);
+    f->size = src.len;
+    f->uniq = ngx_file_uniq(&file.info);
+
+    goto done;
+
+failed:
+
+    ngx_destroy_pool(pool);
+    doc = NULL;
+
+done:
+
+    if (NGX_FILE_ERROR==ngx_close_file(file.fd)) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &f->name);
+    }
+
+    return doc;
+}
+
+/**
+ * Load new version if the file is changed, may run in a thread
+ * @param f
+ * @param log
+ * @return new version or NULL if the current one is kept
+ */
+static je_file_doc_t *
+je_file_check(je_file_t *f, ngx_log_t *log)
+{
+    ngx_file_info_t  fi;
+
+    if (NGX_FILE_ERROR==ngx_file_info(f->name.data, &fi)) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_file_info_n " \"%V\" failed", &f->name);
+        return NULL;
+    }
+
+    if (f->mtime==ngx_file_mtime(&fi)
+        && f->size==ngx_file_size(&fi)
+        && f->uniq==ngx_file_uniq(&fi))
+        return NULL;
+
+    return je_file_load(f, NGX_LOG_ERR, log);
+}
+
+/**
+ * Move requests to the new version, runs in the event loop
+ * @param f
+ * @param doc - new version or NULL
+ * @param log
+ */
+static void
+je_file_swap(je_file_t *f, je_file_doc_t *doc, ngx_log_t *log)
+{
+    if (NULL==doc)
+        return;
+
+    je_file_release(f->doc);
+    f->doc = doc;
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "JSON file \"%V\" is reloaded", &f->name);
+}
+
+/**
+ * Check the file once in the interval, by the task if the file has
+ * a thread pool
+ * @param ev
+ */
+static void
+je_file_timer(ngx_event_t *ev)
+{
+    je_file_t *f = ev->data;
+
+    if (ngx_exiting || ngx_terminate)
+        return;
+
+#if (NGX_THREADS)
+    if (NULL!=f->task) {
+        // The timer is added again when the task is done
+        if (NGX_OK==ngx_thread_task_post(f->thread_pool, f->task))
+            return;
+
+        // The queue is full, the file is checked by the next timer
+        ngx_add_timer(ev, f->check);
+        return;
+    }
+#endif
+
+    je_file_swap(f, je_file_check(f, ev->log), ev->log);
+
+    ngx_add_timer(ev, f->check);
+}
+
+#if (NGX_THREADS)
+
+/**
+ * Check and load the file, runs in a thread
+ * @param data - je_file_t
+ * @param log
+ */
+static void
+je_file_thread_handler(void *data, ngx_log_t *log)
+{
+    je_file_t *f = data;
+
+    f->next = je_file_check(f, log);
+}
+
+/**
+ * Take the version loaded by the task, runs in the event loop
+ * @param ev
+ */
+static void
+je_file_thread_event_handler(ngx_event_t *ev)
+{
+    je_file_t *f = ev->data;
+
+    je_file_swap(f, f->next, f->event.log);
+    f->next = NULL;
+
+    if (ngx_exiting || ngx_terminate)
+        return;
+
+    ngx_add_timer(&f->event, f->check);
+}
+
+#endif
+
+/**
+ * Release version of the file with the configuration
+ * @param data - je_file_t
+ */
+static void
+je_file_cleanup(void *data)
+{
+    je_file_t *f = data;
+
+    je_file_release(f->doc);
+    f->doc = NULL;
+}
+
+/**
+ * Release one holder of the version
+ * @param data - je_file_doc_t
+ */
+static void
+je_file_release(void *data)
+{
+    je_file_doc_t *doc = data;
+
+    if (0==--doc->refs)
+        ngx_destroy_pool(doc->pool);
+}
+
+/**
+ * Free source of the version
+ * @param data
+ */
+static void
+je_file_free(void *data)
+{
+    ngx_free(data);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+#include <zlib.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Compressed bodies.
+ *
+ * gzip and deflate data is inflated by small windows which are parsed
+ * at once, the window is reused, so the whole document never exists in
+ * memory. Inflating stops as soon as the parser is finished. zlib memory
+ * is taken from the request pool and released with it.
+ */
+
+struct je_inflate_s {
+    z_stream    zs;
+    u_char     *out;
+    unsigned    done:1;                     // Compressed stream is over
+};
+
+static void *je_inflate_alloc(void *opaque, u_int items, u_int size);
+static void je_inflate_free(void *opaque, void *address);
+
+/**
+ * Start inflating of the stream source, gzip and zlib headers
+ * are detected by the data
+ * @param st
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_inflate_init(je_stream_t *st)
+{
+    je_inflate_t  *zi;
+
+    zi = ngx_pcalloc(st->pool, sizeof(je_inflate_t));
+    if (NULL==zi)
+        return NGX_ERROR;
+
+    zi->out = ngx_pnalloc(st->pool, NGX_JSON_EXTRACTOR_READ_SIZE);
+    if (NULL==zi->out)
+        return NGX_ERROR;
+
+    zi->zs.zalloc = je_inflate_alloc;
+    zi->zs.zfree = je_inflate_free;
+    zi->zs.opaque = st->pool;
+
+    if (Z_OK!=inflateInit2(&zi->zs, MAX_WBITS + 32))
+        return NGX_ERROR;
+
+    st->inflate = zi;
+    return NGX_OK;
+}
+
+/**
+ * Inflate next part of the compressed source and parse it
+ * @param st
+ * @param p - buffer start
+ * @param last - buffer end
+ * @return NGX_[STATUS] like the feed
+ */
+ngx_int_t
+ngx_json_extractor_inflate_feed(je_stream_t *st, u_char *p, u_char *last)
+{
+    int            zrc;
+    size_t         n;
+    ngx_int_t      rc;
+    je_inflate_t  *zi;
+
+    zi = st->inflate;
+
+    // Trailing data after the compressed stream is ignored
+    if (zi->done)
+        return NGX_AGAIN;
+
+    zi->zs.next_in = p;
+    zi->zs.avail_in = last - p;
+
+    do {
+        zi->zs.next_out = zi->out;
+        zi->zs.avail_out = NGX_JSON_EXTRACTOR_READ_SIZE;
+
+        zrc = inflate(&zi->zs, Z_NO_FLUSH);
+
+        if (Z_OK!=zrc && Z_STREAM_END!=zrc && Z_BUF_ERROR!=zrc)
+            return NGX_ERROR;
+
+        n = NGX_JSON_EXTRACTOR_READ_SIZE - zi->zs.avail_out;
+
+        if (n>0) {
+            rc = ngx_json_extractor_stream_feed(st, zi->out, zi->out + n);
+
+            // All selectors are found, the rest is not inflated
+            if (NGX_AGAIN!=rc)
+                return rc;
+        }
+
+        if (Z_STREAM_END==zrc) {
+            zi->done = 1;
+            break;
+        }
+
+    } while (zi->zs.avail_in>0 || 0==zi->zs.avail_out);
+
+    return NGX_AGAIN;
+}
+
+static void *
+je_inflate_alloc(void *opaque, u_int items, u_int size)
+{
+    return ngx_palloc((ngx_pool_t *) opaque, items * size);
+}
+
+static void
+je_inflate_free(void *opaque, void *address)
+{
+    // Released with the pool
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Document limits.
+ *
+ * Size is checked before every buffer is parsed. Depth, tokens and
+ * elements of JSON are counted by a light scan of the buffer which
+ * looks only at structural bytes, so the parser never starts on the
+ * buffer over the limit. Binary documents are checked by their walk.
+ * A document over the limit has no values, variables get the default.
+ */
+
+struct je_budget_s {
+    ngx_uint_t      depth;
+    ngx_uint_t      tokens;
+    ngx_array_t     elems;                  // ngx_uint_t, commas per level
+    unsigned        expect:1;               // Next byte starts a token
+    unsigned        instr:1;
+    unsigned        esc:1;
+};
+
+/**
+ * Check next part of the document against the item limits
+ * @param st
+ * @param p - buffer start
+ * @param last - buffer end
+ * @return NGX_OK, NGX_DECLINED if a limit is exceeded or NGX_ERROR
+ */
+ngx_int_t
+ngx_json_extractor_limits_feed(je_stream_t *st, u_char *p, u_char *last)
+{
+    u_char         ch, *start;
+    ngx_uint_t    *elems;
+    je_budget_t   *bg;
+    je_limits_t   *lm;
+
+    lm = st->item->limits;
+
+    if (lm->size && st->offset + (last - p) > (off_t) lm->size)
+        return ngx_json_extractor_limits_over(st, "size", st->offset);
+
+    // Binary items are counted by the walk
+    if (NGX_JSON_EXTRACTOR_FORMAT_JSON!=st->item->format
+        || (0==lm->depth && 0==lm->tokens && 0==lm->elements))
+        return NGX_OK;
+
+    bg = st->budget;
+    if (NULL==bg) {
+        bg = ngx_pcalloc(st->pool, sizeof(je_budget_t));
+        if (NULL==bg)
+            return NGX_ERROR;
+
+        if (lm->elements
+            && NGX_OK!=ngx_array_init(&bg->elems, st->pool, 8,
+                                      sizeof(ngx_uint_t)))
+            return NGX_ERROR;
+
+        bg->expect = 1;
+        st->budget = bg;
+    }
+
+    start = p;
+
+    for ( ; p<last ; p++) {
+        ch = *p;
+
+        if (bg->instr) {
+            if (bg->esc) {
+                bg->esc = 0;
+            } else if ('\\'==ch) {
+                bg->esc = 1;
+            } else if ('"'==ch) {
+                bg->instr = 0;
+            }
+            continue;
+        }
+
+        if (l_isspace(ch))
+            continue;
+
+        if (bg->expect && '}'!=ch && ']'!=ch) {
+            bg->expect = 0;
+            if (lm->tokens && ++bg->tokens>lm->tokens)
+                goto tokens;
+        }
+
+        switch (ch) {
+
+        case '"':
+            bg->instr = 1;
+            break;
+
+        case '{':
+        case '[':
+            if (lm->depth && ++bg->depth>lm->depth)
+                goto depth;
+
+            if (lm->elements) {
+                elems = ngx_array_push(&bg->elems);
+                if (NULL==elems)
+                    return NGX_ERROR;
+                *elems = 0;
+            }
+
+            bg->expect = 1;
+            break;
+
+        case '}':
+        case ']':
+            // Unbalanced brackets are reported by the parser
+            if (bg->depth>0)
+                bg->depth--;
+            if (lm->elements && bg->elems.nelts>0)
+                bg->elems.nelts--;
+
+            bg->expect = 0;
+            break;
+
+        case ',':
+            // Elements are one more than commas
+            if (lm->elements && bg->elems.nelts>0) {
+                elems = bg->elems.elts;
+                if (++elems[bg->elems.nelts-1]>=lm->elements)
+                    goto elements;
+            }
+            /* fall through */
+
+        case ':':
+            bg->expect = 1;
+            break;
+        }
+    }
+
+    return NGX_OK;
+
+tokens:
+    return ngx_json_extractor_limits_over(st, "tokens",
+                                          st->offset + (p - start));
+depth:
+    return ngx_json_extractor_limits_over(st, "depth",
+                                          st->offset + (p - start));
+elements:
+    return ngx_json_extractor_limits_over(st, "elements",
+                                          st->offset + (p - start));
+}
+
+/**
+ * Drop values of the document over the limit
+ * @param st
+ * @param limit - name of the limit
+ * @param pos - document position
+ * @return NGX_DECLINED
+ */
+ngx_int_t
+ngx_json_extractor_limits_over(je_stream_t *st, char *limit, off_t pos)
+{
+    // Log of the request is not used out of the event loop
+    if (st->deferred) {
+        st->limit = limit;
+        st->limitpos = pos;
+    } else {
+        ngx_log_error_core(NGX_LOG_WARN, st->pool->log, 0,
+            "JSON %s limit exceeded: position[%O]", limit, pos);
+    }
+
+    ngx_memzero(st->values, st->item->nslots * sizeof(ngx_str_t));
+    st->found = 0;
+    st->ncaps = 0;
+
+    return NGX_DECLINED;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Worker cache of recently seen sources.
+ *
+ * Every json_extract has own table in the worker memory, so nothing is
+ * locked. Entry keeps values of all slots converted to strings,
+ * entries used by requests are released after the last one.
+ */
+
+struct je_lru_s {
+    ngx_uint_t      size;
+    ngx_uint_t      n;
+    ngx_queue_t     queue;                  // Recently used first
+    je_lru_node_t **buckets;                // size buckets
+};
+
+static void je_lru_unpin(void *data);
+static void je_lru_evict(je_lru_t *lru, je_lru_node_t *ln);
+static void je_lru_free(je_lru_node_t *ln);
+
+/**
+ * Find entry of the source
+ * @param it
+ * @param hash
+ * @param src
+ * @return entry or NULL
+ */
+je_lru_node_t *
+ngx_json_extractor_lru_get(je_item_t *it, uint64_t hash, ngx_str_t *src)
+{
+    je_lru_t       *lru;
+    je_lru_node_t  *ln;
+
+    lru = it->lru;
+    if (NULL==lru)
+        return NULL;
+
+    for (ln=lru->buckets[hash % lru->size] ; ln ; ln=ln->next) {
+        if (hash==ln->hash && src->len==ln->source.len
+            && 0==ngx_memcmp(src->data, ln->source.data, src->len))
+        {
+            ngx_queue_remove(&ln->queue);
+            ngx_queue_insert_head(&lru->queue, &ln->queue);
+            return ln;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Add entry of the source, the least recently used one is evicted
+ * @param it
+ * @param hash
+ * @param src
+ * @param st - finished stream
+ * @return entry or NULL
+ */
+je_lru_node_t *
+ngx_json_extractor_lru_add(je_item_t *it, uint64_t hash, ngx_str_t *src,
+    je_stream_t *st)
+{
+    ngx_uint_t      i;
+    je_lru_t       *lru;
+    je_lru_node_t  *ln;
+
+    lru = it->lru;
+
+    if (NULL==lru) {
+        lru = ngx_calloc(sizeof(je_lru_t), ngx_cycle->log);
+        if (NULL==lru)
+            return NULL;
+
+        lru->size = it->lru_size;
+        lru->buckets = ngx_calloc(lru->size * sizeof(je_lru_node_t *),
+                                  ngx_cycle->log);
+        if (NULL==lru->buckets) {
+            ngx_free(lru);
+            return NULL;
+        }
+
+        ngx_queue_init(&lru->queue);
+        it->lru = lru;
+    }
+
+    if (lru->n>=lru->size) {
+        je_lru_evict(lru, ngx_queue_data(ngx_queue_last(&lru->queue),
+                                         je_lru_node_t, queue));
+    }
+
+    // Values follow the entry, source follows them
+    ln = ngx_calloc(sizeof(je_lru_node_t)
+                    + it->nslots * sizeof(ngx_str_t) + src->len,
+                    ngx_cycle->log);
+    if (NULL==ln)
+        return NULL;
+
+    ln->item = it;
+    ln->hash = hash;
+    ln->values = (ngx_str_t *) (ln + 1);
+    ln->source.len = src->len;
+    ln->source.data = ngx_cpymem(ln->values + it->nslots, src->data,
+                                 src->len) - src->len;
+
+    for (i=0 ; i<it->nslots ; i++) {
+        if (NULL==st->values[i].data)
+            continue;
+
+        ln->values[i].data = ngx_alloc(st->values[i].len + 1,
+                                       ngx_cycle->log);
+        if (NULL==ln->values[i].data) {
+            je_lru_free(ln);
+            return NULL;
+        }
+
+        ngx_memcpy(ln->values[i].data, st->values[i].data,
+                   st->values[i].len);
+        ln->values[i].data[st->values[i].len] = '\0';
+        ln->values[i].len = st->values[i].len;
+    }
+
+    ln->next = lru->buckets[hash % lru->size];
+    lru->buckets[hash % lru->size] = ln;
+    ngx_queue_insert_head(&lru->queue, &ln->queue);
+    lru->n++;
+
+    return ln;
+}
+
+/**
+ * Keep entry until the pool is destroyed
+ * @param pool
+ * @param ln
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_lru_pin(ngx_pool_t *pool, je_lru_node_t *ln)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (NULL==cln)
+        return NGX_ERROR;
+
+    cln->handler = je_lru_unpin;
+    cln->data = ln;
+    ln->refs++;
+
+    return NGX_OK;
+}
+
+/**
+ * Release entry used by the request
+ * @param data je_lru_node_t*
+ */
+static void
+je_lru_unpin(void *data)
+{
+    je_lru_node_t  *ln = data;
+
+    if (0==--ln->refs && ln->evicted)
+        je_lru_free(ln);
+}
+
+/**
+ * Remove entry from the table
+ * @param lru
+ * @param ln
+ */
+static void
+je_lru_evict(je_lru_t *lru, je_lru_node_t *ln)
+{
+    je_lru_node_t  **pp;
+
+    for (pp=&lru->buckets[ln->hash % lru->size] ; *pp!=ln ; pp=&(*pp)->next)
+        /* void */ ;
+
+    *pp = ln->next;
+    ngx_queue_remove(&ln->queue);
+    lru->n--;
+
+    ln->evicted = 1;
+
+    if (NULL!=ngx_json_extractor_status)
+        (void) ngx_atomic_fetch_add(&ngx_json_extractor_status->evictions, 1);
+
+    if (0==ln->refs)
+        je_lru_free(ln);
+}
+
+/**
+ * Free entry memory
+ * @param ln
+ */
+static void
+je_lru_free(je_lru_node_t *ln)
+{
+    ngx_uint_t  i;
+
+    for (i=0 ; i<ln->item->nslots ; i++) {
+        if (NULL!=ln->values[i].data)
+            ngx_free(ln->values[i].data);
+    }
+
+    ngx_free(ln);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
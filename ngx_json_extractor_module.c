@@ -14,14 +14,6 @@
 #include <locale.h>
 #endif
 
-#ifndef NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE
-#define NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE 1
-#endif
-
-#ifndef NGX_JSON_EXTRACTOR_CLEANUP_SPIKE
-#define NGX_JSON_EXTRACTOR_CLEANUP_SPIKE 1
-#endif
-
 #include "ngx_json_extractor_module.h"
 
 #ifdef __cplusplus
@@ -40,8 +32,6 @@ extern "C" {
     #define JSON_DECODE_ANY        0x4
 #endif
 
-#define l_isspace(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
-
 #define JSON_VAR_GEN_NAME_FORMAT "jsone_%p"
 
 /**
@@ -67,13 +57,27 @@ static char *strip(char *str) {
 
 
 // Module inits
+static ngx_int_t ngx_json_extractor_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_json_extractor_module_postinit(ngx_conf_t *cf);
-
-#if (!NGX_JSON_EXTRACTOR_CLEANUP_SPIKE)
-static ngx_int_t ngx_json_extractor_module_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_json_extractor_init_process(ngx_cycle_t *cycle);
+
+// Filters
+static ngx_int_t ngx_json_extractor_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in);
+static ngx_int_t ngx_json_extractor_response_header_filter(
+    ngx_http_request_t *r);
+static ngx_int_t ngx_json_extractor_response_body_filter(
+    ngx_http_request_t *r, ngx_chain_t *in);
+
+#if (NGX_THREADS)
+// Phases
+static ngx_int_t ngx_json_extractor_precontent_handler(
+    ngx_http_request_t *r);
+static void ngx_json_extractor_body_handler(ngx_http_request_t *r);
 #endif
 
-static void ngx_json_extractor_module_cleanup_handler(void *data);
+// main configuration inits
+static void *ngx_json_extractor_create_main_conf(ngx_conf_t *cf);
 
 // location configuration inits
 static void *ngx_json_extractor_create_loc_conf(ngx_conf_t *cf);
@@ -83,24 +87,98 @@ static char *ngx_json_extractor_merge_loc_conf(ngx_conf_t *cf,
 // Config Commands
 static char * ngx_http_json_extract(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char * ngx_http_json_extract_select(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char * ngx_http_json_extract_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char * ngx_http_json_build(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char * ngx_http_json_extract_lru(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char * ngx_http_json_extract_limits(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char * ngx_http_json_extract_threads(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char * ngx_http_json_extract_file_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char * ngx_http_json_extractor_status(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 // Variable accessors
 static ngx_int_t ngx_http_json_extract_var(ngx_http_request_t *r, 
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_json_desc(ngx_http_request_t *r, 
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_json_select(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_json_build_var(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static void ngx_http_json_conf_cleanup(void *data);
+static ngx_int_t ngx_http_json_cache_status(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_json_cache_stat(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_json_request_var(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 
 // Helpers
-static json_t *get_json(ngx_http_request_t *r, uintptr_t data);
-static ngx_int_t add_json_item(ngx_json_extractor_loc_t *lc,
+static je_item_t *add_json_item(ngx_json_extractor_loc_t *lc,
     ngx_int_t index, ngx_uint_t data_index, uintptr_t data, void *pool);
-static u_char *get_json_item(ngx_http_request_t *r, u_char *text,
-    json_t *json);
-static ngx_http_variable_t *get_head_var(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v);
-static je_item_t *get_item_by_data(ngx_json_extractor_loc_t *olcf,
-    uintptr_t data);
+static ngx_int_t check_json_var(ngx_conf_t *cf, ngx_http_variable_t *v,
+    je_item_t *it);
+static ngx_int_t get_json_format(ngx_str_t *value, ngx_uint_t *format);
+static ngx_int_t load_json_const(ngx_conf_t *cf, je_item_t *it,
+    ngx_str_t *value);
+static ngx_int_t add_json_stat(ngx_json_extractor_main_t *jmcf,
+    je_item_t *it);
+static je_item_t *get_json_select(ngx_http_request_t *r, je_select_t *sel,
+    ngx_str_t *key);
+static ngx_int_t compile_json_path(ngx_pool_t *pool, je_path_t *path,
+    ngx_str_t *prefix);
+static ngx_json_extractor_ctx_t *get_json_ctx(ngx_http_request_t *r);
+static je_stream_t *get_json_stream(ngx_json_extractor_ctx_t *ctx,
+    je_item_t *it);
+static je_stream_t *create_json_stream(ngx_http_request_t *r,
+    ngx_pool_t *pool, je_item_t *it);
+static ngx_table_elt_t *get_json_encoding(ngx_http_request_t *r,
+    je_item_t *it);
+static je_request_t *get_json_request(ngx_http_request_t *r);
+static je_arena_t *get_json_arena(ngx_http_request_t *r);
+static je_doc_t *get_json_doc(je_request_t *jr, je_item_t *it,
+    ngx_str_t *src, uint64_t hash);
+static je_doc_t *add_json_doc(je_request_t *jr, je_item_t *it,
+    ngx_str_t *src, uint64_t hash);
+static ngx_int_t walk_json_doc(ngx_http_request_t *r, je_item_t *it,
+    je_stream_t *st, ngx_str_t *src, ngx_str_t *doc, uint64_t hash,
+    json_error_t *error);
+static je_stream_t *get_json_values(ngx_pool_t *pool, je_item_t *it);
+static ngx_str_t *get_json_file(ngx_pool_t *pool, je_item_t *it);
+static ngx_int_t get_json_jwt(ngx_pool_t *pool, ngx_str_t *token,
+    ngx_str_t *payload);
+static ngx_int_t feed_json_streams(ngx_http_request_t *r,
+    ngx_array_t *items, ngx_chain_t *in);
+static void walk_json_item(je_stream_t *st, je_node_t *node, json_t *json);
+static ngx_int_t dump_json_item(ngx_pool_t *pool, json_t *val,
+    ngx_str_t *out);
+static ngx_int_t set_json_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, ngx_str_t *val, ngx_uint_t partial);
+static void set_json_vars(ngx_http_request_t *r, je_item_t *it,
+    ngx_str_t *values);
+
+
+static ngx_conf_enum_t ngx_json_extractor_engines[] = {
+    { ngx_string("dom"),    NGX_JSON_EXTRACTOR_ENGINE_DOM },
+    { ngx_string("stream"), NGX_JSON_EXTRACTOR_ENGINE_STREAM },
+    { ngx_string("tape"),   NGX_JSON_EXTRACTOR_ENGINE_TAPE },
+    { ngx_null_string, 0 }
+};
 
+static ngx_conf_enum_t ngx_json_extractor_formats[] = {
+    { ngx_string("json"),    NGX_JSON_EXTRACTOR_FORMAT_JSON },
+    { ngx_string("msgpack"), NGX_JSON_EXTRACTOR_FORMAT_MSGPACK },
+    { ngx_string("cbor"),    NGX_JSON_EXTRACTOR_FORMAT_CBOR },
+    { ngx_null_string, 0 }
+};
 
 static ngx_command_t ngx_json_extractor_commands[] = {
 
@@ -127,6 +205,20 @@ static ngx_command_t ngx_json_extractor_commands[] = {
       NULL },
 #endif
 
+    { ngx_string("json_engine"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_json_extractor_loc_t, engine),
+      &ngx_json_extractor_engines },
+
+    { ngx_string("json_extract_raw"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_json_extractor_loc_t, raw),
+      NULL },
+
     { ngx_string("json_extract"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_json_extract,
@@ -134,14 +226,121 @@ static ngx_command_t ngx_json_extractor_commands[] = {
       0,
       NULL },
 
+    { ngx_string("json_extract_jwt"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+      ngx_http_json_extract,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      NGX_JSON_EXTRACTOR_SOURCE_JWT,
+      NULL },
+
+    { ngx_string("json_extract_file"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+      ngx_http_json_extract,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      NGX_JSON_EXTRACTOR_SOURCE_FILE,
+      NULL },
+
+    { ngx_string("json_extract_file_check"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_json_extract_file_check,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("json_extract_select"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+      |NGX_CONF_TAKE3|NGX_CONF_TAKE4,
+      ngx_http_json_extract_select,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("json_build"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      ngx_http_json_build,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("json_extract_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_json_extract_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("json_extract_lru"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_json_extract_lru,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_json_extractor_loc_t, lru),
+      NULL },
+
+    { ngx_string("json_extract_limits"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_json_extract_limits,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("json_extract_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_json_extract_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("json_extractor_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_json_extractor_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
+// Content-Encoding of bodies which are inflated
+static ngx_str_t ngx_json_extractor_encodings[] = {
+    ngx_string("gzip"),
+    ngx_string("x-gzip"),
+    ngx_string("deflate"),
+    ngx_null_string
+};
+
+static ngx_str_t ngx_json_extractor_cache_statuses[] = {
+    ngx_null_string,
+    ngx_string("BYPASS"),
+    ngx_string("MISS"),
+    ngx_string("HIT")
+};
+
+static ngx_http_variable_t ngx_json_extractor_vars[] = {
+
+    { ngx_string("json_extract_cache_status"), NULL,
+      ngx_http_json_cache_status, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("json_extract_cache_hits"), NULL,
+      ngx_http_json_cache_stat, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("json_extract_cache_misses"), NULL,
+      ngx_http_json_cache_stat, 1,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("json_extractor_request"), NULL,
+      ngx_http_json_request_var, 0,
+      NGX_HTTP_VAR_NOHASH, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
 static ngx_http_module_t ngx_json_extractor_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_json_extractor_add_variables,      /* preconfiguration */
     ngx_json_extractor_module_postinit,    /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_json_extractor_create_main_conf,   /* create main configuration */
     NULL,                                  /* init main configuration */
 
     NULL,                                  /* create server configuration */
@@ -151,6 +350,10 @@ static ngx_http_module_t ngx_json_extractor_module_ctx = {
     ngx_json_extractor_merge_loc_conf      /* merge location configuration */
 };
 
+static ngx_http_request_body_filter_pt   ngx_http_next_request_body_filter;
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
 ngx_module_t ngx_json_extractor_module = {
     NGX_MODULE_V1,
    &ngx_json_extractor_module_ctx,         /* module context */
@@ -158,7 +361,7 @@ ngx_module_t ngx_json_extractor_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_json_extractor_init_process,       /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -190,520 +393,2978 @@ ngx_http_json_pstrdup(ngx_pool_t *pool, u_char *src, ngx_int_t len)
 ///////////////////////////////////////////////////////////////////////////////
 
 static ngx_int_t
-ngx_json_extractor_module_postinit(ngx_conf_t *cf)
+ngx_json_extractor_add_variables(ngx_conf_t *cf)
 {
-#if (!NGX_JSON_EXTRACTOR_CLEANUP_SPIKE)
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
+    ngx_http_variable_t        *var, *v;
+    ngx_json_extractor_main_t  *jmcf;
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    static ngx_str_t  request = ngx_string("json_extractor_request");
 
-    if (NULL==cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers.elts) {
-        // Init handlers array
-        if (NGX_OK!=ngx_array_init(
-            &cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers,
-            cf->pool, 1, sizeof(ngx_http_handler_pt)))
+    for (v=ngx_json_extractor_vars ; v->name.len ; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (NULL==var)
             return NGX_ERROR;
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
     }
-    h = ngx_array_push(&cmcf->phases[NGX_HTTP_CONTENT_PHASE].handlers);
 
-    if (h == NULL) {
+    jmcf = ngx_http_conf_get_module_main_conf(cf, ngx_json_extractor_module);
+
+    jmcf->request = ngx_http_get_variable_index(cf, &request);
+    if (NGX_ERROR==jmcf->request)
         return NGX_ERROR;
-    }
 
-    *h = ngx_json_extractor_module_handler;
-#endif
     return NGX_OK;
 }
 
-#if (!NGX_JSON_EXTRACTOR_CLEANUP_SPIKE)
-
 static ngx_int_t
-ngx_json_extractor_module_handler(ngx_http_request_t *r)
+ngx_json_extractor_module_postinit(ngx_conf_t *cf)
 {
-    ngx_pool_cleanup_t    *cln;
+    ngx_uint_t                  i, k;
+    je_item_t                  *it;
+    je_path_t                 **paths, **pp;
+    je_select_t               **sels;
+    je_stream_t                *st;
+    je_arena_t                 *arena;
+    je_file_t                 **files;
+    ngx_json_extractor_main_t  *jmcf;
+#if (NGX_THREADS)
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+#endif
 
-    cln = ngx_pool_cleanup_add(r->pool, 0);
+    ngx_json_extractor_simd_init();
 
-    if(cln == NULL)
+    // Serialized constant values live with the configuration
+    arena = ngx_json_extractor_arena_create(cf->pool);
+    if (NULL==arena)
         return NGX_ERROR;
 
-    // Set handler
-    cln->handler = ngx_json_extractor_module_cleanup_handler;
+    // Compile selectors, prefix and separator are merged by this moment
+    jmcf = ngx_http_conf_get_module_main_conf(cf, ngx_json_extractor_module);
+    paths = jmcf->paths.elts;
 
-    // Init data
-    cln->data = r;
+    ngx_conf_init_msec_value(jmcf->file_check, NGX_JSON_EXTRACTOR_FILE_CHECK);
 
-    return NGX_OK;
-}
+#if (NGX_THREADS)
+    // Files are reloaded by the "default" pool unless one is named
+    if (NGX_CONF_UNSET_PTR==jmcf->file_pool) {
+        jmcf->file_pool = NULL;
 
+        if (jmcf->files.nelts>0 && jmcf->file_check>0) {
+            jmcf->file_pool = ngx_thread_pool_add(cf, NULL);
+            if (NULL==jmcf->file_pool)
+                return NGX_ERROR;
+        }
+    }
 #endif
 
-/**
- * Cleanup hundler, free all JSON objects
- * @param data ngx_http_request_t*
- */
-static void
-ngx_json_extractor_module_cleanup_handler(void *data)
-{
-    ngx_uint_t i;
-    ngx_http_request_t *r;
-    ngx_http_variable_value_t *vv;
-    ngx_json_extractor_loc_t *olcf;
+    files = jmcf->files.elts;
+    for (i=0 ; i<jmcf->files.nelts ; i++) {
+        files[i]->check = jmcf->file_check;
+#if (NGX_THREADS)
+        files[i]->thread_pool = jmcf->file_pool;
+#endif
+    }
 
-    r = data;
-    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+    for (i=0 ; i<jmcf->paths.nelts ; i++) {
+        it = paths[i]->item;
 
-    if (NULL!=olcf->json_cache.elts) {
-        for (i=0 ; i<olcf->json_cache.nelts ; i++) {
-            vv = ngx_http_get_indexed_variable(r,
-                    ((je_item_t *)olcf->json_cache.elts)[i].index);
-            if (NULL!=vv)
-                json_delete((json_t *)vv->data);
+        if (NGX_OK!=compile_json_path(cf->pool, paths[i], &it->conf->prefix)
+            || NGX_OK!=ngx_json_extractor_trie_add(cf->pool, paths[i]))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
+            return NGX_ERROR;
         }
-    }
-}
 
-///////////////////////////////////////////////////////////////////////////////
-/// LOCATION CONFIGS //////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+        // http level configuration is never merged
+        it->engine = NGX_CONF_UNSET_UINT==it->conf->engine
+                   ? NGX_JSON_EXTRACTOR_ENGINE_DOM
+                   : it->conf->engine;
+
+        // Request and response bodies are parsed while they pass,
+        // binary documents are walked by the stream engine only
+        if (NGX_JSON_EXTRACTOR_SOURCE_BODY==it->source
+            || NGX_JSON_EXTRACTOR_SOURCE_RESPONSE==it->source
+            || NGX_JSON_EXTRACTOR_FORMAT_JSON!=it->format)
+            it->engine = NGX_JSON_EXTRACTOR_ENGINE_STREAM;
+
+        // Only variable sources repeat between requests
+        if ((NGX_JSON_EXTRACTOR_SOURCE_VARIABLE==it->source
+             || NGX_JSON_EXTRACTOR_SOURCE_JWT==it->source)
+            && NGX_CONF_UNSET_PTR!=it->conf->cache)
+        {
+            it->cache = it->conf->cache;
+            it->cache_ttl = NGX_CONF_UNSET==it->conf->cache_ttl
+                          ? 60 : it->conf->cache_ttl;
+        }
 
-static void *
-ngx_json_extractor_create_loc_conf(ngx_conf_t *cf)
-{
-    ngx_json_extractor_loc_t  *olcf;
+        if (NGX_JSON_EXTRACTOR_SOURCE_VARIABLE==it->source
+            && NGX_CONF_UNSET_UINT!=it->conf->lru)
+            it->lru_size = it->conf->lru;
+
+        if (NGX_CONF_UNSET_PTR!=it->conf->limits)
+            it->limits = it->conf->limits;
+
+        // Tokens repeat on keepalive connections, cached unless disabled
+        if (NGX_JSON_EXTRACTOR_SOURCE_JWT==it->source)
+            it->lru_size = NGX_CONF_UNSET_UINT==it->conf->lru
+                         ? NGX_JSON_EXTRACTOR_JWT_LRU : it->conf->lru;
+
+        // Indexes from the end are known when the array is over,
+        // binary arrays have the length ahead
+        if (it->backward
+            && NGX_JSON_EXTRACTOR_ENGINE_STREAM==it->engine
+            && NGX_JSON_EXTRACTOR_FORMAT_JSON==it->format)
+        {
+            if (NGX_JSON_EXTRACTOR_SOURCE_BODY==it->source
+                || NGX_JSON_EXTRACTOR_SOURCE_RESPONSE==it->source)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Index from the end in body selector: [%V]",
+                    &paths[i]->name);
+                return NGX_ERROR;
+            }
+            it->engine = NGX_JSON_EXTRACTOR_ENGINE_DOM;
+        }
 
-    olcf = ngx_pcalloc(cf->pool, sizeof(ngx_json_extractor_loc_t));
-    if (NULL == olcf) {
-        return NULL;
+        // Objects, arrays and numbers are spans of the source instead of
+        // json_dumps output, the tape keeps the selectors of dom
+        if (1==it->conf->raw && NGX_JSON_EXTRACTOR_ENGINE_DOM==it->engine)
+            it->engine = NGX_JSON_EXTRACTOR_ENGINE_TAPE;
     }
-    return olcf;
-}
 
-static char *
-ngx_json_extractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
-{
-    ngx_json_extractor_loc_t *prev = parent;
-    ngx_json_extractor_loc_t *conf = child;
+    // Slots are numbered when all selectors are in the trie
+    for (i=0 ; i<jmcf->paths.nelts ; i++) {
+        it = paths[i]->item;
 
-    ngx_conf_merge_str_value(conf->prefix,      prev->prefix,      "");
-    ngx_conf_merge_str_value(conf->separator,   prev->separator,   "");
+        if (NULL==it->slots) {
+            it->slots = ngx_pcalloc(cf->pool,
+                                    it->nslots * sizeof(je_path_t *));
+            if (NULL==it->slots)
+                return NGX_ERROR;
 
-#if (NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE)
-    ngx_conf_merge_str_value(conf->default_val, prev->default_val, "");
-#endif
+            // Engines render values differently, zones may be shared
+            it->selhash = ngx_json_extractor_hash((u_char *) &it->engine,
+                sizeof(it->engine), it->selhash);
+        }
 
-    return NGX_CONF_OK;
-}
+        it->slots[paths[i]->slot] = paths[i];
 
-///////////////////////////////////////////////////////////////////////////////
-/// COMMANDS //////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+        if (NULL==it->paths.elts) {
+            if (NGX_OK!=ngx_array_init(&it->paths, cf->pool, 4,
+                                       sizeof(je_path_t *)))
+                return NGX_ERROR;
+        }
 
-/**
- * Extract json vars
- * @param nginx config
- * @param cmd
- * @param conf
- * @return nginx state
- */
-static char *
-ngx_http_json_extract(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_uint_t                       i;
-    ngx_str_t                        n;
-    ngx_int_t                        index;
-    ngx_str_t                       *value;
-    ngx_http_variable_t             *v;
+        pp = ngx_array_push(&it->paths);
+        if (NULL==pp)
+            return NGX_ERROR;
 
-    ngx_json_extractor_loc_t   *olcf = conf;
-    value = cf->args->elts;
-    
-    // Generate new temp var
-    n.len = snprintf(NULL, 0, JSON_VAR_GEN_NAME_FORMAT, value[1].data);
-    n.data = ngx_pcalloc(cf->pool, n.len + 1);
-    
-    if (NULL==n.data) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
-        return NGX_CONF_ERROR;
+        *pp = paths[i];
+
+        // Cached values are bound to the selector set
+        for (k=0 ; k<paths[i]->nkeys ; k++) {
+            it->selhash = ngx_json_extractor_hash(paths[i]->keys[k].data,
+                paths[i]->keys[k].len,
+                it->selhash ^ (paths[i]->slot << 8 | k));
+        }
     }
-    sprintf((char *)n.data, JSON_VAR_GEN_NAME_FORMAT, value[1].data);
-    
-    // Add JSON handle var
-    v = ngx_http_add_variable(cf, &n, NGX_HTTP_VAR_CHANGEABLE);
-    if (NULL == v) {
-        return NGX_CONF_ERROR;
+
+    for (i=0 ; i<jmcf->paths.nelts ; i++) {
+        it = paths[i]->item;
+        pp = it->paths.elts;
+
+        // Values of files are walked by the master, workers share them
+        if (NULL!=it->file && pp[0]==paths[i]
+            && NULL==get_json_file(NULL, it))
+            return NGX_ERROR;
+
+        // Values of constant documents are extracted only once
+        if (NULL==it->json || pp[0]!=paths[i])
+            continue;
+
+        st = get_json_values(cf->pool, it);
+        if (NULL==st)
+            return NGX_ERROR;
+
+        ngx_json_extractor_alloc_begin(arena);
+        walk_json_item(st, &it->root, it->json);
+        ngx_json_extractor_alloc_end();
+
+        for (k=0 ; k<it->paths.nelts ; k++)
+            pp[k]->value = st->values[pp[k]->slot];
     }
 
-    index = ngx_http_get_variable_index(cf, &n);
-    if (NGX_ERROR == index) {
-        return NGX_CONF_ERROR;
+    // Locations with parsed sources get counters
+    for (i=0 ; jmcf->status>0 && i<jmcf->paths.nelts ; i++) {
+        if (NGX_OK!=add_json_stat(jmcf, paths[i]->item))
+            return NGX_ERROR;
     }
-    
-    v->index        = index;
-    v->data         = (uintptr_t) value[1].data;
-    v->get_handler  = ngx_http_json_desc;
-    index           = NGX_CONF_UNSET_UINT;
-    
-    // If it varname
-    if ('$'==value[1].data[0]) {
-        n.len = value[1].len-1;
-        n.data = value[1].data+1;
-        index = ngx_http_get_variable_index(cf, &n);
-        if (NGX_ERROR == index) {
-            return NGX_CONF_ERROR;
-        }
+
+    sels = jmcf->selects.elts;
+    for (i=0 ; jmcf->status>0 && i<jmcf->selects.nelts ; i++) {
+        if (NGX_OK!=add_json_stat(jmcf, sels[i]->item))
+            return NGX_ERROR;
     }
-    
-    // Add item link
-    if (NGX_OK!=add_json_item(olcf, v->index, index, v->data, cf->pool)) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
-        return NGX_CONF_ERROR;
+
+    if (jmcf->status>0
+        && NGX_OK!=ngx_json_extractor_status_zone(cf, jmcf))
+        return NGX_ERROR;
+
+#if (NGX_THREADS)
+    // Large bodies are read before the content handler
+    if (jmcf->threads>0) {
+        cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+        h = ngx_array_push(&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+        if (NULL==h)
+            return NGX_ERROR;
+
+        *h = ngx_json_extractor_precontent_handler;
     }
-    
-    // Process values
-    for (i=2 ; i<cf->args->nelts ; i++) {
-        if ('$' != value[i].data[0]) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                    "Invalid variable name: [%V]", &value[i]);
-            return NGX_CONF_ERROR;
-        }
-        
-        value[i].data++;
-        value[i].len--;
-    
-        v = ngx_http_add_variable(cf, &value[i], NGX_HTTP_VAR_CHANGEABLE);
-        if (NULL == v) {
-            return NGX_CONF_ERROR;
-        }
-    
-        index = ngx_http_get_variable_index(cf, &value[i]);
-        if (NGX_ERROR == index) {
-            return NGX_CONF_ERROR;
-        }
-        
-        v->index        = index;
-        v->data         = (uintptr_t) value[1].data;
-        v->get_handler  = ngx_http_json_extract_var;
+#endif
+
+    if (jmcf->bodies>0) {
+        ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+        ngx_http_top_request_body_filter = ngx_json_extractor_body_filter;
     }
-    return NGX_CONF_OK;
+
+    if (jmcf->responses>0) {
+        ngx_http_next_header_filter = ngx_http_top_header_filter;
+        ngx_http_top_header_filter = ngx_json_extractor_response_header_filter;
+
+        ngx_http_next_body_filter = ngx_http_top_body_filter;
+        ngx_http_top_body_filter = ngx_json_extractor_response_body_filter;
+    }
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_json_extractor_init_process(ngx_cycle_t *cycle)
+{
+    if (NGX_OK!=ngx_json_extractor_status_process(cycle))
+        return NGX_ERROR;
+
+    return ngx_json_extractor_file_process(cycle);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-/// VARIABLE //////////////////////////////////////////////////////////////////
+/// FILTERS ///////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
 /**
- * Get JSON value
+ * Parse request body sources while the body is read,
+ * buffers are processed in place
  * @param r
- * @param v
- * @param data
+ * @param in
  * @return NGX_[STATUS]
  */
 static ngx_int_t
-ngx_http_json_extract_var(ngx_http_request_t *r, 
-    ngx_http_variable_value_t *v, uintptr_t data)
+ngx_json_extractor_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    if (0==data)
-        return NGX_ERROR;
-    
-    ngx_http_variable_t *vv;
-    json_t *j;
-    u_char *stext, *val;
+    ngx_json_extractor_ctx_t *ctx;
     ngx_json_extractor_loc_t *olcf;
 
     olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
 
-    vv = get_head_var(r, v);
-    if (NULL==vv) {
-        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
-            "Can`t find var");
-        return NGX_ERROR;
-    }
+    if (NULL==olcf->bodies || NULL==in)
+        return ngx_http_next_request_body_filter(r, in);
 
-    // Get JSON loaded context
-    j = get_json(r, data);
-    if (NULL==j) {
-        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
-            "JSON extract error: %s", data);
-        return NGX_ERROR;
-    }
+    // Body is parsed when it is read completely
+    ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+    if (NULL!=ctx && ctx->threads)
+        return ngx_http_next_request_body_filter(r, in);
 
-    // Search var
-    stext = ngx_http_json_pstrdup(r->pool, vv->name.data, vv->name.len);
-    
-    // Add offset if have prefix
-    if (olcf->prefix.data!=NULL && olcf->prefix.len>0) {
-        if (stext == (u_char *)ngx_strstr(stext, olcf->prefix.data))
-            stext += olcf->prefix.len;
-    }
+    if (NGX_OK!=feed_json_streams(r, olcf->bodies, in))
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    return ngx_http_next_request_body_filter(r, in);
+}
+
+/**
+ * Keep the response body of header only subrequests
+ * (auth_request) for the response sources
+ * @param r
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_json_extractor_response_header_filter(ngx_http_request_t *r)
+{
+    ngx_json_extractor_ctx_t *ctx;
+    ngx_json_extractor_loc_t *olcf;
+
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+
+    if (NULL==olcf->responses || r==r->main || !r->header_only)
+        return ngx_http_next_header_filter(r);
+
+    ctx = get_json_ctx(r);
+    if (NULL==ctx)
+        return NGX_ERROR;
+
+    // Body is read by the handler and dropped by the body filter
+    r->header_only = 0;
+    ctx->discard = 1;
+
+    return ngx_http_next_header_filter(r);
+}
+
+/**
+ * Parse response sources while the response passes,
+ * buffers are processed in place and sent further as they are
+ * @param r
+ * @param in
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_json_extractor_response_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in)
+{
+    ngx_chain_t *cl;
+    ngx_json_extractor_ctx_t *ctx;
+    ngx_json_extractor_loc_t *olcf;
+
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+
+    if (NULL==olcf->responses || NULL==in)
+        return ngx_http_next_body_filter(r, in);
+
+    if (NGX_OK!=feed_json_streams(r, olcf->responses, in))
+        return NGX_ERROR;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+
+    if (!ctx->discard)
+        return ngx_http_next_body_filter(r, in);
+
+    // Subrequest was asked for the header only
+    for (cl=in ; cl ; cl=cl->next) {
+        cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
+    }
+
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+///////////////////////////////////////////////////////////////////////////////
+/// PHASES ////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Read the body which may be parsed by the thread pool,
+ * small ones are left to the filter
+ * @param r
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_json_extractor_precontent_handler(ngx_http_request_t *r)
+{
+    ngx_int_t rc;
+    ngx_json_extractor_ctx_t *ctx;
+    ngx_json_extractor_loc_t *olcf;
+
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+
+    if (NULL==olcf->bodies || NULL==olcf->thread_pool || r!=r->main)
+        return NGX_DECLINED;
+
+    // Phases are run again when the body is parsed
+    ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+    if (NULL!=ctx && ctx->threads)
+        return ctx->phase;
+
+    // Length of chunked body is known when it is read
+    if (NULL!=r->request_body
+        || (!r->headers_in.chunked
+            && r->headers_in.content_length_n<(off_t) olcf->thread_size))
+        return NGX_DECLINED;
+
+    ctx = get_json_ctx(r);
+    if (NULL==ctx)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ctx->threads = 1;
+    ctx->phase = NGX_DONE;
+
+    rc = ngx_http_read_client_request_body(r,
+                                           ngx_json_extractor_body_handler);
+    if (rc>=NGX_HTTP_SPECIAL_RESPONSE)
+        return rc;
+
+    ngx_http_finalize_request(r, NGX_DONE);
+    return NGX_DONE;
+}
+
+/**
+ * Post the read body to the thread pool, the request goes on
+ * when it is parsed. Small bodies are parsed by the variable.
+ * @param r
+ */
+static void
+ngx_json_extractor_body_handler(ngx_http_request_t *r)
+{
+    off_t size;
+    ngx_uint_t i, n;
+    ngx_pool_t *pool;
+    ngx_chain_t *cl;
+    je_item_t **its;
+    je_stream_t *st, **stp;
+    ngx_pool_cleanup_t *cln;
+    ngx_http_request_body_t *rb;
+    ngx_json_extractor_ctx_t *ctx;
+    ngx_json_extractor_loc_t *olcf;
+
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+
+    ctx->phase = NGX_DECLINED;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    rb = r->request_body;
+    size = 0;
+
+    for (cl = NULL==rb ? NULL : rb->bufs ; cl ; cl=cl->next)
+        size += ngx_buf_size(cl->buf);
+
+    if (size<(off_t) olcf->thread_size)
+        goto done;
+
+    // Task allocates only from own pool, it lives as long as the request
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+    if (NULL==pool)
+        goto done;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (NULL==cln) {
+        ngx_destroy_pool(pool);
+        goto done;
+    }
+
+    cln->handler = (ngx_pool_cleanup_pt) ngx_destroy_pool;
+    cln->data = pool;
+
+    n = ctx->streams.nelts;
+    its = olcf->bodies->elts;
+
+    for (i=0 ; i<olcf->bodies->nelts ; i++) {
+        st = create_json_stream(r, pool, its[i]);
+        stp = ngx_array_push(&ctx->streams);
+        if (NULL==st || NULL==stp)
+            goto failed;
+        *stp = st;
+    }
+
+    stp = ctx->streams.elts;
+
+    if (NGX_OK==ngx_json_extractor_thread_parse(r, olcf->thread_pool,
+                                                stp + n, olcf->bodies->nelts,
+                                                rb->bufs))
+        return;
+
+failed:
+
+    // Queue is full, the variable parses the body on the event loop
+    ngx_log_error_core(NGX_LOG_WARN, r->connection->log, 0,
+        "JSON body is not parsed by thread pool");
+    ctx->streams.nelts = n;
+
+done:
+
+    ngx_http_core_run_phases(r);
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+/// MAIN CONFIGS //////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static void *
+ngx_json_extractor_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_json_extractor_main_t  *jmcf;
+
+    jmcf = ngx_pcalloc(cf->pool, sizeof(ngx_json_extractor_main_t));
+    if (NULL == jmcf) {
+        return NULL;
+    }
+
+    if (NGX_OK!=ngx_array_init(&jmcf->paths, cf->pool, 4, sizeof(je_path_t *)))
+        return NULL;
+
+    if (NGX_OK!=ngx_array_init(&jmcf->selects, cf->pool, 1,
+                               sizeof(je_select_t *)))
+        return NULL;
+
+    if (NGX_OK!=ngx_array_init(&jmcf->stat_names, cf->pool, 4,
+                               sizeof(ngx_str_t)))
+        return NULL;
+
+    if (NGX_OK!=ngx_array_init(&jmcf->files, cf->pool, 1,
+                               sizeof(je_file_t *)))
+        return NULL;
+
+    jmcf->file_check = NGX_CONF_UNSET_MSEC;
+#if (NGX_THREADS)
+    jmcf->file_pool = NGX_CONF_UNSET_PTR;
+#endif
+
+    return jmcf;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// LOCATION CONFIGS //////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static void *
+ngx_json_extractor_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_json_extractor_loc_t  *olcf;
+
+    olcf = ngx_pcalloc(cf->pool, sizeof(ngx_json_extractor_loc_t));
+    if (NULL == olcf) {
+        return NULL;
+    }
+
+    olcf->engine = NGX_CONF_UNSET_UINT;
+    olcf->raw = NGX_CONF_UNSET;
+    olcf->cache = NGX_CONF_UNSET_PTR;
+    olcf->cache_ttl = NGX_CONF_UNSET;
+    olcf->lru = NGX_CONF_UNSET_UINT;
+    olcf->limits = NGX_CONF_UNSET_PTR;
+    olcf->stat = NGX_CONF_UNSET_UINT;
+#if (NGX_THREADS)
+    olcf->thread_pool = NGX_CONF_UNSET_PTR;
+    olcf->thread_size = NGX_CONF_UNSET_SIZE;
+#endif
+    return olcf;
+}
+
+static char *
+ngx_json_extractor_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_json_extractor_loc_t *prev = parent;
+    ngx_json_extractor_loc_t *conf = child;
+
+    ngx_conf_merge_str_value(conf->prefix,      prev->prefix,      "");
+    ngx_conf_merge_str_value(conf->separator,   prev->separator,   "");
+
+#if (NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE)
+    ngx_conf_merge_str_value(conf->default_val, prev->default_val, "");
+#endif
+
+    ngx_conf_merge_uint_value(conf->engine, prev->engine,
+                              NGX_JSON_EXTRACTOR_ENGINE_DOM);
+    ngx_conf_merge_value(conf->raw, prev->raw, 0);
+
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+    ngx_conf_merge_sec_value(conf->cache_ttl, prev->cache_ttl, 60);
+    // Unset is kept, the default depends on the source
+    ngx_conf_merge_uint_value(conf->lru, prev->lru, NGX_CONF_UNSET_UINT);
+    ngx_conf_merge_ptr_value(conf->limits, prev->limits, NULL);
+
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+    ngx_conf_merge_size_value(conf->thread_size, prev->thread_size,
+                              NGX_JSON_EXTRACTOR_THREAD_SIZE);
+#endif
+
+    // Body may be read or sent by nested location
+    if (NULL==conf->bodies)
+        conf->bodies = prev->bodies;
+
+    if (NULL==conf->responses)
+        conf->responses = prev->responses;
+
+    return NGX_CONF_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// COMMANDS //////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Extract json vars, json_extract_jwt takes the token payload,
+ * json_extract_file the document of a file
+ * json_extract [format=json|msgpack|cbor] source $var1 ...
+ * @param nginx config
+ * @param cmd - offset is the source of json_extract_jwt and json_extract_file
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_uint_t                       i, nelts;
+    ngx_str_t                        n;
+    ngx_int_t                        index, rc;
+    ngx_str_t                       *value;
+    ngx_http_variable_t             *v;
+    ngx_uint_t                       source, format;
+    je_item_t                       *it, **itp;
+    ngx_array_t                    **filtered;
+    je_path_t                       *path, **pp;
+    ngx_json_extractor_main_t       *jmcf;
+    ngx_http_core_loc_conf_t        *clcf;
+
+    ngx_json_extractor_loc_t   *olcf = conf;
+    value = cf->args->elts;
+    nelts = cf->args->nelts;
+    jmcf = ngx_http_conf_get_module_main_conf(cf, ngx_json_extractor_module);
+
+    // Optional "format=name" goes before the source
+    rc = get_json_format(&value[1], &format);
+
+    if (NGX_ERROR==rc || (NGX_OK==rc && nelts<4)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid format: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (NGX_OK==rc) {
+        value++;
+        nelts--;
+    }
+    
+    // Generate new temp var
+    n.len = snprintf(NULL, 0, JSON_VAR_GEN_NAME_FORMAT, value[1].data);
+    n.data = ngx_pcalloc(cf->pool, n.len + 1);
+    
+    if (NULL==n.data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
+        return NGX_CONF_ERROR;
+    }
+    sprintf((char *)n.data, JSON_VAR_GEN_NAME_FORMAT, value[1].data);
+    
+    // Add JSON handle var
+    v = ngx_http_add_variable(cf, &n, NGX_HTTP_VAR_CHANGEABLE);
+    if (NULL == v) {
+        return NGX_CONF_ERROR;
+    }
+
+    index = ngx_http_get_variable_index(cf, &n);
+    if (NGX_ERROR == index) {
+        return NGX_CONF_ERROR;
+    }
+    
+    v->index        = index;
+    v->get_handler  = ngx_http_json_desc;
+    index           = NGX_CONF_UNSET_UINT;
+    
+    source = NGX_JSON_EXTRACTOR_SOURCE_CONST;
+
+    // Path of the file is taken as is
+    if (NGX_JSON_EXTRACTOR_SOURCE_FILE==cmd->offset) {
+        source = NGX_JSON_EXTRACTOR_SOURCE_FILE;
+
+    // Request body is read by the filter, not by the variable
+    } else if (value[1].len==sizeof("$request_body")-1
+        && 0==ngx_strncmp(value[1].data, "$request_body", value[1].len))
+    {
+        source = NGX_JSON_EXTRACTOR_SOURCE_BODY;
+
+    // Response of this location, subrequests included
+    } else if (value[1].len==sizeof("$response_body")-1
+        && 0==ngx_strncmp(value[1].data, "$response_body", value[1].len))
+    {
+        source = NGX_JSON_EXTRACTOR_SOURCE_RESPONSE;
+
+    // If it varname
+    } else if ('$'==value[1].data[0]) {
+        source = NGX_JSON_EXTRACTOR_SOURCE_JWT==cmd->offset
+               ? NGX_JSON_EXTRACTOR_SOURCE_JWT
+               : NGX_JSON_EXTRACTOR_SOURCE_VARIABLE;
+        n.len = value[1].len-1;
+        n.data = value[1].data+1;
+        index = ngx_http_get_variable_index(cf, &n);
+        if (NGX_ERROR == index) {
+            return NGX_CONF_ERROR;
+        }
+    }
+    
+    // Token is taken from a variable only
+    if (NGX_JSON_EXTRACTOR_SOURCE_JWT==cmd->offset
+        && NGX_JSON_EXTRACTOR_SOURCE_JWT!=source)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid token variable: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    // Binary documents do not fit into the configuration,
+    // files are parsed into a tape
+    if (NGX_JSON_EXTRACTOR_FORMAT_JSON!=format
+        && (NGX_JSON_EXTRACTOR_SOURCE_CONST==source
+            || NGX_JSON_EXTRACTOR_SOURCE_FILE==source))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid binary source: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    // Add item link
+    it = add_json_item(olcf, v->index, index, (uintptr_t) value[1].data,
+                       cf->pool);
+    if (NULL==it) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
+        return NGX_CONF_ERROR;
+    }
+    it->source = source;
+    it->format = format;
+
+    // Counters are shown by the location
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    olcf->name = clcf->name;
+
+    it->selhash = format;                   // Cached values of one format
+    v->data = (uintptr_t) it;
+
+    if (NGX_JSON_EXTRACTOR_SOURCE_BODY==source
+        || NGX_JSON_EXTRACTOR_SOURCE_RESPONSE==source)
+    {
+        if (NGX_JSON_EXTRACTOR_SOURCE_BODY==source) {
+            filtered = &olcf->bodies;
+            jmcf->bodies++;
+        } else {
+            filtered = &olcf->responses;
+            jmcf->responses++;
+        }
+
+        if (NULL==*filtered) {
+            *filtered = ngx_array_create(cf->pool, 1, sizeof(je_item_t *));
+            if (NULL==*filtered)
+                return NGX_CONF_ERROR;
+        }
+
+        itp = ngx_array_push(*filtered);
+        if (NULL==itp)
+            return NGX_CONF_ERROR;
+
+        *itp = it;
+    }
+
+    // Constant JSON is parsed once for all workers
+    if (NGX_JSON_EXTRACTOR_SOURCE_CONST==source
+        && NGX_OK!=load_json_const(cf, it, &value[1]))
+        return NGX_CONF_ERROR;
+
+    // So is the file, workers reload it when it is changed
+    if (NGX_JSON_EXTRACTOR_SOURCE_FILE==source) {
+        it->file = ngx_json_extractor_file_open(cf, &jmcf->files, &value[1]);
+        if (NULL==it->file)
+            return NGX_CONF_ERROR;
+    }
+    
+    // Process values
+    for (i=2 ; i<nelts ; i++) {
+        if ('$' != value[i].data[0]) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Invalid variable name: [%V]", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+        
+        value[i].data++;
+        value[i].len--;
+    
+        v = ngx_http_add_variable(cf, &value[i], NGX_HTTP_VAR_CHANGEABLE);
+        if (NULL == v) {
+            return NGX_CONF_ERROR;
+        }
+    
+        index = ngx_http_get_variable_index(cf, &value[i]);
+        if (NGX_ERROR == index) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (NGX_OK!=check_json_var(cf, v, it))
+            return NGX_CONF_ERROR;
+
+        // Selector is compiled on postconfiguration
+        path = ngx_pcalloc(cf->pool, sizeof(je_path_t));
+        pp = ngx_array_push(&jmcf->paths);
+        if (NULL==path || NULL==pp) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
+            return NGX_CONF_ERROR;
+        }
+
+        // Keys are taken from the name lowercased by nginx
+        path->item      = it;
+        path->name      = v->name;
+        path->index     = index;
+        *pp             = path;
+        
+        v->index        = index;
+        v->data         = (uintptr_t) path;
+        v->get_handler  = ngx_http_json_extract_var;
+    }
+    return NGX_CONF_OK;
+}
+
+/**
+ * Extract json var by the selector evaluated for every request
+ * json_extract_select [format=json|msgpack|cbor] source selector $var
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract_select(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_uint_t                          nelts, source, format;
+    ngx_int_t                           index, rc;
+    ngx_str_t                          *value;
+    ngx_http_variable_t                *v;
+    je_select_t                        *sel, **selp;
+    ngx_json_extractor_main_t          *jmcf;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_compile_complex_value_t    ccv;
+
+    ngx_json_extractor_loc_t   *olcf = conf;
+    value = cf->args->elts;
+    nelts = cf->args->nelts;
+    jmcf = ngx_http_conf_get_module_main_conf(cf, ngx_json_extractor_module);
+
+    rc = get_json_format(&value[1], &format);
+
+    if (NGX_ERROR==rc || (NGX_OK==rc && nelts<5)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid format: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (NGX_OK==rc) {
+        value++;
+        nelts--;
+    }
+
+    if (4!=nelts || '$'!=value[3].data[0]) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid variable name: [%V]", &value[nelts-1]);
+        return NGX_CONF_ERROR;
+    }
+
+    index = NGX_CONF_UNSET_UINT;
+    source = NGX_JSON_EXTRACTOR_SOURCE_CONST;
+
+    // Response is not kept when the variable is read
+    if (value[1].len==sizeof("$response_body")-1
+        && 0==ngx_strncmp(value[1].data, "$response_body", value[1].len))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid select source: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    // Body is read by the location, the variable walks its buffers
+    if (value[1].len==sizeof("$request_body")-1
+        && 0==ngx_strncmp(value[1].data, "$request_body", value[1].len))
+    {
+        source = NGX_JSON_EXTRACTOR_SOURCE_BODY;
+
+    } else if ('$'==value[1].data[0]) {
+        source = NGX_JSON_EXTRACTOR_SOURCE_VARIABLE;
+        value[1].data++;
+        value[1].len--;
+
+        index = ngx_http_get_variable_index(cf, &value[1]);
+        if (NGX_ERROR == index) {
+            return NGX_CONF_ERROR;
+        }
+
+    } else if (NGX_JSON_EXTRACTOR_FORMAT_JSON!=format) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid binary source: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    sel = ngx_pcalloc(cf->pool, sizeof(je_select_t));
+    selp = ngx_array_push(&jmcf->selects);
+    if (NULL==sel || NULL==selp) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
+        return NGX_CONF_ERROR;
+    }
+
+    // Item keeps the source, selectors are compiled into own items
+    sel->item = add_json_item(olcf, NGX_CONF_UNSET_UINT, index,
+                              (uintptr_t) value[1].data, cf->pool);
+    if (NULL==sel->item) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid memory alloc");
+        return NGX_CONF_ERROR;
+    }
+    sel->item->source = source;
+    sel->item->format = format;
+    *selp = sel;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    olcf->name = clcf->name;
+
+    if (NGX_JSON_EXTRACTOR_SOURCE_CONST==source
+        && NGX_OK!=load_json_const(cf, sel->item, &value[1]))
+        return NGX_CONF_ERROR;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &sel->selector;
+
+    if (NGX_OK!=ngx_http_compile_complex_value(&ccv))
+        return NGX_CONF_ERROR;
+
+    value[3].data++;
+    value[3].len--;
+
+    v = ngx_http_add_variable(cf, &value[3], NGX_HTTP_VAR_CHANGEABLE);
+    if (NULL == v) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (NGX_OK!=check_json_var(cf, v, NULL))
+        return NGX_CONF_ERROR;
+
+    v->data         = (uintptr_t) sel;
+    v->get_handler  = ngx_http_json_select;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Build JSON document from variables
+ * json_build $var { key $value [string|number|bool|json]; ... }
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_build(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    je_build_t             *b;
+    ngx_str_t              *value;
+    ngx_http_variable_t    *v;
+
+    value = cf->args->elts;
+
+    if ('$'!=value[1].data[0]) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid variable name: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    value[1].data++;
+    value[1].len--;
+
+    // Arguments are reused by the block
+    v = ngx_http_add_variable(cf, &value[1], NGX_HTTP_VAR_CHANGEABLE);
+    if (NULL == v) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (NGX_OK!=check_json_var(cf, v, NULL))
+        return NGX_CONF_ERROR;
+
+    b = ngx_json_extractor_build_block(cf);
+    if (NULL==b)
+        return NGX_CONF_ERROR;
+
+    v->data         = (uintptr_t) b;
+    v->get_handler  = ngx_http_json_build_var;
+
+    return NGX_CONF_OK;
+}
+
+/**
+ * Cache extracted values in shared memory
+ * json_extract_cache zone=name:size [ttl=time] | off
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                     *p;
+    ssize_t                     size;
+    ngx_str_t                  *value, name, s;
+    ngx_int_t                   ttl;
+    ngx_uint_t                  i;
+    ngx_json_extractor_loc_t   *olcf = conf;
+
+    value = cf->args->elts;
+
+    if (NGX_CONF_UNSET_PTR!=olcf->cache)
+        return "is duplicate";
+
+    if (0==ngx_strcmp(value[1].data, "off")) {
+        olcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    size = 0;
+    ttl = NGX_CONF_UNSET;
+    ngx_str_null(&name);
+
+    for (i=1 ; i<cf->args->nelts ; i++) {
+        if (0==ngx_strncmp(value[i].data, "zone=", 5)) {
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+
+            // Size is optional when the zone is declared elsewhere
+            p = (u_char *) ngx_strchr(name.data, ':');
+            if (NULL!=p) {
+                name.len = p - name.data;
+
+                s.data = p + 1;
+                s.len = value[i].data + value[i].len - s.data;
+
+                size = ngx_parse_size(&s);
+                if (NGX_ERROR==size || size<(ssize_t) (8 * ngx_pagesize)) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                        "Invalid zone size: [%V]", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+            continue;
+        }
+
+        if (0==ngx_strncmp(value[i].data, "ttl=", 4)) {
+            s.data = value[i].data + 4;
+            s.len = value[i].len - 4;
+
+            ttl = ngx_parse_time(&s, 1);
+            if (NGX_ERROR==ttl) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Invalid ttl: [%V]", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "Invalid parameter: [%V]", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (0==name.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"%V\" must have \"zone\" parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    olcf->cache = ngx_json_extractor_cache_zone(cf, &name, size);
+    if (NULL==olcf->cache)
+        return NGX_CONF_ERROR;
+
+    olcf->cache_ttl = ttl;
+    return NGX_CONF_OK;
+}
+
+/**
+ * Size of the worker cache of recent sources
+ * json_extract_lru entries | off
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract_lru(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                   n;
+    ngx_str_t                  *value;
+    ngx_json_extractor_loc_t   *olcf = conf;
+
+    value = cf->args->elts;
+
+    if (NGX_CONF_UNSET_UINT!=olcf->lru)
+        return "is duplicate";
+
+    // Sources which never repeat
+    if (0==ngx_strcmp(value[1].data, "off")) {
+        olcf->lru = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (NGX_ERROR==n || 0==n) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "Invalid entries number: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    olcf->lru = n;
+    return NGX_CONF_OK;
+}
+
+/**
+ * Limit documents of the location, zero is no limit
+ * json_extract_limits [size=size] [depth=n] [tokens=n] [elements=n] | off
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract_limits(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_int_t                   n;
+    ngx_str_t                  *value, s;
+    ngx_uint_t                  i, *counter;
+    je_limits_t                *lm;
+    ngx_json_extractor_loc_t   *olcf = conf;
+
+    value = cf->args->elts;
+
+    if (NGX_CONF_UNSET_PTR!=olcf->limits)
+        return "is duplicate";
+
+    if (0==ngx_strcmp(value[1].data, "off")) {
+        olcf->limits = NULL;
+        return NGX_CONF_OK;
+    }
+
+    lm = ngx_pcalloc(cf->pool, sizeof(je_limits_t));
+    if (NULL==lm)
+        return NGX_CONF_ERROR;
+
+    for (i=1 ; i<cf->args->nelts ; i++) {
+        if (0==ngx_strncmp(value[i].data, "size=", 5)) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            n = ngx_parse_size(&s);
+            if (NGX_ERROR==n) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Invalid size: [%V]", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            lm->size = n;
+            continue;
+        }
+
+        if (0==ngx_strncmp(value[i].data, "depth=", 6)) {
+            counter = &lm->depth;
+            s.data = value[i].data + 6;
+
+        } else if (0==ngx_strncmp(value[i].data, "tokens=", 7)) {
+            counter = &lm->tokens;
+            s.data = value[i].data + 7;
+
+        } else if (0==ngx_strncmp(value[i].data, "elements=", 9)) {
+            counter = &lm->elements;
+            s.data = value[i].data + 9;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid parameter: [%V]", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[i].data + value[i].len - s.data;
+
+        n = ngx_atoi(s.data, s.len);
+        if (NGX_ERROR==n) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid number: [%V]", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        *counter = n;
+    }
+
+    olcf->limits = lm;
+    return NGX_CONF_OK;
+}
+
+/**
+ * Parse large request bodies of the location by a thread pool
+ * json_extract_threads pool=name [size=size] | off
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ssize_t                     size;
+    ngx_str_t                  *value, name, s;
+    ngx_uint_t                  i;
+    ngx_json_extractor_main_t  *jmcf;
+    ngx_json_extractor_loc_t   *olcf = conf;
+
+    value = cf->args->elts;
+
+    if (NGX_CONF_UNSET_PTR!=olcf->thread_pool)
+        return "is duplicate";
+
+    if (0==ngx_strcmp(value[1].data, "off")) {
+        olcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_null(&name);
+
+    for (i=1 ; i<cf->args->nelts ; i++) {
+        if (0==ngx_strncmp(value[i].data, "pool=", 5)) {
+            name.data = value[i].data + 5;
+            name.len = value[i].len - 5;
+            continue;
+        }
+
+        if (0==ngx_strncmp(value[i].data, "size=", 5)) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            size = ngx_parse_size(&s);
+            if (NGX_ERROR==size) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "Invalid size: [%V]", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            olcf->thread_size = size;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "Invalid parameter: [%V]", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (0==name.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"%V\" must have \"pool\" parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    // "default" pool is created unless it is declared by thread_pool
+    olcf->thread_pool = ngx_thread_pool_add(cf, &name);
+    if (NULL==olcf->thread_pool)
+        return NGX_CONF_ERROR;
+
+    jmcf = ngx_http_conf_get_module_main_conf(cf, ngx_json_extractor_module);
+    jmcf->threads++;
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+        "\"%V\" needs nginx built --with-threads", &cmd->name);
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * Check files of json_extract_file once in the interval, files are
+ * reloaded by a thread pool
+ * json_extract_file_check time [pool=name]
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extract_file_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_int_t                   check;
+    ngx_str_t                  *value, name;
+    ngx_json_extractor_main_t  *jmcf = conf;
+
+    value = cf->args->elts;
+
+    if (NGX_CONF_UNSET_MSEC!=jmcf->file_check)
+        return "is duplicate";
+
+    check = ngx_parse_time(&value[1], 0);
+    if (NGX_ERROR==check) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "Invalid time: [%V]", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    jmcf->file_check = (ngx_msec_t) check;
+
+    if (2==cf->args->nelts)
+        return NGX_CONF_OK;
+
+    if (value[2].len<=5 || 0!=ngx_strncmp(value[2].data, "pool=", 5)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "Invalid parameter: [%V]", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[2].data + 5;
+    name.len = value[2].len - 5;
+
+#if (NGX_THREADS)
+    jmcf->file_pool = ngx_thread_pool_add(cf, &name);
+    if (NULL==jmcf->file_pool)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+        "\"%V\" pool \"%V\" needs nginx built --with-threads",
+        &cmd->name, &name);
+    return NGX_CONF_ERROR;
+#endif
+}
+
+/**
+ * Show counters of all locations
+ * json_extractor_status [json|prometheus]
+ * @param nginx config
+ * @param cmd
+ * @param conf
+ * @return nginx state
+ */
+static char *
+ngx_http_json_extractor_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                  *value;
+    ngx_http_core_loc_conf_t   *clcf;
+    ngx_json_extractor_main_t  *jmcf;
+    ngx_json_extractor_loc_t   *olcf = conf;
+
+    value = cf->args->elts;
+
+    if (olcf->status)
+        return "is duplicate";
+
+    olcf->status = NGX_JSON_EXTRACTOR_STATUS_JSON;
+
+    if (2==cf->args->nelts) {
+        if (0==ngx_strcmp(value[1].data, "prometheus")) {
+            olcf->status = NGX_JSON_EXTRACTOR_STATUS_PROMETHEUS;
+
+        } else if (0!=ngx_strcmp(value[1].data, "json")) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "Invalid format: [%V]", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_json_extractor_status_handler;
+
+    jmcf = ngx_http_conf_get_module_main_conf(cf, ngx_json_extractor_module);
+    jmcf->status++;
+
+    return NGX_CONF_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// VARIABLE //////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Get JSON value
+ * @param r
+ * @param v
+ * @param data
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_extract_var(ngx_http_request_t *r, 
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    if (0==data)
+        return NGX_ERROR;
+    
+    je_path_t *path;
+    je_stream_t *st;
+    ngx_http_variable_value_t *jv;
+    ngx_str_t val;
+    ngx_uint_t partial;
+
+    partial = 0;
+    path = (je_path_t *) data;
+
+    // Constant document, value is ready
+    if (NULL!=path->item->json) {
+        val = path->value;
+        goto done;
+    }
+
+    // Siblings are usually set by the descriptor already
+    jv = ngx_http_get_indexed_variable(r, path->item->index);
+    if (NULL==jv || NULL==jv->data) {
+        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
+            "JSON extract error: %V", &path->name);
+        return NGX_ERROR;
+    }
+
+    // Worker cache entries are wrapped by the descriptor too
+    st = (je_stream_t *)jv->data;
+    val = st->values[path->slot];
+    partial = NGX_AGAIN==st->rc;
+
+done:
+
+    if (NGX_OK!=set_json_value(r, v, &val, partial)) {
+        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
+            "Failed value: %V", &path->name);
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+/**
+ * Get JSON object
+ * @param r
+ * @param v
+ * @param data
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_desc(ngx_http_request_t *r, 
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    if (data==0)
+        return NGX_ERROR;
+
+    json_error_t error;
+    je_item_t *jit;
+    je_stream_t *st;
+    ngx_int_t rc;
+    uint64_t hash, lhash;
+    ngx_str_t sv, doc;
+    ngx_shm_zone_t *cache;
+    je_lru_node_t *ln;
+    ngx_http_request_body_t *rb;
+    ngx_json_extractor_ctx_t *ctx;
+    ngx_http_variable_value_t *src;
+    uint64_t t;
+
+    jit = (je_item_t *)data;
+
+    // Constant document is shared and must not be released
+    if (NULL!=jit->json) {
+        v->len = 0;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+        v->data = (u_char *)jit->json;
+        return NGX_OK;
+    }
+
+    if (NGX_JSON_EXTRACTOR_SOURCE_BODY==jit->source
+        || NGX_JSON_EXTRACTOR_SOURCE_RESPONSE==jit->source)
+    {
+        ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+        st = NULL==ctx ? NULL : get_json_stream(ctx, jit);
+
+        if (NULL!=st)
+            goto stream_done;
+
+        st = create_json_stream(r, r->pool, jit);
+        if (NULL==st)
+            return NGX_ERROR;
+
+        // Response was not sent yet, values are not cached
+        if (NGX_JSON_EXTRACTOR_SOURCE_RESPONSE==jit->source)
+            goto stream_done;
+
+        // Body was read without the filter, file parts are read by pread
+        rb = r->request_body;
+        if (NULL!=rb && 0==rb->rest) {
+            t = ngx_json_extractor_stat_time();
+
+            if (NULL==rb->bufs) {
+                st->rc = NGX_OK;
+            } else if (NGX_AGAIN==ngx_json_extractor_stream_chain(st,
+                                                                  rb->bufs))
+            {
+                st->rc = ngx_json_extractor_stream_finish(st);
+            }
+
+            ngx_json_extractor_stat_parse(jit, st->offset,
+                ngx_json_extractor_stat_time() - t, st->rc);
+        }
+
+        goto stream_done;
+    }
+
+    // File document is walked once for every version of the file
+    if (NGX_JSON_EXTRACTOR_SOURCE_FILE==jit->source) {
+        st = ngx_pcalloc(r->pool, sizeof(je_stream_t));
+        if (NULL==st)
+            return NGX_ERROR;
+
+        st->values = get_json_file(r->pool, jit);
+        if (NULL==st->values)
+            return NGX_ERROR;
+
+        st->pool = r->pool;
+        st->item = jit;
+        st->rc = NGX_OK;
+
+        goto stream_done;
+    }
+
+    if (NGX_CONF_UNSET_UINT==jit->data_index) {
+        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
+            "Invalid JSON descriptor");
+        return NGX_ERROR;
+    }
+
+    src = ngx_http_get_indexed_variable(r, jit->data_index);
+    if (NULL == src || src->not_found) {
+        return NGX_ERROR;
+    }
+
+    st = NULL;
+    cache = jit->cache;
+    hash = 0;
+    sv.data = src->data;
+    sv.len = src->len;
+
+    // Long sources are not hashed, decoded or parsed
+    if (NULL!=jit->limits && jit->limits->size
+        && sv.len>jit->limits->size)
+    {
+        st = get_json_values(r->pool, jit);
+        if (NULL==st)
+            return NGX_ERROR;
+
+        st->rc = ngx_json_extractor_limits_over(st, "size", 0);
+        ngx_json_extractor_stat_parse(jit, sv.len, 0, st->rc);
+        goto stream_done;
+    }
+
+    // Worker cache is looked up before the shared one, long sources
+    // are not kept by both
+    lhash = 0;
+    if (jit->lru_size>0 && sv.len<=NGX_JSON_EXTRACTOR_CACHE_SOURCE) {
+        lhash = ngx_json_extractor_hash(sv.data, sv.len, 0);
+
+        ln = ngx_json_extractor_lru_get(jit, lhash, &sv);
+        if (NULL!=ln) {
+            ngx_json_extractor_stat_add(jit, offsetof(je_stat_t, lru_hits), 1);
+            goto lru_done;
+        }
+    }
+
+    // Both engines keep values per slot
+    if (NGX_JSON_EXTRACTOR_ENGINE_STREAM==jit->engine) {
+        st = ngx_json_extractor_stream_create(r->pool, jit);
+    } else {
+        st = get_json_values(r->pool, jit);
+    }
+
+    if (NULL==st)
+        return NGX_ERROR;
+
+    // Source lives as long as the request, values are slices of it
+    st->inplace = 1;
+
+    if (NULL!=cache) {
+        ctx = get_json_ctx(r);
+        if (NULL==ctx)
+            return NGX_ERROR;
+
+        if (sv.len>NGX_JSON_EXTRACTOR_CACHE_SOURCE) {
+            ctx->cache_status = NGX_JSON_EXTRACTOR_CACHE_BYPASS;
+            cache = NULL;
+
+        } else {
+            hash = ngx_json_extractor_hash(sv.data, sv.len, jit->selhash);
+
+            rc = ngx_json_extractor_cache_get(cache, hash, &sv, st);
+            if (NGX_ERROR==rc)
+                return NGX_ERROR;
+
+            if (NGX_OK==rc) {
+                ctx->cache_status = NGX_JSON_EXTRACTOR_CACHE_HIT;
+                ngx_json_extractor_stat_add(jit,
+                    offsetof(je_stat_t, cache_hits), 1);
+                cache = NULL;
+                goto stream_put;
+            }
+
+            ctx->cache_status = NGX_JSON_EXTRACTOR_CACHE_MISS;
+            ngx_json_extractor_stat_add(jit,
+                offsetof(je_stat_t, cache_misses), 1);
+        }
+    }
+
+    t = ngx_json_extractor_stat_time();
+
+    // Caches are keyed by the token, payload is decoded on miss only
+    doc = sv;
+    if (NGX_JSON_EXTRACTOR_SOURCE_JWT==jit->source
+        && NGX_OK!=get_json_jwt(r->pool, &sv, &doc))
+    {
+        ngx_json_extractor_stat_parse(jit, sv.len, 0, NGX_ERROR);
+        ngx_log_error_core(NGX_LOG_INFO, r->connection->log, 0,
+            "Invalid JWT payload");
+        return NGX_ERROR;
+    }
+
+    // Single pass over the source, only requested values are kept
+    if (NGX_JSON_EXTRACTOR_ENGINE_STREAM==jit->engine) {
+        st->rc = ngx_json_extractor_stream_feed(st, doc.data,
+                                                doc.data + doc.len);
+        if (NGX_AGAIN==st->rc)
+            st->rc = ngx_json_extractor_stream_finish(st);
+
+        ngx_json_extractor_stat_parse(jit, doc.len,
+            ngx_json_extractor_stat_time() - t, st->rc);
+        goto stream_put;
+    }
+
+    // Document is checked before libjansson builds it
+    if (NULL!=jit->limits) {
+        st->rc = ngx_json_extractor_limits_feed(st, doc.data,
+                                                doc.data + doc.len);
+        if (NGX_OK!=st->rc) {
+            ngx_json_extractor_stat_parse(jit, doc.len,
+                ngx_json_extractor_stat_time() - t, st->rc);
+            goto stream_put;
+        }
+    }
+
+    // Other locations and subrequests may have parsed the source
+    if (0==lhash)
+        lhash = ngx_json_extractor_hash(sv.data, sv.len, 0);
+
+    rc = walk_json_doc(r, jit, st, &sv, &doc, lhash, &error);
+    if (NGX_ERROR==rc)
+        return NGX_ERROR;
+
+    if (NGX_DONE!=rc)
+        ngx_json_extractor_stat_parse(jit, doc.len,
+            ngx_json_extractor_stat_time() - t,
+            NGX_OK==rc ? NGX_OK : NGX_ERROR);
+
+    if (NGX_DECLINED==rc) {
+        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
+            "JSON string parse error: line[%d] column[%d] position[%d]\n%s",
+                error.line, error.column, error.position, error.text);
+        return NGX_ERROR;
+    }
+
+    st->rc = NGX_OK;
+
+stream_put:
+
+    if (NULL!=cache && NGX_OK==st->rc)
+        ngx_json_extractor_cache_put(cache, jit->cache_ttl, hash, &sv, st);
+
+    if (0==jit->lru_size || NGX_OK!=st->rc
+        || sv.len>NGX_JSON_EXTRACTOR_CACHE_SOURCE)
+        goto stream_done;
+
+    ln = ngx_json_extractor_lru_add(jit, lhash, &sv, st);
+    if (NULL==ln)
+        return NGX_ERROR;
+
+lru_done:
+
+    // Entry may be evicted by other requests meanwhile
+    if (NGX_OK!=ngx_json_extractor_lru_pin(r->pool, ln))
+        return NGX_ERROR;
+
+    // Descriptor always holds values as a stream
+    st = ngx_pcalloc(r->pool, sizeof(je_stream_t));
+    if (NULL==st)
+        return NGX_ERROR;
+
+    st->pool = r->pool;
+    st->item = jit;
+    st->values = ln->values;
+    st->rc = NGX_OK;
+
+stream_done:
+
+    if (NGX_ERROR==st->rc) {
+        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
+            "JSON stream parse error: position[%O]", st->offset);
+        return NGX_ERROR;
+    }
+
+    // Values of the document over the limits are default
+    if (NGX_OK==st->rc || NGX_DECLINED==st->rc)
+        set_json_vars(r, jit, st->values);
+
+    // Body is not read or sent completely yet
+    v->len = 0;
+    v->valid = 1;
+    v->no_cacheable = NGX_AGAIN==st->rc;
+    v->not_found = 0;
+    v->data = (u_char *)st;
+
+    return NGX_OK;
+}
+
+/**
+ * Get value of json_extract_select, the source is parsed
+ * for the selector of the request alone
+ * @param r
+ * @param v
+ * @param data
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_select(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    json_error_t error;
+    je_item_t *it;
+    je_stream_t *st;
+    je_select_t *sel;
+    je_arena_t *arena;
+    ngx_str_t key, doc;
+    ngx_uint_t partial;
+    uint64_t t, hash;
+    ngx_int_t rc;
+    ngx_http_request_body_t *rb;
+    ngx_http_variable_value_t *src;
+
+    sel = (je_select_t *) data;
+
+    if (NGX_OK!=ngx_http_complex_value(r, &sel->selector, &key))
+        return NGX_ERROR;
+
+    it = get_json_select(r, sel, &key);
+    if (NULL==it)
+        return NGX_ERROR;
+
+    partial = 0;
+    t = ngx_json_extractor_stat_time();
+
+    switch (it->source) {
+
+    // Constant document is walked by the trie of the selector
+    case NGX_JSON_EXTRACTOR_SOURCE_CONST:
+        st = get_json_values(r->pool, it);
+        if (NULL==st)
+            return NGX_ERROR;
+
+        arena = get_json_arena(r);
+        if (NULL==arena)
+            return NGX_ERROR;
+
+        ngx_json_extractor_alloc_begin(arena);
+        walk_json_item(st, &it->root, it->json);
+        ngx_json_extractor_alloc_end();
+
+        st->rc = NGX_OK;
+        goto done;
+
+    // Body was read by the location, file parts are read by pread
+    case NGX_JSON_EXTRACTOR_SOURCE_BODY:
+        st = create_json_stream(r, r->pool, it);
+        if (NULL==st)
+            return NGX_ERROR;
+
+        rb = r->request_body;
+        if (NULL==rb || rb->rest) {
+            partial = 1;
+            goto done;
+        }
+
+        if (NULL==rb->bufs) {
+            st->rc = NGX_OK;
+        } else if (NGX_AGAIN==ngx_json_extractor_stream_chain(st, rb->bufs)) {
+            st->rc = ngx_json_extractor_stream_finish(st);
+        }
+
+        doc.len = st->offset;
+        break;
+
+    default:
+        src = ngx_http_get_indexed_variable(r, it->data_index);
+        if (NULL == src || src->not_found) {
+            return NGX_ERROR;
+        }
+
+        doc.data = src->data;
+        doc.len = src->len;
+
+        if (NGX_JSON_EXTRACTOR_ENGINE_STREAM==it->engine) {
+            st = ngx_json_extractor_stream_create(r->pool, it);
+            if (NULL==st)
+                return NGX_ERROR;
+
+            st->inplace = 1;
+            st->rc = ngx_json_extractor_stream_feed(st, doc.data,
+                                                    doc.data + doc.len);
+            if (NGX_AGAIN==st->rc)
+                st->rc = ngx_json_extractor_stream_finish(st);
+            break;
+        }
+
+        st = get_json_values(r->pool, it);
+        if (NULL==st)
+            return NGX_ERROR;
+
+        st->inplace = 1;
+
+        if (NULL!=it->limits) {
+            st->rc = ngx_json_extractor_limits_feed(st, doc.data,
+                                                    doc.data + doc.len);
+            if (NGX_OK!=st->rc)
+                break;
+        }
+
+        hash = ngx_json_extractor_hash(doc.data, doc.len, 0);
+
+        // Parsed once for all selectors of the source
+        rc = walk_json_doc(r, it, st, &doc, &doc, hash, &error);
+        if (NGX_ERROR==rc)
+            return NGX_ERROR;
+
+        st->rc = NGX_DECLINED==rc ? NGX_ERROR : NGX_OK;
+
+        if (NGX_DONE==rc)
+            goto done;
+        break;
+    }
+
+    ngx_json_extractor_stat_parse(it, doc.len,
+        ngx_json_extractor_stat_time() - t, st->rc);
+
+    if (NGX_ERROR==st->rc) {
+        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
+            "JSON select parse error: [%V]", &key);
+        return NGX_ERROR;
+    }
+
+done:
+
+    if (!partial && NULL==st->values[0].data)
+        ngx_json_extractor_stat_add(it, offsetof(je_stat_t, defaults), 1);
+
+    if (NGX_OK!=set_json_value(r, v, &st->values[0], partial))
+        v->not_found = 1;
+
+    return NGX_OK;
+}
+
+/**
+ * Get document of json_build
+ * @param r
+ * @param v
+ * @param data
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_build_var(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_str_t out;
+
+    if (NGX_OK!=ngx_json_extractor_build(r, (je_build_t *) data, &out))
+        return NGX_ERROR;
+
+    v->len = out.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = out.data;
+
+    return NGX_OK;
+}
+
+/**
+ * Release constant JSON with configuration
+ * @param data json_t*
+ */
+static void
+ngx_http_json_conf_cleanup(void *data)
+{
+    // Heap chunks of the module carry the owner ahead
+    ngx_json_extractor_alloc_begin(NULL);
+    json_decref((json_t *)data);
+    ngx_json_extractor_alloc_end();
+}
+
+/**
+ * Cache status of the last extracted source: HIT, MISS or BYPASS
+ * @param r
+ * @param v
+ * @param data
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_cache_status(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_json_extractor_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+
+    if (NULL==ctx || NGX_JSON_EXTRACTOR_CACHE_NONE==ctx->cache_status) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = ngx_json_extractor_cache_statuses[ctx->cache_status].len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = ngx_json_extractor_cache_statuses[ctx->cache_status].data;
+
+    return NGX_OK;
+}
+
+/**
+ * Parse context of the client request, created once: the value is
+ * cached by the variables of the main request
+ * @param r - main request
+ * @param v
+ * @param data
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_request_var(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    je_request_t *jr;
+
+    jr = ngx_palloc(r->pool, sizeof(je_request_t));
+    if (NULL==jr)
+        return NGX_ERROR;
+
+    jr->arena = NULL;
+
+    if (NGX_OK!=ngx_array_init(&jr->docs, r->pool, 1, sizeof(je_doc_t)))
+        return NGX_ERROR;
+
+    v->len = 0;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = (u_char *) jr;
+
+    return NGX_OK;
+}
+
+/**
+ * Hits or misses of the location cache zone
+ * @param r
+ * @param v
+ * @param data - 0 hits, 1 misses
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+ngx_http_json_cache_stat(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char *p;
+    ngx_atomic_uint_t hits, misses;
+    ngx_json_extractor_loc_t *olcf;
+
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+
+    if (NULL==olcf->cache || NGX_CONF_UNSET_PTR==olcf->cache) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (NULL==p)
+        return NGX_ERROR;
+
+    ngx_json_extractor_cache_stat(olcf->cache, &hits, &misses);
+
+    v->len = ngx_sprintf(p, "%uA", 0==data ? hits : misses) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Add JSON link to local config
+ * @param lc
+ * @param index
+ * @param data_index
+ * @param data
+ * @param pool
+ * @return item or NULL
+ */
+static je_item_t *
+add_json_item(ngx_json_extractor_loc_t *lc,
+    ngx_int_t index, ngx_uint_t data_index, uintptr_t data, void* pool)
+{
+    je_item_t  *it, **itp;
+
+    if (NULL==lc->json_cache.elts) {
+        if (ngx_array_init(&lc->json_cache, pool, 1,
+                           sizeof(je_item_t *))!=NGX_OK)
+            return NULL;
+    }
+
+    it = ngx_pcalloc(pool, sizeof(je_item_t));
+    itp = ngx_array_push(&lc->json_cache);
+    if (NULL==it || NULL==itp)
+        return NULL;
     
-    ngx_pfree(r->pool, stext);
+    it->index       = index;
+    it->data        = data;
+    it->data_index  = data_index;
+    it->conf        = lc;
+    it->root.slot   = -1;
+    *itp            = it;
     
-    // Get JSON item text var
-    val = get_json_item(r, stext, j);
-    if (NULL==val) {
+    return it;
+}
 
-#if (NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE)
-        v->len = olcf->default_val.len;
-        v->valid = 1;
-        v->no_cacheable = 0;
-        v->not_found = 0;
-        v->data = olcf->default_val.data;
-#else
-        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
-            "Failed value: %V", data);
+/**
+ * Check that the variable is not bound by other directive, a variable
+ * has one value handler for all locations
+ * @param cf
+ * @param v
+ * @param it - json_extract binding it again, NULL for other directives
+ * @return NGX_OK or NGX_ERROR
+ */
+static ngx_int_t
+check_json_var(ngx_conf_t *cf, ngx_http_variable_t *v, je_item_t *it)
+{
+    // The same json_extract may name it twice
+    if (ngx_http_json_extract_var==v->get_handler && NULL!=it
+        && ((je_path_t *) v->data)->item==it)
+        return NGX_OK;
+
+    if (ngx_http_json_extract_var!=v->get_handler
+        && ngx_http_json_select!=v->get_handler
+        && ngx_http_json_build_var!=v->get_handler)
+        return NGX_OK;
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "Variable is bound by other directive: [$%V]", &v->name);
+    return NGX_ERROR;
+}
+
+/**
+ * Parse optional "format=name" argument
+ * @param value
+ * @param format
+ * @return NGX_OK, NGX_DECLINED if it is not a format or NGX_ERROR
+ */
+static ngx_int_t
+get_json_format(ngx_str_t *value, ngx_uint_t *format)
+{
+    ngx_str_t n;
+    ngx_conf_enum_t *e;
+
+    *format = NGX_JSON_EXTRACTOR_FORMAT_JSON;
+
+    if (value->len<=sizeof("format=")-1
+        || 0!=ngx_strncmp(value->data, "format=", sizeof("format=")-1))
+        return NGX_DECLINED;
+
+    n.len = value->len - (sizeof("format=")-1);
+    n.data = value->data + sizeof("format=")-1;
+
+    for (e=ngx_json_extractor_formats ; e->name.len ; e++) {
+        if (e->name.len==n.len
+            && 0==ngx_strncmp(e->name.data, n.data, n.len))
+        {
+            *format = e->value;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+/**
+ * Parse constant document once for all workers
+ * @param cf
+ * @param it
+ * @param value - JSON text
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+load_json_const(ngx_conf_t *cf, je_item_t *it, ngx_str_t *value)
+{
+    json_error_t error;
+    ngx_pool_cleanup_t *cln;
+
+    ngx_json_extractor_alloc_begin(NULL);
+    it->json = json_loads(strip((char *)value->data), JSON_DECODE_ANY,
+                          &error);
+    ngx_json_extractor_alloc_end();
+
+    if (NULL==it->json) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "JSON string parse error: line[%d] column[%d] position[%d] %s",
+            error.line, error.column, error.position, error.text);
         return NGX_ERROR;
-#endif
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (NULL==cln) {
+        ngx_http_json_conf_cleanup(it->json);
+        return NGX_ERROR;
+    }
+    cln->handler = ngx_http_json_conf_cleanup;
+    cln->data = it->json;
+
+    return NGX_OK;
+}
+
+/**
+ * Give counters slot to the location of the parsed source
+ * @param jmcf
+ * @param it
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+add_json_stat(ngx_json_extractor_main_t *jmcf, je_item_t *it)
+{
+    ngx_str_t *name;
+
+    if (NULL!=it->json || NGX_CONF_UNSET_UINT!=it->conf->stat)
+        return NGX_OK;
+
+    it->conf->stat = jmcf->stat_names.nelts;
+
+    name = ngx_array_push(&jmcf->stat_names);
+    if (NULL==name)
+        return NGX_ERROR;
+
+    *name = it->conf->name;
+    return NGX_OK;
+}
+
+/**
+ * Get compiled selector of json_extract_select, a new one is
+ * compiled into own pool and kept by the worker
+ * @param r
+ * @param sel
+ * @param key - selector "key1__key2__keyN"
+ * @return item with the single slot or NULL
+ */
+static je_item_t *
+get_json_select(ngx_http_request_t *r, je_select_t *sel, ngx_str_t *key)
+{
+    je_item_t *it, *src;
+    je_path_t *path;
+    ngx_pool_t *pool;
+    ngx_pool_cleanup_t *cln;
+    ngx_json_extractor_loc_t *olcf;
+
+    // Engine and limits are of the location serving the request
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+
+    it = ngx_json_extractor_select_get(sel, key, olcf);
+    if (NULL!=it)
+        return it;
+
+    pool = ngx_create_pool(NGX_JSON_EXTRACTOR_SELECT_POOL, ngx_cycle->log);
+    if (NULL==pool)
+        return NULL;
+
+    src = sel->item;
+
+    it = ngx_pcalloc(pool, sizeof(je_item_t));
+    path = ngx_pcalloc(pool, sizeof(je_path_t));
+    if (NULL==it || NULL==path)
+        goto failed;
+
+    it->data = src->data;
+    it->data_index = src->data_index;
+    it->index = src->index;
+    it->conf = olcf;
+    it->json = src->json;
+    it->source = src->source;
+    it->format = src->format;
+    it->root.slot = -1;
+
+    path->item = it;
+    path->name.len = key->len;
+    path->name.data = ngx_http_json_pstrdup(pool, key->data, key->len);
+    if (NULL==path->name.data)
+        goto failed;
+
+    if (NGX_OK!=compile_json_path(pool, path, NULL)
+        || NGX_OK!=ngx_json_extractor_trie_add(pool, path))
+        goto failed;
+
+    it->slots = ngx_palloc(pool, sizeof(je_path_t *));
+    if (NULL==it->slots)
+        goto failed;
+
+    it->slots[path->slot] = path;
+
+    // Location is merged by now, settings are taken as postconfiguration does
+    it->engine = NGX_CONF_UNSET_UINT==it->conf->engine
+               ? NGX_JSON_EXTRACTOR_ENGINE_DOM
+               : it->conf->engine;
+
+    if (NGX_JSON_EXTRACTOR_SOURCE_BODY==it->source
+        || NGX_JSON_EXTRACTOR_FORMAT_JSON!=it->format)
+        it->engine = NGX_JSON_EXTRACTOR_ENGINE_STREAM;
+
+    // Indexes from the end of body arrays are not found
+    if (it->backward
+        && NGX_JSON_EXTRACTOR_SOURCE_VARIABLE==it->source
+        && NGX_JSON_EXTRACTOR_FORMAT_JSON==it->format)
+        it->engine = NGX_JSON_EXTRACTOR_ENGINE_DOM;
+
+    if (1==it->conf->raw && NGX_JSON_EXTRACTOR_ENGINE_DOM==it->engine)
+        it->engine = NGX_JSON_EXTRACTOR_ENGINE_TAPE;
+
+    if (NGX_CONF_UNSET_PTR!=it->conf->limits)
+        it->limits = it->conf->limits;
+
+    if (NGX_OK==ngx_json_extractor_select_add(sel, &path->name, it, pool))
+        return it;
+
+    // Not kept, released with the request
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (NULL==cln)
+        goto failed;
+
+    cln->handler = (ngx_pool_cleanup_pt) ngx_destroy_pool;
+    cln->data = pool;
+
+    return it;
+
+failed:
+
+    ngx_destroy_pool(pool);
+    return NULL;
+}
+
+/**
+ * Get request context, create it on first use
+ * @param r
+ * @return context or NULL
+ */
+static ngx_json_extractor_ctx_t *
+get_json_ctx(ngx_http_request_t *r)
+{
+    ngx_json_extractor_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_json_extractor_module);
+    if (NULL!=ctx)
+        return ctx;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_json_extractor_ctx_t));
+    if (NULL==ctx)
+        return NULL;
+
+    if (NGX_OK!=ngx_array_init(&ctx->streams, r->pool, 1,
+                               sizeof(je_stream_t *)))
+        return NULL;
+
+    ngx_http_set_ctx(r, ctx, ngx_json_extractor_module);
+    return ctx;
+}
+
+/**
+ * Start stream of the body source, compressed body is inflated
+ * @param r
+ * @param pool - memory of the stream and its values
+ * @param it
+ * @return stream or NULL
+ */
+static je_stream_t *
+create_json_stream(ngx_http_request_t *r, ngx_pool_t *pool, je_item_t *it)
+{
+    je_stream_t *st;
+    ngx_str_t *e;
+    ngx_table_elt_t *enc;
+
+    st = ngx_json_extractor_stream_create(pool, it);
+    if (NULL==st)
+        return NULL;
+
+    enc = get_json_encoding(r, it);
+    if (NULL==enc)
+        return st;
+
+    for (e=ngx_json_extractor_encodings ; e->len ; e++) {
+        if (enc->value.len==e->len
+            && 0==ngx_strncasecmp(enc->value.data, e->data, e->len))
+        {
+            if (NGX_OK!=ngx_json_extractor_inflate_init(st))
+                return NULL;
+            break;
+        }
+    }
+
+    return st;
+}
+
+/**
+ * Get Content-Encoding of the request or of the response body
+ * @param r
+ * @param it
+ * @return header or NULL
+ */
+static ngx_table_elt_t *
+get_json_encoding(ngx_http_request_t *r, je_item_t *it)
+{
+    ngx_uint_t i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    if (NGX_JSON_EXTRACTOR_SOURCE_RESPONSE==it->source) {
+        h = r->headers_out.content_encoding;
+        return NULL!=h && 0!=h->hash ? h : NULL;
+    }
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i=0 ; /* void */ ; i++) {
+        if (i>=part->nelts) {
+            if (NULL==part->next)
+                break;
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len==sizeof("Content-Encoding")-1
+            && 0==ngx_strncasecmp(h[i].key.data, (u_char *)"Content-Encoding",
+                                  h[i].key.len))
+            return &h[i];
+    }
+
+    return NULL;
+}
 
-    } else {
-        v->len = ngx_strlen(val);
-        v->valid = 1;
-        v->no_cacheable = 0;
-        v->not_found = 0;
-        v->data = val;
+/**
+ * Find stream of the source started by a filter
+ * @param ctx
+ * @param it
+ * @return stream or NULL
+ */
+static je_stream_t *
+get_json_stream(ngx_json_extractor_ctx_t *ctx, je_item_t *it)
+{
+    ngx_uint_t i;
+    je_stream_t **streams;
+
+    streams = ctx->streams.elts;
+    for (i=0 ; i<ctx->streams.nelts ; i++) {
+        if (it==streams[i]->item)
+            return streams[i];
     }
-    return NGX_OK;
+    return NULL;
 }
 
 /**
- * Get JSON object
+ * Pass next buffers of the body to the streams of its sources,
+ * finished streams are not fed anymore
  * @param r
- * @param v
- * @param data
+ * @param items - je_item_t *
+ * @param in
  * @return NGX_[STATUS]
  */
 static ngx_int_t
-ngx_http_json_desc(ngx_http_request_t *r, 
-    ngx_http_variable_value_t *v, uintptr_t data)
+feed_json_streams(ngx_http_request_t *r, ngx_array_t *items,
+    ngx_chain_t *in)
 {
-    if (data==0)
+    ngx_uint_t i;
+    uint64_t t;
+    je_item_t **its;
+    je_stream_t *st, **stp;
+    ngx_json_extractor_ctx_t *ctx;
+
+    ctx = get_json_ctx(r);
+    if (NULL==ctx)
         return NGX_ERROR;
 
-    int flags = JSON_DECODE_ANY;
-    json_t *json;
-    json_error_t error;
-    char *nm;
+    its = items->elts;
+
+    for (i=0 ; i<items->nelts ; i++) {
+        st = get_json_stream(ctx, its[i]);
+
+        if (NULL==st) {
+            st = create_json_stream(r, r->pool, its[i]);
+            stp = ngx_array_push(&ctx->streams);
+            if (NULL==st || NULL==stp)
+                return NGX_ERROR;
+            *stp = st;
+        }
 
-#if (NGX_JSON_EXTRACTOR_CLEANUP_SPIKE)
-    /**
-     * @SPIKE:
-     * It did not work to get to work in a place where it
-     * is written in the documentation. I hope this problem
-     * will be solved, and then we can remove the flag NGX_JSON_EXTRACTOR_CLEANUP_SPIKE
-     */
+        // Parse errors are reported by the variable
+        if (NGX_AGAIN!=st->rc)
+            continue;
 
-    ngx_pool_cleanup_t *cln = r->pool->cleanup;
+        t = ngx_json_extractor_stat_time();
+        (void) ngx_json_extractor_stream_chain(st, in);
+        st->nsec += ngx_json_extractor_stat_time() - t;
 
-    for ( ; cln ; cln = cln->next ) {
-        if (ngx_json_extractor_module_cleanup_handler == cln->handler)
-            goto pool_exist;
+        if (NGX_AGAIN!=st->rc)
+            ngx_json_extractor_stat_parse(its[i], st->offset, st->nsec,
+                                          st->rc);
     }
 
-    cln = ngx_pool_cleanup_add(r->pool, 0);
+    return NGX_OK;
+}
 
-    if(cln == NULL)
-        return NGX_ERROR;
+/**
+ * Get parse context of the client request, create it on first use
+ * @param r - main request or subrequest
+ * @return context or NULL
+ */
+static je_request_t *
+get_json_request(ngx_http_request_t *r)
+{
+    ngx_http_variable_value_t *vv;
+    ngx_json_extractor_ctx_t *ctx;
+    ngx_json_extractor_main_t *jmcf;
 
-    // Set handler
-    cln->handler = ngx_json_extractor_module_cleanup_handler;
+    ctx = get_json_ctx(r->main);
+    if (NULL==ctx)
+        return NULL;
 
-    // Init data
-    cln->data = r;
+    if (NULL!=ctx->request)
+        return ctx->request;
 
-pool_exist:
+    // Redirects clear the module context, not the variables
+    jmcf = ngx_http_get_module_main_conf(r, ngx_json_extractor_module);
 
-#endif
+    vv = ngx_http_get_indexed_variable(r->main, jmcf->request);
+    if (NULL==vv || NULL==vv->data)
+        return NULL;
 
-    nm = (char *)data;
-    
-    // If this is varname
-    if ('$'==*nm) {
-        je_item_t *jit;
-        ngx_http_variable_value_t *v;
-        ngx_json_extractor_loc_t *olcf;
+    ctx->request = (je_request_t *) vv->data;
+    return ctx->request;
+}
 
-        olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+/**
+ * Get arena of the request documents, create it on first use
+ * @param r
+ * @return arena or NULL
+ */
+static je_arena_t *
+get_json_arena(ngx_http_request_t *r)
+{
+    je_request_t *jr;
 
-        jit = get_item_by_data(olcf, data);
-        
-        if (NULL==jit || NGX_CONF_UNSET_UINT==jit->data_index) {
-            ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
-                "Invalid JSON descriptor");
-            return NGX_ERROR;
-        }
+    jr = get_json_request(r);
+    if (NULL==jr)
+        return NULL;
 
-        v = ngx_http_get_indexed_variable(r, jit->data_index);
-        if (NULL == v) {
-            return NGX_ERROR;
+    if (NULL==jr->arena)
+        jr->arena = ngx_json_extractor_arena_create(r->main->pool);
+
+    return jr->arena;
+}
+
+/**
+ * Find document of the source parsed for the client request
+ * @param jr
+ * @param it
+ * @param src - source value
+ * @param hash - of the source value
+ * @return document or NULL
+ */
+static je_doc_t *
+get_json_doc(je_request_t *jr, je_item_t *it, ngx_str_t *src, uint64_t hash)
+{
+    ngx_uint_t i;
+    je_doc_t *doc;
+
+    doc = jr->docs.elts;
+
+    for (i=0 ; i<jr->docs.nelts ; i++) {
+        if (hash==doc[i].hash
+            && it->source==doc[i].source
+            && it->data_index==doc[i].data_index
+            && src->len==doc[i].src.len
+            && (src->data==doc[i].src.data
+                || 0==ngx_memcmp(src->data, doc[i].src.data, src->len)))
+            return &doc[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Keep document of the source for other locations of the client request
+ * @param jr
+ * @param it
+ * @param src - source value, lives as long as the request
+ * @param hash - of the source value
+ * @return document without representations or NULL
+ */
+static je_doc_t *
+add_json_doc(je_request_t *jr, je_item_t *it, ngx_str_t *src, uint64_t hash)
+{
+    je_doc_t *doc;
+
+    doc = ngx_array_push(&jr->docs);
+    if (NULL==doc)
+        return NULL;
+
+    doc->source = it->source;
+    doc->data_index = it->data_index;
+    doc->src = *src;
+    doc->hash = hash;
+    doc->json = NULL;
+    doc->tape = NULL;
+
+    return doc;
+}
+
+/**
+ * Walk document of the source by the item trie, the document is parsed
+ * by the item engine once for the client request
+ * @param r
+ * @param it
+ * @param st - values by slot
+ * @param src - source value, the key of the document
+ * @param doc - document, payload of the token for JWT
+ * @param hash - of the source value
+ * @param error - parse error
+ * @return NGX_OK, NGX_DONE if parsed before, NGX_DECLINED if invalid
+ * or NGX_ERROR
+ */
+static ngx_int_t
+walk_json_doc(ngx_http_request_t *r, je_item_t *it, je_stream_t *st,
+    ngx_str_t *src, ngx_str_t *doc, uint64_t hash, json_error_t *error)
+{
+    size_t pos;
+    json_t *json;
+    je_tape_t *tape;
+    je_doc_t *jd;
+    je_request_t *jr;
+    je_arena_t *arena;
+    ngx_int_t rc;
+
+    jr = get_json_request(r);
+    if (NULL==jr)
+        return NGX_ERROR;
+
+    jd = get_json_doc(jr, it, src, hash);
+    rc = NGX_DONE;
+
+    // Values are slices of the source, nothing is allocated by libjansson
+    if (NGX_JSON_EXTRACTOR_ENGINE_TAPE==it->engine) {
+        if (NULL==jd || NULL==jd->tape) {
+            rc = ngx_json_extractor_tape_parse(r->main->pool, doc, &tape,
+                                               &pos);
+            if (NGX_DECLINED==rc) {
+                ngx_memzero(error, sizeof(json_error_t));
+                error->line = -1;
+                error->column = -1;
+                error->position = (int) pos;
+                ngx_cpystrn((u_char *) error->text,
+                            (u_char *) "invalid document",
+                            JSON_ERROR_TEXT_LENGTH);
+            }
+
+            if (NGX_OK!=rc)
+                return rc;
+
+            if (NULL==jd && NULL==(jd = add_json_doc(jr, it, src, hash)))
+                return NGX_ERROR;
+
+            jd->tape = tape;
         }
 
-        nm = (char *)v->data;
+        ngx_json_extractor_tape_walk(st, &it->root, jd->tape);
+        return rc;
     }
-    
-    json = json_loads(strip(nm), flags, &error);
 
-    if (NULL==json) {
-        ngx_log_error_core(NGX_LOG_EMERG, r->connection->log, 0,
-            "JSON string parse error: line[%d] column[%d] position[%d]\n%s",
-                error.line, error.column, error.position, error.text);
+    // Document is released with the request pool
+    arena = get_json_arena(r);
+    if (NULL==arena)
         return NGX_ERROR;
+
+    ngx_json_extractor_alloc_begin(arena);
+
+    if (NULL==jd || NULL==jd->json) {
+        // Source is not changed, it may be cached
+        json = json_loadb((char *)doc->data, doc->len, JSON_DECODE_ANY,
+                          error);
+
+        if (NULL!=json && NULL==jd)
+            jd = add_json_doc(jr, it, src, hash);
+
+        if (NULL==json || NULL==jd) {
+            ngx_json_extractor_alloc_end();
+            return NULL==json ? NGX_DECLINED : NGX_ERROR;
+        }
+
+        jd->json = json;
+        rc = NGX_OK;
     }
 
-    v->len = 0;
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
-    v->data = (u_char *)json;
+    // All selectors at once, common prefixes are walked once
+    walk_json_item(st, &it->root, jd->json);
 
-    return NGX_OK;
+    ngx_json_extractor_alloc_end();
+    return rc;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-/// Helpers ///////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+/**
+ * Create finished stream to keep values of all slots
+ * @param pool
+ * @param it
+ * @return stream or NULL
+ */
+static je_stream_t *
+get_json_values(ngx_pool_t *pool, je_item_t *it)
+{
+    je_stream_t *st;
+
+    st = ngx_pcalloc(pool, sizeof(je_stream_t));
+    if (NULL==st)
+        return NULL;
+
+    st->values = ngx_pcalloc(pool, (it->nslots + 1) * sizeof(ngx_str_t));
+    if (NULL==st->values)
+        return NULL;
+
+    st->pool = pool;
+    st->item = it;
+    st->rc = NGX_AGAIN;
+
+    return st;
+}
 
 /**
- * Get JSON object from cache
- * @param r
- * @param v
- * @param data
- * @return JSON link
+ * Get values of the current file version, the version is held by
+ * the pool while the values are used
+ * @param pool - NULL if the version is not held
+ * @param it
+ * @return values by slot or NULL
  */
-static json_t *
-get_json(ngx_http_request_t *r, uintptr_t data)
+static ngx_str_t *
+get_json_file(ngx_pool_t *pool, je_item_t *it)
 {
-    ngx_uint_t i;
-    ngx_http_variable_value_t *vv;
-    ngx_json_extractor_loc_t *olcf;
+    je_stream_t    *st;
+    je_file_doc_t  *doc;
 
-    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
-    
-    if (NULL!=olcf->json_cache.elts) {
-        for (i=0 ; i<olcf->json_cache.nelts ; i++) {
-            if (data==((je_item_t *)olcf->json_cache.elts)[i].data) {
-                vv = ngx_http_get_indexed_variable(r,
-                    ((je_item_t *)olcf->json_cache.elts)[i].index);
-                return NULL==vv ? NULL : (json_t *)vv->data;
-            }
-        }
+    doc = ngx_json_extractor_file_get(it->file, pool);
+    if (NULL==doc)
+        return NULL;
+
+    if (NULL!=it->file_values && it->file_gen==doc->gen)
+        return it->file_values;
+
+    // Values and unescaped strings live with the version
+    st = get_json_values(doc->pool, it);
+    if (NULL==st)
+        return NULL;
+
+    ngx_json_extractor_tape_walk(st, &it->root, doc->tape);
+
+    it->file_values = st->values;
+    it->file_gen = doc->gen;
+
+    return st->values;
+}
+
+/**
+ * Decode payload of the token, "Bearer" scheme is skipped
+ * @param pool
+ * @param token - "[Bearer ]header.payload.signature"
+ * @param payload - decoded JSON
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+get_json_jwt(ngx_pool_t *pool, ngx_str_t *token, ngx_str_t *payload)
+{
+    u_char *p, *last, *dot;
+    ngx_str_t src;
+
+    p = token->data;
+    last = p + token->len;
+
+    if ((size_t)(last - p)>sizeof("Bearer ")-1
+        && 0==ngx_strncasecmp(p, (u_char *)"Bearer ", sizeof("Bearer ")-1))
+    {
+        for (p+=sizeof("Bearer ")-1 ; p<last && ' '==*p ; p++)
+            /* void */ ;
     }
-    return NULL;
+
+    // Header is not needed, the payload ends with the signature dot
+    dot = ngx_strlchr(p, last, '.');
+    if (NULL==dot)
+        return NGX_ERROR;
+
+    src.data = dot + 1;
+    dot = ngx_strlchr(src.data, last, '.');
+    if (NULL==dot)
+        return NGX_ERROR;
+
+    src.len = dot - src.data;
+
+    payload->data = ngx_pnalloc(pool, ngx_base64_decoded_length(src.len));
+    if (NULL==payload->data)
+        return NGX_ERROR;
+
+    return ngx_decode_base64url(payload, &src);
 }
 
 /**
- * Add JSON link to local config
- * @param lc
- * @param index
- * @param data
+ * Split variable name into JSON keys
  * @param pool
+ * @param path - selector with name "pfx_key1__key2__keyN"
+ * @param prefix - skipped prefix of the name or NULL
  * @return NGX_[STATUS]
  */
 static ngx_int_t
-add_json_item(ngx_json_extractor_loc_t *lc,
-    ngx_int_t index, ngx_uint_t data_index, uintptr_t data, void* pool)
+compile_json_path(ngx_pool_t *pool, je_path_t *path, ngx_str_t *prefix)
 {
-    je_item_t  *it;
+    u_char *p, *start, *last;
+    ngx_str_t sep, *key;
+    ngx_array_t keys;
+    ngx_json_extractor_loc_t *olcf;
 
-    if (NULL==lc->json_cache.elts) {
-        if (ngx_array_init(&lc->json_cache, pool, 1, sizeof(je_item_t))!=NGX_OK)
-            return NGX_ERROR;
+    olcf = path->item->conf;
+
+    p = path->name.data;
+    last = path->name.data + path->name.len;
+
+    // Skip prefix
+    if (NULL!=prefix && prefix->len>0 && prefix->len<=path->name.len
+        && 0==ngx_strncasecmp(p, prefix->data, prefix->len))
+    {
+        p += prefix->len;
     }
 
-    it = ngx_array_push(&lc->json_cache);
-    if (NULL==it)
+    if (olcf->separator.len>0) {
+        sep = olcf->separator;
+    } else {
+        ngx_str_set(&sep, "__");
+    }
+
+    if (NGX_OK!=ngx_array_init(&keys, pool, 2, sizeof(ngx_str_t)))
         return NGX_ERROR;
-    
-    it->index       = index;
-    it->data        = data;
-    it->data_index  = data_index;
-    
+
+    for (start=p ; p<=last ; p++) {
+        if (p<last && (sep.len>(size_t)(last-p)
+                       || 0!=ngx_strncmp(p, sep.data, sep.len)))
+            continue;
+
+        // Trailing separator does not make an empty key
+        if (p==last && p==start && keys.nelts>0)
+            break;
+
+        key = ngx_array_push(&keys);
+        if (NULL==key)
+            return NGX_ERROR;
+
+        // Keys are NUL terminated for json_object_get
+        key->len = p - start;
+        key->data = ngx_http_json_pstrdup(pool, start, key->len);
+        if (NULL==key->data)
+            return NGX_ERROR;
+
+        if (p==last)
+            break;
+
+        p += sep.len - 1;
+        start = p + 1;
+    }
+
+    path->keys = keys.elts;
+    path->nkeys = keys.nelts;
     return NGX_OK;
 }
 
 /**
- * Get string JSON val
- * @param r
- * @param text - search string "key1__key2__keyN"
- * @param json - searched object
- * @return JSON value as string or NULL
+ * Get values of all selectors of the trie in one descent
+ * @param st - values by slot
+ * @param node - trie node of json
+ * @param json
  */
-static u_char *
-get_json_item(ngx_http_request_t *r, u_char *text, json_t *json)
+static void
+walk_json_item(je_stream_t *st, je_node_t *node, json_t *json)
 {
-    if (!json_is_object(json))
-        return NULL;
-
-    u_char *separator, *end, *txt;
+    size_t i, n, k;
+    ngx_int_t idx;
+    je_node_t *child;
     json_t* val;
-    ngx_json_extractor_loc_t *olcf;
 
-    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+    if (node->slot>=0 && NULL==st->values[node->slot].data) {
+        if (NGX_OK!=dump_json_item(st->pool, json,
+                                   &st->values[node->slot]))
+            st->values[node->slot].data = NULL;
+    }
 
-    // Finde end of selector
-    separator = olcf->separator.len>0
-              ? olcf->separator.data
-              : (u_char*)"__";
-    end = (u_char*)ngx_strstr(text, separator);
-    
-    // Make next chan
-    if (NULL!=end) {
-        *end = '\0';
-        end += olcf->separator.len>0 ? olcf->separator.len : 2;
+    child = node->children.elts;
+
+    if (json_is_object(json)) {
+        for (i=0 ; i<node->children.nelts ; i++) {
+            val = json_object_get(json, (char *)child[i].key.data);
+
+            if (NULL!=val)
+                walk_json_item(st, &child[i], val);
+        }
+        return;
     }
-    
-    // Get JSON value node
-    val = json_object_get(json, (char *)text);
 
-    if (NULL==val)
-        return NULL;
+    if (!node->elems || !json_is_array(json))
+        return;
+
+    n = json_array_size(json);
+
+    for (i=0 ; i<node->children.nelts ; i++) {
+        if (child[i].any) {
+            for (k=0 ; k<n ; k++)
+                walk_json_item(st, &child[i], json_array_get(json, k));
+            continue;
+        }
+
+        if (!child[i].isindex)
+            continue;
 
-    if (NULL!=end && '\0'!=*end) {
-        return get_json_item(r, end, val);
+        idx = child[i].index<0 ? (ngx_int_t) n + child[i].index
+                               : child[i].index;
+
+        if (idx>=0 && (size_t) idx<n)
+            walk_json_item(st, &child[i], json_array_get(json, idx));
     }
+}
+
+/**
+ * Convert value to string, numbers are formatted into the pool
+ * and only objects and arrays are serialized by libjansson
+ * @param pool
+ * @param val
+ * @param out
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+dump_json_item(ngx_pool_t *pool, json_t *val, ngx_str_t *out)
+{
+    u_char *p;
+
+    switch (json_typeof(val)) {
+    case JSON_TRUE:
+        ngx_str_set(out, "1");
+        return NGX_OK;
+
+    case JSON_FALSE:
+        ngx_str_set(out, "0");
+        return NGX_OK;
+
+    case JSON_NULL:
+        ngx_str_set(out, "");
+        return NGX_OK;
+
+    case JSON_STRING:
+        out->data = (u_char *)json_string_value(val);
+        out->len = json_string_length(val);
+        return NGX_OK;
+
+    case JSON_INTEGER:
+        p = ngx_pnalloc(pool, NGX_INT64_LEN);
+        if (NULL==p)
+            return NGX_ERROR;
+
+        out->data = p;
+        out->len = ngx_sprintf(p, "%L", (int64_t)json_integer_value(val)) - p;
+        return NGX_OK;
+
+    case JSON_REAL:
+        p = ngx_pnalloc(pool, NGX_JSON_EXTRACTOR_REAL_LEN);
+        if (NULL==p)
+            return NGX_ERROR;
 
-    // Convert value to string
-    if (json_is_true(val)) {
-        return (u_char *)"1";
-    } else if (json_is_false(val)) {
-        return (u_char *)"0";
-    } else if (json_is_null(val)) {
-        return (u_char *)"";
-    } else if (json_is_string(val)) {
-        txt = (u_char *)json_string_value(val);
-        return ngx_http_json_pstrdup(r->pool, txt, ngx_strlen(txt));
+        out->data = p;
+        p = ngx_json_extractor_dtoa(p, json_real_value(val));
+        if (NULL==p)
+            return NGX_ERROR;
+
+        out->len = p - out->data;
+        return NGX_OK;
+
+    default:
+        break;
     }
 
-    txt = (u_char *)json_dumps(val, JSON_ENCODE_ANY);
-    end = ngx_http_json_pstrdup(r->pool, txt, ngx_strlen(txt));
-    free(txt);
-    return end;
+    out->data = (u_char *)json_dumps(val, JSON_ENCODE_ANY);
+    if (NULL==out->data)
+        return NGX_ERROR;
+
+    out->len = ngx_strlen(out->data);
+    return NGX_OK;
 }
 
-static ngx_http_variable_t *
-get_head_var(ngx_http_request_t *r, ngx_http_variable_value_t *v)
+/**
+ * Set variable value, default value is used for not found one
+ * @param r
+ * @param v
+ * @param val
+ * @param partial - value may appear later
+ * @return NGX_OK or NGX_DECLINED without the default value
+ */
+static ngx_int_t
+set_json_value(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    ngx_str_t *val, ngx_uint_t partial)
 {
-    ngx_uint_t i;
-    ngx_http_core_main_conf_t  *cmcf;
-    
-    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
-    
-    for (i=0 ; i<cmcf->variables.nelts ; i++) {
-        if (v == r->variables+i)
-            return ((ngx_http_variable_t*)cmcf->variables.elts)+i;
+#if (NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE)
+    ngx_json_extractor_loc_t *olcf;
+#endif
+
+    if (NULL==val->data) {
+
+#if (NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE)
+        olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+        v->len = olcf->default_val.len;
+        v->valid = 1;
+        v->no_cacheable = partial;
+        v->not_found = 0;
+        v->data = olcf->default_val.data;
+#else
+        return NGX_DECLINED;
+#endif
+
+    } else {
+        v->len = val->len;
+        v->valid = 1;
+        v->no_cacheable = partial;
+        v->not_found = 0;
+        v->data = val->data;
     }
-    return NULL;
+    return NGX_OK;
 }
 
-static je_item_t *
-get_item_by_data(ngx_json_extractor_loc_t *olcf, uintptr_t data)
+/**
+ * Set all variables of the finished json_extract, so later
+ * reads are indexed hits
+ * @param r
+ * @param it
+ * @param values - values by slot
+ */
+static void
+set_json_vars(ngx_http_request_t *r, je_item_t *it, ngx_str_t *values)
 {
-    ngx_uint_t i;
-    for (i=0 ; i<olcf->json_cache.nelts ; i++) {
-        if (data==((je_item_t *)olcf->json_cache.elts)[i].data)
-            return ((je_item_t *)olcf->json_cache.elts)+i;
+    ngx_uint_t i, n;
+    je_path_t **paths;
+
+    paths = it->paths.elts;
+    for (n=0, i=0 ; i<it->paths.nelts ; i++) {
+        if (NULL==values[paths[i]->slot].data)
+            n++;
+
+        // Missing value is reported by the variable itself
+        (void) set_json_value(r, r->variables + paths[i]->index,
+                              &values[paths[i]->slot], 0);
     }
-    return NULL;
+
+    ngx_json_extractor_stat_add(it, offsetof(je_stat_t, defaults), n);
 }
 
 #ifdef __cplusplus
@@ -8,20 +8,491 @@
 #ifndef _NGX_JSON_EXTRACTOR_MODULE_H_
 #define _NGX_JSON_EXTRACTOR_MODULE_H_
 
+#ifndef NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE
+#define NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE 1
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_ARENA_SLAB
+#define NGX_JSON_EXTRACTOR_ARENA_SLAB 16384
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_ARENA_KEEP
+#define NGX_JSON_EXTRACTOR_ARENA_KEEP 64    // Free slabs kept by worker
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_SIMD
+#if ((defined __x86_64__ || defined __i386__) && defined __GNUC__)
+#define NGX_JSON_EXTRACTOR_SIMD 1
+#else
+#define NGX_JSON_EXTRACTOR_SIMD 0
+#endif
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_READ_SIZE
+#define NGX_JSON_EXTRACTOR_READ_SIZE 16384
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_CACHE_SOURCE
+#define NGX_JSON_EXTRACTOR_CACHE_SOURCE 16384   // Longest cached source
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_JWT_LRU
+#define NGX_JSON_EXTRACTOR_JWT_LRU 256      // Tokens kept by worker
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_SELECT_CACHE
+#define NGX_JSON_EXTRACTOR_SELECT_CACHE 256 // Selectors compiled by worker
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_SELECT_POOL
+#define NGX_JSON_EXTRACTOR_SELECT_POOL 1024 // Pool of compiled selector
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_THREAD_SIZE
+#define NGX_JSON_EXTRACTOR_THREAD_SIZE 1048576  // Bodies parsed by threads
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_FILE_CHECK
+#define NGX_JSON_EXTRACTOR_FILE_CHECK 60000 // Files mtime check, msec
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_FILE_POOL
+#define NGX_JSON_EXTRACTOR_FILE_POOL 4096   // Pool of one file version
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_TAPE_ITEMS
+#define NGX_JSON_EXTRACTOR_TAPE_ITEMS 64    // First tape size, items
+#endif
+
+#ifndef NGX_JSON_EXTRACTOR_TAPE_KEYS
+#define NGX_JSON_EXTRACTOR_TAPE_KEYS 16     // Bigger objects are indexed
+#endif
+
+#define NGX_JSON_EXTRACTOR_ENGINE_DOM       0
+#define NGX_JSON_EXTRACTOR_ENGINE_STREAM    1
+#define NGX_JSON_EXTRACTOR_ENGINE_TAPE      2
+
+#define NGX_JSON_EXTRACTOR_SOURCE_CONST     0
+#define NGX_JSON_EXTRACTOR_SOURCE_VARIABLE  1
+#define NGX_JSON_EXTRACTOR_SOURCE_BODY      2
+#define NGX_JSON_EXTRACTOR_SOURCE_RESPONSE  3
+#define NGX_JSON_EXTRACTOR_SOURCE_JWT       4   // Payload of a token
+#define NGX_JSON_EXTRACTOR_SOURCE_FILE      5   // json_extract_file
+
+#define NGX_JSON_EXTRACTOR_FORMAT_JSON       0
+#define NGX_JSON_EXTRACTOR_FORMAT_MSGPACK    1
+#define NGX_JSON_EXTRACTOR_FORMAT_CBOR       2
+
+#define NGX_JSON_EXTRACTOR_REAL_LEN         32  // "%.17g" of double and ".0"
+
+#define NGX_JSON_EXTRACTOR_STATUS_JSON       1
+#define NGX_JSON_EXTRACTOR_STATUS_PROMETHEUS 2
+
+#define NGX_JSON_EXTRACTOR_STAT_BUCKETS     11  // Parse time, 5us to 10ms
+
+#define NGX_JSON_EXTRACTOR_CACHE_NONE       0
+#define NGX_JSON_EXTRACTOR_CACHE_BYPASS     1
+#define NGX_JSON_EXTRACTOR_CACHE_MISS       2
+#define NGX_JSON_EXTRACTOR_CACHE_HIT        3
+
+#define l_isspace(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+typedef struct ngx_json_extractor_loc_s ngx_json_extractor_loc_t;
+typedef struct je_arena_s je_arena_t;
+typedef struct je_cache_s je_cache_t;
+typedef struct je_path_s je_path_t;
+typedef struct je_lru_s je_lru_t;
+typedef struct je_inflate_s je_inflate_t;
+typedef struct je_budget_s je_budget_t;
+typedef struct je_select_cache_s je_select_cache_t;
+typedef struct je_build_s je_build_t;
+typedef struct je_tape_s je_tape_t;
+
+/**
+ * Limits of one document, zero is no limit
+ */
+typedef struct {
+    size_t      size;                       // Source bytes
+    ngx_uint_t  depth;                      // Nested objects and arrays
+    ngx_uint_t  tokens;                     // Keys and values
+    ngx_uint_t  elements;                   // Items of one object or array
+} je_limits_t;
+
+/**
+ * Version of a json_extract_file document, released when the file
+ * moved to a newer one and requests using its values are over
+ */
 typedef struct {
-    uintptr_t   data;
-    ngx_uint_t  data_index;
-    ngx_uint_t  index;
+    ngx_pool_t         *pool;               // Source, tape and values
+    je_tape_t          *tape;
+    ngx_uint_t          gen;
+    ngx_uint_t          refs;               // File and requests
+} je_file_doc_t;
+
+/**
+ * Document of json_extract_file, loaded by the master and reloaded
+ * by a timer of every worker when the file is changed
+ */
+typedef struct {
+    ngx_str_t           name;               // Full path
+    je_file_doc_t      *doc;                // Current version
+    ngx_msec_t          check;              // 0 if not checked
+    ngx_event_t         event;              // Check timer of the worker
+    time_t              mtime;
+    off_t               size;
+    ngx_file_uniq_t     uniq;
+    ngx_uint_t          gen;                // Versions loaded
+#if (NGX_THREADS)
+    ngx_thread_pool_t  *thread_pool;        // Reloads off the event loop
+    ngx_thread_task_t  *task;               // Check of the worker
+    je_file_doc_t      *next;               // Version loaded by the task
+#endif
+} je_file_t;
+
+/**
+ * Selector trie of one json_extract directive,
+ * every variable ends on the node with own value slot.
+ * Keys "0".."N", "n1".."nN" (from the end) and "any" (first match)
+ * select array elements, the same keys of objects are matched as is.
+ * Every element reaches the "any" node, so walkers keep the first value
+ * of its slot and skip the slot once it is set.
+ */
+typedef struct je_node_s je_node_t;
+
+struct je_node_s {
+    ngx_str_t   key;
+    ngx_array_t children;                   // je_node_t
+    ngx_int_t   slot;                       // -1 if no variable ends here
+    ngx_int_t   index;                      // Negative from the end
+    unsigned    isindex:1;
+    unsigned    any:1;
+    unsigned    elems:1;                    // Has array element children
+};
+
+typedef struct {
+    uintptr_t                   data;
+    ngx_uint_t                  data_index;
+    ngx_uint_t                  index;
+    ngx_json_extractor_loc_t   *conf;
+    json_t                     *json;       // Constant document
+    ngx_uint_t                  source;
+    ngx_uint_t                  format;
+    ngx_uint_t                  engine;
+    je_node_t                   root;
+    ngx_uint_t                  nslots;
+    ngx_uint_t                  depth;      // Longest selector
+    size_t                      keylen;     // Longest selector key
+    ngx_uint_t                  backward;   // Has indexes from the end
+    je_path_t                 **slots;      // Selector of every slot
+    ngx_array_t                 paths;      // je_path_t *, all variables
+    uint64_t                    selhash;    // Selector set hash
+    ngx_shm_zone_t             *cache;
+    time_t                      cache_ttl;
+    ngx_uint_t                  lru_size;
+    je_lru_t                   *lru;        // Worker cache, created on use
+    je_limits_t                *limits;     // NULL if not limited
+    je_file_t                  *file;       // json_extract_file document
+    ngx_str_t                  *file_values; // By slot, file_gen version
+    ngx_uint_t                  file_gen;
 } je_item_t;
 
+/**
+ * Selector of json_extract_select, evaluated by every request
+ * and compiled into own item of the same source
+ */
 typedef struct {
+    je_item_t                  *item;       // Source of the document
+    ngx_http_complex_value_t    selector;
+    je_select_cache_t          *cache;      // Worker cache, created on use
+} je_select_t;
+
+/**
+ * Compiled selector of one extracted variable
+ * "$pfx_key1__key2" => {"key1", "key2"}
+ */
+struct je_path_s {
+    je_item_t  *item;
+    ngx_str_t   name;
+    ngx_str_t  *keys;
+    ngx_uint_t  nkeys;
+    ngx_uint_t  slot;
+    ngx_uint_t  index;                      // Variable index
+    ngx_str_t   value;                      // Precomputed constant value
+};
+
+typedef struct {
+    ngx_array_t paths;
+    ngx_array_t selects;                    // je_select_t *
+    ngx_uint_t  bodies;                     // Request body sources count
+    ngx_uint_t  responses;                  // Response body sources count
+    ngx_uint_t  status;                     // json_extractor_status count
+    ngx_uint_t  threads;                    // json_extract_threads count
+    ngx_array_t files;                      // je_file_t *
+    ngx_msec_t  file_check;                 // json_extract_file_check
+#if (NGX_THREADS)
+    ngx_thread_pool_t *file_pool;           // Pool of the file checks
+#endif
+    ngx_array_t stat_names;                 // ngx_str_t, location of slot
+    ngx_shm_zone_t *stat_zone;
+    ngx_int_t   request;                    // Parse context variable index
+} ngx_json_extractor_main_t;
+
+struct ngx_json_extractor_loc_s {
     ngx_str_t   prefix;
     ngx_str_t   separator;
 #if (NGX_JSON_EXTRACTOR_USE_DEFAULT_VALUE)
     ngx_str_t   default_val;
+#endif
+    ngx_uint_t  engine;
+    ngx_flag_t  raw;                        // json_extract_raw
+    ngx_shm_zone_t *cache;                  // json_extract_cache zone
+    time_t      cache_ttl;
+    ngx_uint_t  lru;                        // json_extract_lru entries
+    je_limits_t *limits;                    // json_extract_limits
+    ngx_str_t   name;                       // Location of json_extract
+    ngx_uint_t  stat;                       // Counters slot
+    ngx_uint_t  status;                     // json_extractor_status format
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;         // json_extract_threads
+    size_t      thread_size;                // Smallest body parsed by it
 #endif
     ngx_array_t json_cache;
-} ngx_json_extractor_loc_t;
+    ngx_array_t *bodies;                    // je_item_t *, fed by filter
+    ngx_array_t *responses;                 // je_item_t *, fed by filter
+};
+
+/**
+ * Streaming extractor state, the document is read once
+ * and only values of declared selectors are materialized
+ */
+typedef struct {
+    ngx_uint_t  slot;
+    ngx_uint_t  level;                      // Frames count on value start
+    u_char     *mark;                       // Value start in current buffer
+    ngx_str_t   buf;
+    size_t      size;
+} je_capture_t;
+
+typedef struct {
+    je_node_t  *node;
+    ngx_uint_t  index;                      // Current array element
+    ngx_uint_t  array;
+} je_frame_t;
+
+typedef struct {
+    ngx_pool_t     *pool;
+    je_item_t      *item;
+    ngx_str_t      *values;
+    ngx_uint_t      found;
+
+    ngx_int_t       rc;                     // NGX_AGAIN until finished
+    ngx_uint_t      state;
+    off_t           offset;                 // Consumed bytes
+    u_char         *window;                 // Read buffer of file data
+    je_inflate_t   *inflate;                // Compressed body or NULL
+    ngx_str_t       bin;                    // Binary document collected
+    size_t          binsize;
+    je_budget_t    *budget;                 // Limits scan, created on use
+    uint64_t        nsec;                   // Parse time of body buffers
+    char           *limit;                  // Exceeded in a thread task
+    off_t           limitpos;
+    ngx_err_t       err;                    // Read error in a thread task
+
+    je_frame_t     *frames;
+    ngx_uint_t      nframes;
+    je_node_t      *vnode;                  // Node of the next value
+
+    je_capture_t   *caps;
+    ngx_uint_t      ncaps;
+
+    u_char         *key;
+    size_t          keylen;
+    size_t          keysize;
+
+    ngx_uint_t      depth;                  // Depth of skipped value
+    unsigned        inplace:1;              // Buffers outlive the values
+    unsigned        deferred:1;             // Errors are logged by the caller
+    unsigned        instr:1;
+    unsigned        esc:1;
+    unsigned        kesc:1;
+    unsigned        kover:1;
+} je_stream_t;
+
+/**
+ * Worker cache entry of one source
+ */
+typedef struct je_lru_node_s je_lru_node_t;
+
+struct je_lru_node_s {
+    je_lru_node_t  *next;                   // Bucket chain
+    ngx_queue_t     queue;
+    je_item_t      *item;
+    uint64_t        hash;
+    ngx_str_t       source;
+    ngx_str_t      *values;
+    ngx_uint_t      refs;                   // Requests using the entry
+    unsigned        evicted:1;
+};
+
+/**
+ * Shared counters of one location, sums of all workers
+ */
+typedef struct {
+    ngx_atomic_t    parses;
+    ngx_atomic_t    bytes;
+    ngx_atomic_t    nsec;                   // Parse time
+    ngx_atomic_t    failures;               // Invalid documents
+    ngx_atomic_t    limited;                // Documents over the limits
+    ngx_atomic_t    defaults;               // Values not found
+    ngx_atomic_t    lru_hits;
+    ngx_atomic_t    cache_hits;
+    ngx_atomic_t    cache_misses;
+    ngx_atomic_t    latency[NGX_JSON_EXTRACTOR_STAT_BUCKETS];
+    uint64_t        name;                   // Hash of the location
+} je_stat_t;
+
+typedef struct {
+    ngx_atomic_t    cleanups;               // Arenas released
+    ngx_atomic_t    slabs;                  // Arena slabs released
+    ngx_atomic_t    evictions;              // Worker cache entries
+    ngx_uint_t      nstats;
+    je_stat_t       stats[1];               // nstats locations
+} je_status_t;
+
+/**
+ * Document parsed for the client request
+ */
+typedef struct {
+    ngx_uint_t      source;
+    ngx_uint_t      data_index;             // Source variable
+    ngx_str_t       src;                    // Source value, compared on hit
+    uint64_t        hash;
+    json_t         *json;                   // dom engine
+    je_tape_t      *tape;                   // tape engine
+} je_doc_t;
+
+/**
+ * Parse context of the client request. It is kept in the module context
+ * of the main request, locations after internal redirects and
+ * subrequests share it: redirects reset module contexts, so it is the
+ * value of a hidden variable of the main request too.
+ */
+typedef struct {
+    ngx_array_t     docs;                   // je_doc_t
+    je_arena_t     *arena;                  // Parsed documents memory
+} je_request_t;
+
+typedef struct {
+    ngx_array_t     streams;                // je_stream_t *
+    ngx_uint_t      cache_status;
+    ngx_int_t       phase;                  // Result of the body handler
+    je_request_t   *request;                // Main request only
+    unsigned        discard:1;              // Response is not sent anywhere
+    unsigned        threads:1;              // Body is read for the threads
+} ngx_json_extractor_ctx_t;
+
+ngx_int_t ngx_json_extractor_trie_add(ngx_pool_t *pool, je_path_t *path);
+je_node_t *ngx_json_extractor_node_find(je_node_t *node, u_char *key,
+    size_t len);
+
+je_stream_t *ngx_json_extractor_stream_create(ngx_pool_t *pool,
+    je_item_t *item);
+ngx_int_t ngx_json_extractor_stream_feed(je_stream_t *st, u_char *p,
+    u_char *last);
+ngx_int_t ngx_json_extractor_stream_finish(je_stream_t *st);
+ngx_int_t ngx_json_extractor_stream_chain(je_stream_t *st, ngx_chain_t *in);
+
+u_char *ngx_json_extractor_unescape(u_char *dst, u_char *src, size_t len);
+u_char *ngx_json_extractor_dtoa(u_char *buf, double d);
+u_char *ngx_json_extractor_space(u_char *p, u_char *last);
+u_char *ngx_json_extractor_string(u_char *p, u_char *last,
+    ngx_uint_t *escaped);
+u_char *ngx_json_extractor_number(u_char *p, u_char *last);
+
+ngx_int_t ngx_json_extractor_binary_feed(je_stream_t *st, u_char *p,
+    u_char *last);
+ngx_int_t ngx_json_extractor_binary_finish(je_stream_t *st);
+
+ngx_int_t ngx_json_extractor_limits_feed(je_stream_t *st, u_char *p,
+    u_char *last);
+ngx_int_t ngx_json_extractor_limits_over(je_stream_t *st, char *limit,
+    off_t pos);
+
+ngx_int_t ngx_json_extractor_inflate_init(je_stream_t *st);
+ngx_int_t ngx_json_extractor_inflate_feed(je_stream_t *st, u_char *p,
+    u_char *last);
+
+void ngx_json_extractor_alloc_begin(je_arena_t *a);
+void ngx_json_extractor_alloc_end(void);
+je_arena_t *ngx_json_extractor_arena_create(ngx_pool_t *pool);
+
+/**
+ * Skip version of the CPU, versions are compared by checks
+ */
+typedef u_char *(*je_skip_pt)(je_stream_t *st, u_char *p, u_char *last);
+
+#define NGX_JSON_EXTRACTOR_SKIP_VERSIONS  3
+
+typedef struct {
+    char           *name;
+    je_skip_pt      skip;
+} je_skip_version_t;
+
+uint64_t ngx_json_extractor_hash(u_char *p, size_t len, uint64_t seed);
+ngx_shm_zone_t *ngx_json_extractor_cache_zone(ngx_conf_t *cf,
+    ngx_str_t *name, size_t size);
+ngx_int_t ngx_json_extractor_cache_get(ngx_shm_zone_t *shm_zone,
+    uint64_t hash, ngx_str_t *src, je_stream_t *st);
+void ngx_json_extractor_cache_put(ngx_shm_zone_t *shm_zone, time_t ttl,
+    uint64_t hash, ngx_str_t *src, je_stream_t *st);
+void ngx_json_extractor_cache_stat(ngx_shm_zone_t *shm_zone,
+    ngx_atomic_uint_t *hits, ngx_atomic_uint_t *misses);
+
+je_lru_node_t *ngx_json_extractor_lru_get(je_item_t *it, uint64_t hash,
+    ngx_str_t *src);
+je_lru_node_t *ngx_json_extractor_lru_add(je_item_t *it, uint64_t hash,
+    ngx_str_t *src, je_stream_t *st);
+ngx_int_t ngx_json_extractor_lru_pin(ngx_pool_t *pool, je_lru_node_t *ln);
+
+je_item_t *ngx_json_extractor_select_get(je_select_t *sel, ngx_str_t *key,
+    ngx_json_extractor_loc_t *conf);
+ngx_int_t ngx_json_extractor_select_add(je_select_t *sel, ngx_str_t *key,
+    je_item_t *it, ngx_pool_t *pool);
+
+ngx_int_t ngx_json_extractor_tape_parse(ngx_pool_t *pool, ngx_str_t *doc,
+    je_tape_t **tape, size_t *pos);
+void ngx_json_extractor_tape_walk(je_stream_t *st, je_node_t *node,
+    je_tape_t *tape);
+size_t ngx_json_extractor_tape_size(je_tape_t *tape);
+
+je_file_t *ngx_json_extractor_file_open(ngx_conf_t *cf, ngx_array_t *files,
+    ngx_str_t *name);
+je_file_doc_t *ngx_json_extractor_file_get(je_file_t *f, ngx_pool_t *pool);
+ngx_int_t ngx_json_extractor_file_process(ngx_cycle_t *cycle);
+
+je_build_t *ngx_json_extractor_build_block(ngx_conf_t *cf);
+ngx_int_t ngx_json_extractor_build(ngx_http_request_t *r, je_build_t *b,
+    ngx_str_t *out);
+
+ngx_int_t ngx_json_extractor_status_zone(ngx_conf_t *cf,
+    ngx_json_extractor_main_t *jmcf);
+ngx_int_t ngx_json_extractor_status_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_json_extractor_status_handler(ngx_http_request_t *r);
+uint64_t ngx_json_extractor_stat_time(void);
+void ngx_json_extractor_stat_parse(je_item_t *it, off_t bytes, uint64_t nsec,
+    ngx_int_t rc);
+void ngx_json_extractor_stat_add(je_item_t *it, size_t field, ngx_uint_t n);
+extern je_status_t *ngx_json_extractor_status;    // Shared counters or NULL
+
+#if (NGX_THREADS)
+ngx_int_t ngx_json_extractor_thread_parse(ngx_http_request_t *r,
+    ngx_thread_pool_t *tp, je_stream_t **streams, ngx_uint_t n,
+    ngx_chain_t *in);
+#endif
+
+void ngx_json_extractor_simd_init(void);
+ngx_uint_t ngx_json_extractor_simd_versions(je_skip_version_t *v);
+extern je_skip_pt ngx_json_extractor_skip;
 
 extern ngx_module_t  ngx_json_extractor_module;
 
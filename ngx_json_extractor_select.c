@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Worker cache of compiled selectors.
+ *
+ * Every json_extract_select has own table in the worker memory keyed by
+ * the selector string and the location serving the request, so a
+ * repeated selector is neither split nor put into a trie again. Entry owns the pool of its item, items are used by
+ * the variable only while it is evaluated, so entries are evicted at
+ * once.
+ */
+
+typedef struct je_select_node_s je_select_node_t;
+
+struct je_select_node_s {
+    je_select_node_t   *next;               // Bucket chain
+    ngx_queue_t         queue;
+    uint64_t            hash;
+    ngx_str_t           key;
+    je_item_t          *item;
+    ngx_pool_t         *pool;               // Item, trie and key
+};
+
+struct je_select_cache_s {
+    ngx_uint_t          size;
+    ngx_uint_t          n;
+    ngx_queue_t         queue;              // Recently used first
+    je_select_node_t  **buckets;            // size buckets
+};
+
+static void je_select_evict(je_select_cache_t *sc, je_select_node_t *sn);
+
+/**
+ * Find compiled selector
+ * @param sel
+ * @param key - selector string
+ * @param conf - location serving the request
+ * @return item or NULL
+ */
+je_item_t *
+ngx_json_extractor_select_get(je_select_t *sel, ngx_str_t *key,
+    ngx_json_extractor_loc_t *conf)
+{
+    uint64_t            hash;
+    je_select_node_t   *sn;
+    je_select_cache_t  *sc;
+
+    sc = sel->cache;
+    if (NULL==sc)
+        return NULL;
+
+    hash = ngx_json_extractor_hash(key->data, key->len, (uintptr_t) conf);
+
+    for (sn=sc->buckets[hash % sc->size] ; sn ; sn=sn->next) {
+        if (hash==sn->hash && conf==sn->item->conf && key->len==sn->key.len
+            && 0==ngx_memcmp(key->data, sn->key.data, key->len))
+        {
+            ngx_queue_remove(&sn->queue);
+            ngx_queue_insert_head(&sc->queue, &sn->queue);
+            return sn->item;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Keep compiled selector, the least recently used one is evicted
+ * @param sel
+ * @param key - selector string in the pool
+ * @param it
+ * @param pool - memory of the item, released by the cache
+ * @return NGX_OK or NGX_ERROR if the item is not kept
+ */
+ngx_int_t
+ngx_json_extractor_select_add(je_select_t *sel, ngx_str_t *key,
+    je_item_t *it, ngx_pool_t *pool)
+{
+    je_select_node_t   *sn;
+    je_select_cache_t  *sc;
+
+    sc = sel->cache;
+
+    if (NULL==sc) {
+        sc = ngx_calloc(sizeof(je_select_cache_t), ngx_cycle->log);
+        if (NULL==sc)
+            return NGX_ERROR;
+
+        sc->size = NGX_JSON_EXTRACTOR_SELECT_CACHE;
+        sc->buckets = ngx_calloc(sc->size * sizeof(je_select_node_t *),
+                                 ngx_cycle->log);
+        if (NULL==sc->buckets) {
+            ngx_free(sc);
+            return NGX_ERROR;
+        }
+
+        ngx_queue_init(&sc->queue);
+        sel->cache = sc;
+    }
+
+    if (sc->n>=sc->size) {
+        je_select_evict(sc, ngx_queue_data(ngx_queue_last(&sc->queue),
+                                           je_select_node_t, queue));
+    }
+
+    sn = ngx_palloc(pool, sizeof(je_select_node_t));
+    if (NULL==sn)
+        return NGX_ERROR;
+
+    sn->hash = ngx_json_extractor_hash(key->data, key->len,
+                                       (uintptr_t) it->conf);
+    sn->key = *key;
+    sn->item = it;
+    sn->pool = pool;
+
+    sn->next = sc->buckets[sn->hash % sc->size];
+    sc->buckets[sn->hash % sc->size] = sn;
+    ngx_queue_insert_head(&sc->queue, &sn->queue);
+    sc->n++;
+
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Remove entry and release its item
+ * @param sc
+ * @param sn
+ */
+static void
+je_select_evict(je_select_cache_t *sc, je_select_node_t *sn)
+{
+    je_select_node_t **snp;
+
+    for (snp=&sc->buckets[sn->hash % sc->size] ; *snp ; snp=&(*snp)->next) {
+        if (*snp==sn) {
+            *snp = sn->next;
+            break;
+        }
+    }
+
+    ngx_queue_remove(&sn->queue);
+    sc->n--;
+
+    ngx_destroy_pool(sn->pool);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
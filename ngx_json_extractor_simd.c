@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#if (NGX_JSON_EXTRACTOR_SIMD)
+#include <immintrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Skipping of unrelated values.
+ *
+ * Vector versions classify 64 bytes at once and visit only quotes,
+ * backslashes and brackets, every visited byte goes through the same
+ * transitions as in the scalar loop, so all versions stop on the same
+ * byte with the same state.
+ */
+
+static u_char *je_skip_scalar(je_stream_t *st, u_char *p, u_char *last);
+
+je_skip_pt ngx_json_extractor_skip = je_skip_scalar;
+
+/**
+ * Skip value bytes
+ * @param st - skip state: depth, instr, esc
+ * @param p
+ * @param last
+ * @return the last byte of the value or last if it continues
+ */
+static u_char *
+je_skip_scalar(je_stream_t *st, u_char *p, u_char *last)
+{
+    u_char  ch;
+
+    for ( ; p<last ; p++) {
+        ch = *p;
+
+        if (st->instr) {
+            if (st->esc) {
+                st->esc = 0;
+            } else if ('\\'==ch) {
+                st->esc = 1;
+            } else if ('"'==ch) {
+                st->instr = 0;
+                if (0==st->depth)
+                    return p;
+            }
+            continue;
+        }
+
+        if ('"'==ch) {
+            st->instr = 1;
+        } else if ('{'==ch || '['==ch) {
+            st->depth++;
+        } else if ('}'==ch || ']'==ch) {
+            if (0==--st->depth)
+                return p;
+        }
+    }
+
+    return last;
+}
+
+#if (NGX_JSON_EXTRACTOR_SIMD)
+
+/**
+ * Visit marked bytes of one 64 bytes block
+ * @param st
+ * @param p - block start
+ * @param mask - quotes, backslashes and brackets
+ * @return offset of the last byte of the value or 64
+ */
+static ngx_inline ngx_uint_t
+je_skip_block(je_stream_t *st, u_char *p, uint64_t mask)
+{
+    ngx_uint_t  i;
+    u_char      ch;
+
+    // Escaped byte on the block edge
+    if (st->esc) {
+        st->esc = 0;
+        mask &= ~(uint64_t) 1;
+    }
+
+    while (mask) {
+        i = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        ch = p[i];
+
+        if (st->instr) {
+            if ('\\'==ch) {
+                if (63==i) {
+                    st->esc = 1;
+                    break;
+                }
+                mask &= ~((uint64_t) 1 << (i + 1));
+            } else if ('"'==ch) {
+                st->instr = 0;
+                if (0==st->depth)
+                    return i;
+            }
+            continue;
+        }
+
+        if ('"'==ch) {
+            st->instr = 1;
+        } else if ('{'==ch || '['==ch) {
+            st->depth++;
+        } else if ('}'==ch || ']'==ch) {
+            if (0==--st->depth)
+                return i;
+        }
+    }
+
+    return 64;
+}
+
+__attribute__((target("avx2")))
+static ngx_inline uint32_t
+je_mask_avx2(__m256i v)
+{
+    __m256i  x, m;
+
+    // '{' | 0x20 == '[' | 0x20, '}' | 0x20 == ']' | 0x20
+    x = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+    m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('{')),
+                            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('}'))));
+
+    return (uint32_t) _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static u_char *
+je_skip_avx2(je_stream_t *st, u_char *p, u_char *last)
+{
+    uint64_t    mask;
+    ngx_uint_t  i;
+
+    for ( ; last-p>=64 ; p+=64) {
+        mask = (uint64_t) je_mask_avx2(_mm256_loadu_si256((__m256i *) p))
+             | (uint64_t) je_mask_avx2(_mm256_loadu_si256((__m256i *) (p + 32)))
+               << 32;
+
+        i = je_skip_block(st, p, mask);
+        if (i<64)
+            return p + i;
+    }
+
+    return je_skip_scalar(st, p, last);
+}
+
+__attribute__((target("sse4.2")))
+static ngx_inline uint32_t
+je_mask_sse42(__m128i set, u_char *p)
+{
+    __m128i  v;
+
+    v = _mm_loadu_si128((__m128i *) p);
+
+    return (uint32_t) _mm_cvtsi128_si32(_mm_cmpestrm(set, 6, v, 16,
+        _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY|_SIDD_BIT_MASK));
+}
+
+__attribute__((target("sse4.2")))
+static u_char *
+je_skip_sse42(je_stream_t *st, u_char *p, u_char *last)
+{
+    __m128i     set;
+    uint64_t    mask;
+    ngx_uint_t  i;
+
+    set = _mm_setr_epi8('"', '\\', '{', '}', '[', ']',
+                        0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    for ( ; last-p>=64 ; p+=64) {
+        mask = (uint64_t) je_mask_sse42(set, p)
+             | (uint64_t) je_mask_sse42(set, p + 16) << 16
+             | (uint64_t) je_mask_sse42(set, p + 32) << 32
+             | (uint64_t) je_mask_sse42(set, p + 48) << 48;
+
+        i = je_skip_block(st, p, mask);
+        if (i<64)
+            return p + i;
+    }
+
+    return je_skip_scalar(st, p, last);
+}
+
+#endif
+
+/**
+ * Skip versions supported by the CPU, the scalar one first
+ * @param v - NGX_JSON_EXTRACTOR_SKIP_VERSIONS entries
+ * @return versions count
+ */
+ngx_uint_t
+ngx_json_extractor_simd_versions(je_skip_version_t *v)
+{
+    ngx_uint_t  n;
+
+    n = 0;
+    v[n].name = "scalar";
+    v[n++].skip = je_skip_scalar;
+
+#if (NGX_JSON_EXTRACTOR_SIMD)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2")) {
+        v[n].name = "sse4.2";
+        v[n++].skip = je_skip_sse42;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        v[n].name = "avx2";
+        v[n++].skip = je_skip_avx2;
+    }
+#endif
+
+    return n;
+}
+
+/**
+ * Choose skip version supported by the CPU
+ */
+void
+ngx_json_extractor_simd_init(void)
+{
+#if (NGX_JSON_EXTRACTOR_SIMD)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        ngx_json_extractor_skip = je_skip_avx2;
+        return;
+    }
+
+    if (__builtin_cpu_supports("sse4.2")) {
+        ngx_json_extractor_skip = je_skip_sse42;
+        return;
+    }
+#endif
+
+    ngx_json_extractor_skip = je_skip_scalar;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,643 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Extraction metrics.
+ *
+ * Every location with json_extract has a slot of counters in a shared
+ * zone, workers add to them with atomic operations and without locks.
+ * Nothing is counted and the clock is not read unless some location
+ * has json_extractor_status. Totals are summed when the status is read.
+ * Counters are kept on reload for the locations of the same name, the
+ * zone of the new size takes them from the running one.
+ */
+
+typedef struct {
+    je_status_t        *sh;
+    ngx_slab_pool_t    *shpool;
+    ngx_uint_t          nstats;
+    ngx_str_t          *names;              // Location of every slot
+} je_status_zone_t;
+
+typedef struct {
+    char               *name;
+    char               *help;
+    size_t              offset;
+} je_stat_field_t;
+
+#define JE_STAT_LINE    128                 // Metric line without label
+
+static ngx_int_t je_status_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static je_status_t *je_status_running(ngx_shm_zone_t *shm_zone);
+static ngx_int_t je_status_remap(je_status_zone_t *zone, je_status_t *osh,
+    ngx_log_t *log);
+static u_char *je_status_json(u_char *p, je_stat_t *s);
+static u_char *je_status_prometheus(u_char *p, je_stat_t *s, ngx_str_t *name,
+    ngx_uint_t n);
+static u_char *je_status_label(u_char *p, ngx_str_t *name);
+static u_char *je_status_escape(u_char *p, ngx_str_t *name);
+
+je_status_t *ngx_json_extractor_status;
+
+// Upper bounds of latency buckets in nanoseconds, the last is +Inf
+static uint64_t je_stat_bounds[NGX_JSON_EXTRACTOR_STAT_BUCKETS - 1] = {
+    5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 5000000, 10000000
+};
+
+static char *je_stat_le[NGX_JSON_EXTRACTOR_STAT_BUCKETS] = {
+    "0.000005", "0.00001", "0.000025", "0.00005", "0.0001", "0.00025",
+    "0.0005", "0.001", "0.005", "0.01", "+Inf"
+};
+
+static je_stat_field_t je_stat_fields[] = {
+    { "parses", "Documents parsed", offsetof(je_stat_t, parses) },
+    { "bytes", "Bytes of parsed documents", offsetof(je_stat_t, bytes) },
+    { "failures", "Invalid documents", offsetof(je_stat_t, failures) },
+    { "limited", "Documents over the limits", offsetof(je_stat_t, limited) },
+    { "defaults", "Values not found in documents",
+      offsetof(je_stat_t, defaults) },
+    { "lru_hits", "Sources found in the worker cache",
+      offsetof(je_stat_t, lru_hits) },
+    { "cache_hits", "Sources found in the shared cache",
+      offsetof(je_stat_t, cache_hits) },
+    { "cache_misses", "Sources not found in the shared cache",
+      offsetof(je_stat_t, cache_misses) },
+    { NULL, NULL, 0 }
+};
+
+#define je_stat_field(s, f) (*(ngx_atomic_t *) ((u_char *) (s) + (f)))
+
+/**
+ * Add the zone of counters, slots are numbered by this moment
+ * @param cf
+ * @param jmcf
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_status_zone(ngx_conf_t *cf, ngx_json_extractor_main_t *jmcf)
+{
+    size_t             size;
+    ngx_shm_zone_t    *shm_zone;
+    je_status_zone_t  *zone;
+
+    static ngx_str_t  name = ngx_string("json_extractor_status");
+
+    zone = ngx_pcalloc(cf->pool, sizeof(je_status_zone_t));
+    if (NULL==zone)
+        return NGX_ERROR;
+
+    zone->nstats = jmcf->stat_names.nelts;
+    zone->names = jmcf->stat_names.elts;
+
+    // Zone of other size is created again, so counters fit the slots
+    size = 8 * ngx_pagesize + sizeof(je_status_t)
+         + zone->nstats * sizeof(je_stat_t);
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_json_extractor_module);
+    if (NULL==shm_zone)
+        return NGX_ERROR;
+
+    shm_zone->init = je_status_init_zone;
+    shm_zone->data = zone;
+
+    jmcf->stat_zone = shm_zone;
+    return NGX_OK;
+}
+
+/**
+ * Find counters of the worker cycle
+ * @param cycle
+ * @return NGX_OK
+ */
+ngx_int_t
+ngx_json_extractor_status_process(ngx_cycle_t *cycle)
+{
+    je_status_zone_t           *zone;
+    ngx_json_extractor_main_t  *jmcf;
+
+    ngx_json_extractor_status = NULL;
+
+    if (NULL==ngx_get_conf(cycle->conf_ctx, ngx_http_module))
+        return NGX_OK;
+
+    jmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_json_extractor_module);
+    if (NULL==jmcf || NULL==jmcf->stat_zone)
+        return NGX_OK;
+
+    zone = jmcf->stat_zone->data;
+    ngx_json_extractor_status = zone->sh;
+
+    return NGX_OK;
+}
+
+/**
+ * Clock of parse time
+ * @return nanoseconds or 0 if nothing is counted
+ */
+uint64_t
+ngx_json_extractor_stat_time(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+#else
+    struct timeval   tv;
+#endif
+
+    if (NULL==ngx_json_extractor_status)
+        return 0;
+
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    ngx_gettimeofday(&tv);
+    return (uint64_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/**
+ * Count parsed document
+ * @param it
+ * @param bytes
+ * @param nsec - parse time
+ * @param rc - parse result
+ */
+void
+ngx_json_extractor_stat_parse(je_item_t *it, off_t bytes, uint64_t nsec,
+    ngx_int_t rc)
+{
+    ngx_uint_t   i;
+    je_stat_t   *s;
+
+    if (NULL==ngx_json_extractor_status
+        || NGX_CONF_UNSET_UINT==it->conf->stat)
+        return;
+
+    s = &ngx_json_extractor_status->stats[it->conf->stat];
+
+    (void) ngx_atomic_fetch_add(&s->parses, 1);
+    (void) ngx_atomic_fetch_add(&s->bytes, bytes);
+    (void) ngx_atomic_fetch_add(&s->nsec, nsec);
+
+    if (NGX_ERROR==rc)
+        (void) ngx_atomic_fetch_add(&s->failures, 1);
+    else if (NGX_DECLINED==rc)
+        (void) ngx_atomic_fetch_add(&s->limited, 1);
+
+    for (i=0 ; i<NGX_JSON_EXTRACTOR_STAT_BUCKETS-1 ; i++) {
+        if (nsec<=je_stat_bounds[i])
+            break;
+    }
+
+    (void) ngx_atomic_fetch_add(&s->latency[i], 1);
+}
+
+/**
+ * Add to the counter of the item location
+ * @param it
+ * @param field - offset of the counter in je_stat_t
+ * @param n
+ */
+void
+ngx_json_extractor_stat_add(je_item_t *it, size_t field, ngx_uint_t n)
+{
+    if (NULL==ngx_json_extractor_status
+        || NGX_CONF_UNSET_UINT==it->conf->stat || 0==n)
+        return;
+
+    (void) ngx_atomic_fetch_add(
+        &je_stat_field(&ngx_json_extractor_status->stats[it->conf->stat],
+                       field), n);
+}
+
+/**
+ * Write counters of all locations as JSON or Prometheus text
+ * @param r
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_status_handler(ngx_http_request_t *r)
+{
+    size_t                      size;
+    u_char                     *p;
+    ngx_int_t                   rc;
+    ngx_uint_t                  i, k;
+    ngx_str_t                  *names;
+    ngx_buf_t                  *b;
+    ngx_chain_t                 out;
+    je_stat_t                   total, *s;
+    je_status_t                *sh;
+    je_stat_field_t            *f;
+    ngx_json_extractor_loc_t   *olcf;
+    ngx_json_extractor_main_t  *jmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+        return NGX_HTTP_NOT_ALLOWED;
+
+    rc = ngx_http_discard_request_body(r);
+    if (NGX_OK!=rc)
+        return rc;
+
+    sh = ngx_json_extractor_status;
+    if (NULL==sh)
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+    olcf = ngx_http_get_module_loc_conf(r, ngx_json_extractor_module);
+    jmcf = ngx_http_get_module_main_conf(r, ngx_json_extractor_module);
+    names = jmcf->stat_names.elts;
+
+    // Counters of the slot are read one by one, they are not consistent
+    ngx_memzero(&total, sizeof(je_stat_t));
+
+    for (i=0 ; i<sh->nstats ; i++) {
+        s = &sh->stats[i];
+
+        for (f=je_stat_fields ; f->name ; f++)
+            je_stat_field(&total, f->offset) += je_stat_field(s, f->offset);
+
+        total.nsec += s->nsec;
+
+        for (k=0 ; k<NGX_JSON_EXTRACTOR_STAT_BUCKETS ; k++)
+            total.latency[k] += s->latency[k];
+    }
+
+    // Every line may have the escaped location
+    size = 1024;
+    for (i=0 ; i<sh->nstats ; i++) {
+        size += (names[i].len * 6 + JE_STAT_LINE)
+              * (sizeof(je_stat_fields) / sizeof(je_stat_field_t)
+                 + NGX_JSON_EXTRACTOR_STAT_BUCKETS + 3);
+    }
+    size += JE_STAT_LINE * (sizeof(je_stat_fields) / sizeof(je_stat_field_t)
+                            + NGX_JSON_EXTRACTOR_STAT_BUCKETS + 3) * 2;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (NULL==b)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    p = b->last;
+
+    if (NGX_JSON_EXTRACTOR_STATUS_PROMETHEUS==olcf->status) {
+        p = je_status_prometheus(p, sh->stats, names, sh->nstats);
+
+        p = ngx_sprintf(p,
+            "# HELP nginx_json_extractor_cleanups_total"
+                " Arenas of parsed documents released\n"
+            "# TYPE nginx_json_extractor_cleanups_total counter\n"
+            "nginx_json_extractor_cleanups_total %uA\n"
+            "# HELP nginx_json_extractor_slabs_total"
+                " Arena slabs released\n"
+            "# TYPE nginx_json_extractor_slabs_total counter\n"
+            "nginx_json_extractor_slabs_total %uA\n"
+            "# HELP nginx_json_extractor_evictions_total"
+                " Worker cache entries evicted\n"
+            "# TYPE nginx_json_extractor_evictions_total counter\n"
+            "nginx_json_extractor_evictions_total %uA\n",
+            sh->cleanups, sh->slabs, sh->evictions);
+
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+
+    } else {
+        p = ngx_sprintf(p, "{\"cleanups\":%uA,\"slabs\":%uA,"
+                        "\"evictions\":%uA,\"total\":{",
+                        sh->cleanups, sh->slabs, sh->evictions);
+        p = je_status_json(p, &total);
+        p = ngx_cpymem(p, "},\"locations\":[", sizeof("},\"locations\":[")-1);
+
+        for (i=0 ; i<sh->nstats ; i++) {
+            if (i>0)
+                *p++ = ',';
+
+            p = ngx_cpymem(p, "{\"location\":\"", sizeof("{\"location\":\"")-1);
+            p = (u_char *) ngx_escape_json(p, names[i].data, names[i].len);
+            p = ngx_cpymem(p, "\",", 2);
+            p = je_status_json(p, &sh->stats[i]);
+            *p++ = '}';
+        }
+
+        p = ngx_cpymem(p, "]}\n", 3);
+
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
+
+    b->last = p;
+    b->last_buf = (r==r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    rc = ngx_http_send_header(r);
+    if (NGX_ERROR==rc || rc>NGX_OK || r->header_only)
+        return rc;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Init shared memory of the zone, counters of the previous
+ * configuration are kept on reload
+ * @param shm_zone
+ * @param data - zone of the previous configuration of the same size
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    je_status_zone_t  *ozone = data;
+    je_status_zone_t  *zone;
+    je_status_t       *osh;
+
+    zone = shm_zone->data;
+
+    // Zone of the same size has the same number of slots
+    if (NULL!=ozone) {
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return je_status_remap(zone, zone->sh, shm_zone->shm.log);
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_calloc(zone->shpool, sizeof(je_status_t)
+                               + zone->nstats * sizeof(je_stat_t));
+    if (NULL==zone->sh)
+        return NGX_ERROR;
+
+    zone->sh->nstats = zone->nstats;
+    zone->shpool->data = zone->sh;
+
+    // Zone of other size is new, the running one is still mapped
+    osh = je_status_running(shm_zone);
+
+    return je_status_remap(zone, osh, shm_zone->shm.log);
+}
+
+/**
+ * Find counters of the running configuration, it is the current cycle
+ * while the new one is initialized
+ * @param shm_zone - zone of the new configuration
+ * @return counters or NULL
+ */
+static je_status_t *
+je_status_running(ngx_shm_zone_t *shm_zone)
+{
+    ngx_uint_t         i;
+    ngx_shm_zone_t    *oshm;
+    ngx_list_part_t   *part;
+    je_status_zone_t  *ozone;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    oshm = part->elts;
+
+    for (i=0 ; ; i++) {
+        if (i>=part->nelts) {
+            if (NULL==part->next)
+                break;
+
+            part = part->next;
+            oshm = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone->tag!=oshm[i].tag
+            || shm_zone->shm.name.len!=oshm[i].shm.name.len
+            || 0!=ngx_strncmp(shm_zone->shm.name.data, oshm[i].shm.name.data,
+                              shm_zone->shm.name.len))
+            continue;
+
+        ozone = oshm[i].data;
+        return NULL==ozone ? NULL : ozone->sh;
+    }
+
+    return NULL;
+}
+
+/**
+ * Move counters of the previous configuration to the slots of the
+ * locations with the same name, slots of new locations start at zero.
+ * Workers of the previous configuration still count into the slots
+ * by the old order until they exit.
+ * @param zone
+ * @param osh - counters of the previous configuration, may be the zone
+ *              ones or NULL
+ * @param log
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_status_remap(je_status_zone_t *zone, je_status_t *osh, ngx_log_t *log)
+{
+    u_char      *used;
+    uint64_t     name;
+    ngx_uint_t   i, k, n;
+    je_stat_t   *stats;
+
+    n = NULL==osh ? 0 : osh->nstats;
+
+    stats = ngx_alloc(zone->nstats * sizeof(je_stat_t), log);
+    used = ngx_calloc(n + 1, log);
+    if (NULL==stats || NULL==used) {
+        ngx_free(stats);
+        ngx_free(used);
+        return NGX_ERROR;
+    }
+
+    for (i=0 ; i<zone->nstats ; i++) {
+        name = ngx_json_extractor_hash(zone->names[i].data,
+                                       zone->names[i].len, 0);
+
+        ngx_memzero(&stats[i], sizeof(je_stat_t));
+        stats[i].name = name;
+
+        // Locations of the same name share the counters by order
+        for (k=0 ; k<n ; k++) {
+            if (name==osh->stats[k].name && !used[k]) {
+                stats[i] = osh->stats[k];
+                used[k] = 1;
+                break;
+            }
+        }
+    }
+
+    ngx_memcpy(zone->sh->stats, stats, zone->nstats * sizeof(je_stat_t));
+
+    if (NULL!=osh && osh!=zone->sh) {
+        zone->sh->cleanups = osh->cleanups;
+        zone->sh->slabs = osh->slabs;
+        zone->sh->evictions = osh->evictions;
+    }
+
+    ngx_free(stats);
+    ngx_free(used);
+
+    return NGX_OK;
+}
+
+/**
+ * Counters of one slot as JSON members
+ * @param p
+ * @param s
+ * @return end of the text
+ */
+static u_char *
+je_status_json(u_char *p, je_stat_t *s)
+{
+    ngx_uint_t        k;
+    je_stat_field_t  *f;
+
+    for (f=je_stat_fields ; f->name ; f++) {
+        p = ngx_sprintf(p, "\"%s\":%uA,", f->name,
+                        je_stat_field(s, f->offset));
+    }
+
+    p = ngx_sprintf(p, "\"parse_ns\":%uA,\"latency\":{", s->nsec);
+
+    for (k=0 ; k<NGX_JSON_EXTRACTOR_STAT_BUCKETS ; k++) {
+        p = ngx_sprintf(p, "%s\"%s\":%uA", k>0 ? "," : "", je_stat_le[k],
+                        s->latency[k]);
+    }
+
+    *p++ = '}';
+    return p;
+}
+
+/**
+ * Counters of all slots as Prometheus metrics, series of one metric
+ * go together
+ * @param p
+ * @param stats
+ * @param names - location of every slot
+ * @param n - slots count
+ * @return end of the text
+ */
+static u_char *
+je_status_prometheus(u_char *p, je_stat_t *stats, ngx_str_t *names,
+    ngx_uint_t n)
+{
+    ngx_uint_t        i, k;
+    ngx_atomic_uint_t count;
+    je_stat_field_t  *f;
+
+    for (f=je_stat_fields ; f->name ; f++) {
+        p = ngx_sprintf(p, "# HELP nginx_json_extractor_%s_total %s\n"
+                        "# TYPE nginx_json_extractor_%s_total counter\n",
+                        f->name, f->help, f->name);
+
+        for (i=0 ; i<n ; i++) {
+            p = ngx_sprintf(p, "nginx_json_extractor_%s_total", f->name);
+            p = je_status_label(p, &names[i]);
+            p = ngx_sprintf(p, "} %uA\n", je_stat_field(&stats[i], f->offset));
+        }
+    }
+
+    p = ngx_sprintf(p, "# HELP nginx_json_extractor_parse_seconds"
+                    " Parse time of documents\n"
+                    "# TYPE nginx_json_extractor_parse_seconds histogram\n");
+
+    for (i=0 ; i<n ; i++) {
+        for (count=0, k=0 ; k<NGX_JSON_EXTRACTOR_STAT_BUCKETS ; k++) {
+            count += stats[i].latency[k];
+
+            p = ngx_sprintf(p, "nginx_json_extractor_parse_seconds_bucket");
+            p = je_status_label(p, &names[i]);
+            p = ngx_sprintf(p, ",le=\"%s\"} %uA\n", je_stat_le[k], count);
+        }
+
+        p = ngx_sprintf(p, "nginx_json_extractor_parse_seconds_sum");
+        p = je_status_label(p, &names[i]);
+        p = ngx_sprintf(p, "} %uA.%09uA\n", stats[i].nsec / 1000000000,
+                        stats[i].nsec % 1000000000);
+
+        p = ngx_sprintf(p, "nginx_json_extractor_parse_seconds_count");
+        p = je_status_label(p, &names[i]);
+        p = ngx_sprintf(p, "} %uA\n", count);
+    }
+
+    return p;
+}
+
+/**
+ * Open labels of the series with the location
+ * @param p
+ * @param name
+ * @return end of the text
+ */
+static u_char *
+je_status_label(u_char *p, ngx_str_t *name)
+{
+    p = ngx_cpymem(p, "{location=\"", sizeof("{location=\"")-1);
+    p = je_status_escape(p, name);
+    *p++ = '"';
+    return p;
+}
+
+/**
+ * Escape label value of the Prometheus text format, only backslash,
+ * quote and line feed are escaped there
+ * @param p
+ * @param name
+ * @return end of the text
+ */
+static u_char *
+je_status_escape(u_char *p, ngx_str_t *name)
+{
+    ngx_uint_t i;
+
+    for (i=0 ; i<name->len ; i++) {
+        switch (name->data[i]) {
+
+        case '\\':
+        case '"':
+            *p++ = '\\';
+            *p++ = name->data[i];
+            break;
+
+        case '\n':
+            *p++ = '\\';
+            *p++ = 'n';
+            break;
+
+        default:
+            *p++ = name->data[i];
+        }
+    }
+
+    return p;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,986 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    je_st_value = 0,
+    je_st_key_or_end,
+    je_st_key,
+    je_st_colon,
+    je_st_after,
+    je_st_skip,
+    je_st_scalar,
+    je_st_elem_or_end,
+    je_st_done
+};
+
+#define je_is_delimiter(c)                                                    \
+    (l_isspace(c) || (c) == ',' || (c) == '}' || (c) == ']')
+
+#define je_is_scalar(c)                                                       \
+    (((c) >= '0' && (c) <= '9') || ((c) >= 'a' && (c) <= 'z')               \
+     || (c) == '-' || (c) == '+' || (c) == '.' || (c) == 'E')
+
+// Level 0 drops messages of file reads in a thread task
+static ngx_log_t je_quiet_log;
+
+// Helpers
+static void je_node_index(je_node_t *node);
+static je_node_t *je_key_match(je_stream_t *st);
+static je_node_t *je_elem_match(je_stream_t *st);
+static ngx_int_t je_chain_feed(je_stream_t *st, u_char *p, u_char *last);
+static ngx_int_t je_value_end(je_stream_t *st, u_char *p);
+static ngx_int_t je_capture_append(je_stream_t *st, je_capture_t *cap,
+    u_char *p, u_char *last);
+static ngx_int_t je_capture_done(je_stream_t *st, je_capture_t *cap);
+
+///////////////////////////////////////////////////////////////////////////////
+/// SELECTOR TRIE /////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Add compiled selector to the trie of its json_extract
+ * @param pool
+ * @param path
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_trie_add(ngx_pool_t *pool, je_path_t *path)
+{
+    ngx_uint_t  i;
+    je_item_t  *it;
+    je_node_t  *node, *child;
+
+    it = path->item;
+    node = &it->root;
+
+    for (i=0 ; i<path->nkeys ; i++) {
+        if (NULL==node->children.elts) {
+            if (NGX_OK!=ngx_array_init(&node->children, pool, 2,
+                                       sizeof(je_node_t)))
+                return NGX_ERROR;
+        }
+
+        child = ngx_json_extractor_node_find(node, path->keys[i].data,
+                                             path->keys[i].len);
+
+        if (NULL==child) {
+            child = ngx_array_push(&node->children);
+            if (NULL==child)
+                return NGX_ERROR;
+
+            ngx_memzero(child, sizeof(je_node_t));
+            child->key = path->keys[i];
+            child->slot = -1;
+
+            je_node_index(child);
+
+            if (child->isindex || child->any)
+                node->elems = 1;
+
+            if (child->isindex && child->index<0)
+                it->backward = 1;
+        }
+
+        if (it->keylen<path->keys[i].len)
+            it->keylen = path->keys[i].len;
+
+        node = child;
+    }
+
+    // Variables with the same selector share one value
+    if (node->slot<0)
+        node->slot = it->nslots++;
+
+    path->slot = node->slot;
+
+    if (it->depth<path->nkeys)
+        it->depth = path->nkeys;
+
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// STREAM ////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Create extractor state for one document
+ * @param pool
+ * @param item - json_extract descriptor
+ * @return state or NULL
+ */
+je_stream_t *
+ngx_json_extractor_stream_create(ngx_pool_t *pool, je_item_t *item)
+{
+    je_stream_t  *st;
+
+    st = ngx_pcalloc(pool, sizeof(je_stream_t));
+    if (NULL==st)
+        return NULL;
+
+    st->pool = pool;
+    st->item = item;
+    st->vnode = &item->root;
+    st->state = je_st_value;
+    st->rc = NGX_AGAIN;
+
+    // Escaped key can't be longer than 6 bytes per decoded one
+    st->keysize = item->keylen * 6 + 1;
+
+    st->values = ngx_pcalloc(pool, (item->nslots + 1) * sizeof(ngx_str_t));
+    st->frames = ngx_palloc(pool, (item->depth + 1) * sizeof(je_frame_t));
+    st->caps = ngx_palloc(pool, (item->depth + 1) * sizeof(je_capture_t));
+    st->key = ngx_pnalloc(pool, st->keysize);
+
+    if (NULL==st->values || NULL==st->frames || NULL==st->caps
+        || NULL==st->key)
+        return NULL;
+
+    return st;
+}
+
+/**
+ * Process next part of the document
+ * @param st
+ * @param p - buffer start
+ * @param last - buffer end
+ * @return NGX_OK when all values are found or the document is over,
+ *         NGX_AGAIN if more data is expected, NGX_ERROR on invalid JSON,
+ *         NGX_DECLINED if the document is over the limits
+ */
+ngx_int_t
+ngx_json_extractor_stream_feed(je_stream_t *st, u_char *p, u_char *last)
+{
+    u_char        ch, *start;
+    ngx_int_t     rc;
+    ngx_uint_t    i;
+    je_node_t    *node;
+    je_frame_t   *fr;
+    je_capture_t *cap;
+
+    // Limits are checked before the buffer is parsed
+    if (NULL!=st->item->limits) {
+        rc = ngx_json_extractor_limits_feed(st, p, last);
+        if (NGX_OK!=rc)
+            return rc;
+    }
+
+    // Binary document is walked when it is complete
+    if (NGX_JSON_EXTRACTOR_FORMAT_JSON!=st->item->format)
+        return ngx_json_extractor_binary_feed(st, p, last);
+
+    start = p;
+
+    // Unfinished values continue from the buffer start
+    for (i=0 ; i<st->ncaps ; i++)
+        st->caps[i].mark = p;
+
+    while (p<last && je_st_done!=st->state) {
+        ch = *p;
+
+        switch (st->state) {
+
+        case je_st_value:
+            if (l_isspace(ch)) {
+                p++;
+                break;
+            }
+
+            node = st->vnode;
+            st->vnode = NULL;
+
+            // Materialize only requested values
+            if (NULL!=node && node->slot>=0
+                && NULL==st->values[node->slot].data)
+            {
+                cap = &st->caps[st->ncaps++];
+                cap->slot = node->slot;
+                cap->level = st->nframes;
+                cap->mark = p;
+                cap->buf.data = NULL;
+                cap->buf.len = 0;
+                cap->size = 0;
+            }
+
+            if ('{'==ch && NULL!=node && node->children.nelts>0) {
+                fr = &st->frames[st->nframes++];
+                fr->node = node;
+                fr->array = 0;
+                st->state = je_st_key_or_end;
+                p++;
+                break;
+            }
+
+            if ('['==ch && NULL!=node && node->elems) {
+                fr = &st->frames[st->nframes++];
+                fr->node = node;
+                fr->array = 1;
+                fr->index = 0;
+                st->state = je_st_elem_or_end;
+                p++;
+                break;
+            }
+
+            switch (ch) {
+            case '{':
+            case '[':
+                st->depth = 1;
+                st->instr = 0;
+                st->state = je_st_skip;
+                p++;
+                break;
+
+            case '"':
+                st->depth = 0;
+                st->instr = 1;
+                st->esc = 0;
+                st->state = je_st_skip;
+                p++;
+                break;
+
+            case '}':
+            case ']':
+            case ',':
+            case ':':
+                goto invalid;
+
+            default:
+                st->state = je_st_scalar;
+            }
+            break;
+
+        case je_st_skip:
+            // Unrelated subtree, only string and bracket balance matter
+            p = ngx_json_extractor_skip(st, p, last);
+
+            if (p==last)
+                break;
+
+            if (NGX_OK!=je_value_end(st, ++p))
+                return NGX_ERROR;
+            break;
+
+        case je_st_scalar:
+            if (je_is_delimiter(ch)) {
+                if (NGX_OK!=je_value_end(st, p))
+                    return NGX_ERROR;
+                break;
+            }
+
+            if (!je_is_scalar(ch))
+                goto invalid;
+
+            p++;
+            break;
+
+        case je_st_after:
+            if (l_isspace(ch)) {
+                p++;
+                break;
+            }
+
+            fr = &st->frames[st->nframes-1];
+
+            if (','==ch) {
+                if (fr->array) {
+                    fr->index++;
+                    st->vnode = je_elem_match(st);
+                    st->state = je_st_value;
+                } else {
+                    st->state = je_st_key_or_end;
+                }
+                p++;
+                break;
+            }
+
+            if ((fr->array ? ']' : '}')!=ch)
+                goto invalid;
+
+            st->nframes--;
+            if (NGX_OK!=je_value_end(st, ++p))
+                return NGX_ERROR;
+            break;
+
+        case je_st_elem_or_end:
+            if (l_isspace(ch)) {
+                p++;
+                break;
+            }
+
+            if (']'==ch) {
+                st->nframes--;
+                if (NGX_OK!=je_value_end(st, ++p))
+                    return NGX_ERROR;
+                break;
+            }
+
+            // First element starts here
+            st->vnode = je_elem_match(st);
+            st->state = je_st_value;
+            break;
+
+        case je_st_key_or_end:
+            if (l_isspace(ch)) {
+                p++;
+                break;
+            }
+
+            if ('"'==ch) {
+                st->keylen = 0;
+                st->kesc = 0;
+                st->kover = 0;
+                st->esc = 0;
+                st->state = je_st_key;
+                p++;
+                break;
+            }
+
+            if ('}'!=ch)
+                goto invalid;
+
+            st->nframes--;
+            if (NGX_OK!=je_value_end(st, ++p))
+                return NGX_ERROR;
+            break;
+
+        case je_st_key:
+            for ( ; p<last ; p++) {
+                ch = *p;
+
+                if (st->esc) {
+                    st->esc = 0;
+                } else if ('\\'==ch) {
+                    st->esc = 1;
+                    st->kesc = 1;
+                } else if ('"'==ch) {
+                    break;
+                }
+
+                if (st->keylen<st->keysize) {
+                    st->key[st->keylen++] = ch;
+                } else {
+                    st->kover = 1;
+                }
+            }
+
+            if (p==last)
+                break;
+
+            p++;
+            st->vnode = je_key_match(st);
+            st->state = je_st_colon;
+            break;
+
+        case je_st_colon:
+            if (l_isspace(ch)) {
+                p++;
+                break;
+            }
+
+            if (':'!=ch)
+                goto invalid;
+
+            st->state = je_st_value;
+            p++;
+            break;
+        }
+    }
+
+    st->offset += p - start;
+
+    if (je_st_done==st->state)
+        return NGX_OK;
+
+    // Keep parts of unfinished values
+    for (i=0 ; i<st->ncaps ; i++) {
+        if (NGX_OK!=je_capture_append(st, &st->caps[i], st->caps[i].mark,
+                                      last))
+            return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+
+invalid:
+
+    st->offset += p - start;
+    return NGX_ERROR;
+}
+
+/**
+ * End of the document
+ * @param st
+ * @return NGX_[STATUS]
+ */
+ngx_int_t
+ngx_json_extractor_stream_finish(je_stream_t *st)
+{
+    if (NGX_JSON_EXTRACTOR_FORMAT_JSON!=st->item->format)
+        return ngx_json_extractor_binary_finish(st);
+
+    // Top level scalar has no delimiter
+    if (je_st_scalar==st->state && 0==st->nframes)
+        st->state = je_st_done;
+
+    return je_st_done==st->state ? NGX_OK : NGX_ERROR;
+}
+
+/**
+ * Process buffers of the document in place, data of file buffers
+ * is read by small parts
+ * @param st
+ * @param in
+ * @return NGX_OK, NGX_AGAIN or NGX_ERROR like the feed
+ */
+ngx_int_t
+ngx_json_extractor_stream_chain(je_stream_t *st, ngx_chain_t *in)
+{
+    off_t        pos;
+    ssize_t      n;
+    ngx_buf_t   *b;
+    ngx_file_t  *file, quiet;
+
+    for ( ; NULL!=in && NGX_AGAIN==st->rc ; in=in->next) {
+        b = in->buf;
+
+        if (ngx_buf_in_memory(b)) {
+            st->rc = je_chain_feed(st, b->pos, b->last);
+
+        } else if (b->in_file) {
+            if (NULL==st->window) {
+                st->window = ngx_pnalloc(st->pool,
+                                         NGX_JSON_EXTRACTOR_READ_SIZE);
+                if (NULL==st->window) {
+                    st->rc = NGX_ERROR;
+                    break;
+                }
+            }
+
+            // Read error of a thread task is kept for the caller
+            file = b->file;
+            if (st->deferred) {
+                quiet = *b->file;
+                quiet.log = &je_quiet_log;
+                file = &quiet;
+            }
+
+            for (pos=b->file_pos ; pos<b->file_last && NGX_AGAIN==st->rc ;
+                 pos+=n)
+            {
+                n = ngx_read_file(file, st->window,
+                        (size_t) ngx_min(b->file_last - pos,
+                                         NGX_JSON_EXTRACTOR_READ_SIZE),
+                        pos);
+                if (n<=0) {
+                    st->err = NGX_ERROR==n ? ngx_errno : 0;
+                    st->rc = NGX_ERROR;
+                    break;
+                }
+
+                st->rc = je_chain_feed(st, st->window, st->window + n);
+            }
+        }
+
+        // Subrequest output ends with last_in_chain
+        if (NGX_AGAIN==st->rc && (b->last_buf || b->last_in_chain))
+            st->rc = ngx_json_extractor_stream_finish(st);
+    }
+
+    return st->rc;
+}
+
+/**
+ * Decode JSON string escapes
+ * @param dst - not less than len, may be equal to src
+ * @param src - string without quotes
+ * @param len
+ * @return end of decoded string or NULL
+ */
+u_char *
+ngx_json_extractor_unescape(u_char *dst, u_char *src, size_t len)
+{
+    u_char     *last;
+    ngx_int_t   cp, lo;
+
+    last = src + len;
+
+    while (src<last) {
+        if ('\\'!=*src) {
+            *dst++ = *src++;
+            continue;
+        }
+
+        if (++src==last)
+            return NULL;
+
+        switch (*src++) {
+        case '"':  *dst++ = '"';  break;
+        case '\\': *dst++ = '\\'; break;
+        case '/':  *dst++ = '/';  break;
+        case 'b':  *dst++ = '\b'; break;
+        case 'f':  *dst++ = '\f'; break;
+        case 'n':  *dst++ = '\n'; break;
+        case 'r':  *dst++ = '\r'; break;
+        case 't':  *dst++ = '\t'; break;
+
+        case 'u':
+            if (last-src<4 || NGX_ERROR==(cp = ngx_hextoi(src, 4)))
+                return NULL;
+            src += 4;
+
+            // Surrogate pair
+            if (cp>=0xD800 && cp<=0xDBFF) {
+                if (last-src<6 || '\\'!=src[0] || 'u'!=src[1])
+                    return NULL;
+
+                lo = ngx_hextoi(src + 2, 4);
+                if (lo<0xDC00 || lo>0xDFFF)
+                    return NULL;
+                src += 6;
+
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            } else if (cp>=0xDC00 && cp<=0xDFFF) {
+                return NULL;
+            }
+
+            if (cp<0x80) {
+                *dst++ = (u_char) cp;
+            } else if (cp<0x800) {
+                *dst++ = (u_char) (0xC0 | (cp >> 6));
+                *dst++ = (u_char) (0x80 | (cp & 0x3F));
+            } else if (cp<0x10000) {
+                *dst++ = (u_char) (0xE0 | (cp >> 12));
+                *dst++ = (u_char) (0x80 | ((cp >> 6) & 0x3F));
+                *dst++ = (u_char) (0x80 | (cp & 0x3F));
+            } else {
+                *dst++ = (u_char) (0xF0 | (cp >> 18));
+                *dst++ = (u_char) (0x80 | ((cp >> 12) & 0x3F));
+                *dst++ = (u_char) (0x80 | ((cp >> 6) & 0x3F));
+                *dst++ = (u_char) (0x80 | (cp & 0x3F));
+            }
+            break;
+
+        default:
+            return NULL;
+        }
+    }
+
+    return dst;
+}
+
+/**
+ * Find child of the trie node by key
+ * @param node
+ * @param key
+ * @param len
+ * @return node or NULL
+ */
+je_node_t *
+ngx_json_extractor_node_find(je_node_t *node, u_char *key, size_t len)
+{
+    ngx_uint_t  i;
+    je_node_t  *children;
+
+    children = node->children.elts;
+
+    for (i=0 ; i<node->children.nelts ; i++) {
+        if (children[i].key.len==len
+            && 0==ngx_memcmp(children[i].key.data, key, len))
+            return children + i;
+    }
+    return NULL;
+}
+
+/**
+ * Format real number the same way as libjansson does:
+ * "%.17g" and ".0" for integral values
+ * @param buf - NGX_JSON_EXTRACTOR_REAL_LEN bytes
+ * @param d
+ * @return end of the number or NULL for NaN and infinity
+ */
+u_char *
+ngx_json_extractor_dtoa(u_char *buf, double d)
+{
+    int  n;
+
+    if (d!=d || d-d!=d-d)
+        return NULL;
+
+    n = snprintf((char *) buf, NGX_JSON_EXTRACTOR_REAL_LEN - 2, "%.17g", d);
+    if (n<=0 || n>=NGX_JSON_EXTRACTOR_REAL_LEN - 2)
+        return NULL;
+
+    if (NULL==ngx_strlchr(buf, buf + n, '.')
+        && NULL==ngx_strlchr(buf, buf + n, 'e'))
+    {
+        buf[n++] = '.';
+        buf[n++] = '0';
+    }
+
+    return buf + n;
+}
+
+/**
+ * Skip JSON whitespace
+ * @param p
+ * @param last
+ * @return first other byte or last
+ */
+u_char *
+ngx_json_extractor_space(u_char *p, u_char *last)
+{
+    while (p<last && l_isspace(*p))
+        p++;
+
+    return p;
+}
+
+/**
+ * Check JSON string, escapes are decoded on use only
+ * @param p - after the opening quote
+ * @param last
+ * @param escaped - set to 1 if the string has escapes
+ * @return after the closing quote or NULL
+ */
+u_char *
+ngx_json_extractor_string(u_char *p, u_char *last, ngx_uint_t *escaped)
+{
+    *escaped = 0;
+
+    for ( ; p<last ; p++) {
+        if ('"'==*p)
+            return p + 1;
+
+        if (*p<0x20)
+            return NULL;
+
+        if ('\\'!=*p)
+            continue;
+
+        *escaped = 1;
+
+        if (++p==last)
+            return NULL;
+
+        if ('u'==*p) {
+            if (last - p<5 || NGX_ERROR==ngx_hextoi(p + 1, 4))
+                return NULL;
+
+            p += 4;
+            continue;
+        }
+
+        if (NULL==ngx_strlchr((u_char *) "\"\\/bfnrt",
+                              (u_char *) "\"\\/bfnrt" + 8, *p))
+            return NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Check JSON number grammar
+ * @param p
+ * @param last
+ * @return after the number or NULL
+ */
+u_char *
+ngx_json_extractor_number(u_char *p, u_char *last)
+{
+    if (p<last && '-'==*p)
+        p++;
+
+    if (p==last)
+        return NULL;
+
+    if ('0'==*p) {
+        p++;
+    } else if (*p>='1' && *p<='9') {
+        while (p<last && *p>='0' && *p<='9')
+            p++;
+    } else {
+        return NULL;
+    }
+
+    if (p<last && '.'==*p) {
+        if (++p==last || *p<'0' || *p>'9')
+            return NULL;
+        while (p<last && *p>='0' && *p<='9')
+            p++;
+    }
+
+    if (p<last && ('e'==*p || 'E'==*p)) {
+        if (++p<last && ('+'==*p || '-'==*p))
+            p++;
+        if (p==last || *p<'0' || *p>'9')
+            return NULL;
+        while (p<last && *p>='0' && *p<='9')
+            p++;
+    }
+
+    return p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Compile array element key: "N" index, "nN" index from the end,
+ * "any" first matched element
+ * @param node
+ */
+static void
+je_node_index(je_node_t *node)
+{
+    ngx_int_t  n;
+
+    if (3==node->key.len && 0==ngx_strncmp(node->key.data, "any", 3)) {
+        node->any = 1;
+        return;
+    }
+
+    if (node->key.len>1 && 'n'==node->key.data[0]) {
+        n = ngx_atoi(node->key.data + 1, node->key.len - 1);
+        if (n>0) {
+            node->isindex = 1;
+            node->index = -n;
+        }
+        return;
+    }
+
+    n = ngx_atoi(node->key.data, node->key.len);
+    if (NGX_ERROR!=n) {
+        node->isindex = 1;
+        node->index = n;
+    }
+}
+
+/**
+ * Find trie node of the just read object key
+ * @param st
+ * @return node or NULL if the value is not requested
+ */
+static je_node_t *
+je_key_match(je_stream_t *st)
+{
+    u_char  *end;
+    size_t   len;
+
+    if (st->kover)
+        return NULL;
+
+    len = st->keylen;
+
+    if (st->kesc) {
+        end = ngx_json_extractor_unescape(st->key, st->key, len);
+        if (NULL==end)
+            return NULL;
+        len = end - st->key;
+    }
+
+    return ngx_json_extractor_node_find(st->frames[st->nframes-1].node,
+                                        st->key, len);
+}
+
+/**
+ * Find trie node of the next array element, the index wins over "any",
+ * indexes from the end are not known while streaming
+ * @param st
+ * @return node or NULL if the value is not requested
+ */
+static je_node_t *
+je_elem_match(je_stream_t *st)
+{
+    ngx_uint_t   i;
+    je_frame_t  *fr;
+    je_node_t   *children, *any;
+
+    fr = &st->frames[st->nframes-1];
+    children = fr->node->children.elts;
+    any = NULL;
+
+    for (i=0 ; i<fr->node->children.nelts ; i++) {
+        if (children[i].isindex && children[i].index>=0
+            && (ngx_uint_t) children[i].index==fr->index)
+            return children + i;
+
+        if (children[i].any)
+            any = children + i;
+    }
+    return any;
+}
+
+/**
+ * Pass buffer of the chain to the parser or to the inflater
+ * @param st
+ * @param p
+ * @param last
+ * @return NGX_[STATUS] like the feed
+ */
+static ngx_int_t
+je_chain_feed(je_stream_t *st, u_char *p, u_char *last)
+{
+    if (NULL!=st->inflate)
+        return ngx_json_extractor_inflate_feed(st, p, last);
+
+    return ngx_json_extractor_stream_feed(st, p, last);
+}
+
+/**
+ * Value is over, finish its capture if any
+ * @param st
+ * @param p - position after the value in current buffer
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_value_end(je_stream_t *st, u_char *p)
+{
+    je_capture_t  *cap;
+
+    if (st->ncaps>0) {
+        cap = &st->caps[st->ncaps-1];
+
+        if (cap->level==st->nframes) {
+            st->ncaps--;
+
+            // Value of one buffer is taken as is, no copy
+            if (st->inplace && 0==cap->buf.len) {
+                cap->buf.data = cap->mark;
+                cap->buf.len = p - cap->mark;
+
+            } else if (NGX_OK!=je_capture_append(st, cap, cap->mark, p)) {
+                return NGX_ERROR;
+            }
+
+            if (NGX_OK!=je_capture_done(st, cap))
+                return NGX_ERROR;
+
+            // Every selector is resolved, the tail is not needed
+            if (st->found==st->item->nslots) {
+                st->state = je_st_done;
+                return NGX_OK;
+            }
+        }
+    }
+
+    st->state = 0==st->nframes ? je_st_done : je_st_after;
+    return NGX_OK;
+}
+
+static ngx_int_t
+je_capture_append(je_stream_t *st, je_capture_t *cap, u_char *p,
+    u_char *last)
+{
+    u_char  *buf;
+    size_t   n, size;
+
+    n = last - p;
+    if (0==n)
+        return NGX_OK;
+
+    if (cap->buf.len + n > cap->size) {
+        size = ngx_max(cap->size * 2, cap->buf.len + n);
+
+        buf = ngx_pnalloc(st->pool, size);
+        if (NULL==buf)
+            return NGX_ERROR;
+
+        if (cap->buf.len>0)
+            ngx_memcpy(buf, cap->buf.data, cap->buf.len);
+
+        cap->buf.data = buf;
+        cap->size = size;
+    }
+
+    ngx_memcpy(cap->buf.data + cap->buf.len, p, n);
+    cap->buf.len += n;
+    return NGX_OK;
+}
+
+/**
+ * Convert captured JSON text to the variable value the same way
+ * as walk_json_item does, strings without escapes are not copied
+ * @param st
+ * @param cap
+ * @return NGX_[STATUS]
+ */
+static ngx_int_t
+je_capture_done(je_stream_t *st, je_capture_t *cap)
+{
+    u_char     *s, *d, *end;
+    size_t      len;
+    ngx_str_t  *val;
+
+    val = &st->values[cap->slot];
+    s = cap->buf.data;
+    len = cap->buf.len;
+
+    switch (*s) {
+    case '"':
+        s++;
+        len -= 2;
+
+        if (NULL==ngx_strlchr(s, s + len, '\\')) {
+            val->data = s;
+            val->len = len;
+            break;
+        }
+
+        d = ngx_pnalloc(st->pool, len);
+        if (NULL==d)
+            return NGX_ERROR;
+
+        end = ngx_json_extractor_unescape(d, s, len);
+        if (NULL==end)
+            return NGX_ERROR;
+
+        val->data = d;
+        val->len = end - d;
+        break;
+
+    case 't':
+        if (4!=len || 0!=ngx_strncmp(s, "true", 4))
+            return NGX_ERROR;
+        ngx_str_set(val, "1");
+        break;
+
+    case 'f':
+        if (5!=len || 0!=ngx_strncmp(s, "false", 5))
+            return NGX_ERROR;
+        ngx_str_set(val, "0");
+        break;
+
+    case 'n':
+        if (4!=len || 0!=ngx_strncmp(s, "null", 4))
+            return NGX_ERROR;
+        ngx_str_set(val, "");
+        break;
+
+    default:
+        // Numbers and containers as is
+        val->data = s;
+        val->len = len;
+    }
+
+    st->found++;
+    return NGX_OK;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
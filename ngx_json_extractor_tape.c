@@ -0,0 +1,702 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Tape documents.
+ *
+ * The whole document is one array of 16 byte items in document order.
+ * Every item keeps its type and offset in the source, scalars keep the
+ * length, so strings and numbers are not copied. Objects and arrays
+ * keep the count of members and the index of the item after their end
+ * item, members of an object are its keys inline, each followed by the
+ * value. A walk goes forward only and jumps over unrelated values by
+ * the next sibling index.
+ *
+ * Keys are scanned inline. Most documents are walked once, a sort
+ * would cost more than the scan, so objects with more than
+ * NGX_JSON_EXTRACTOR_TAPE_KEYS members walked again (other locations,
+ * file documents) get a sorted key array then: the end item refers to
+ * it and keys are found by binary search. Objects with escaped keys
+ * are always scanned. As in the dom the last of duplicate keys wins.
+ *
+ * While a container is open its next index holds the enclosing open
+ * container, so the parser needs no stack. The tape starts small and
+ * grows twice.
+ */
+
+#define JE_TAPE_OBJECT      1
+#define JE_TAPE_ARRAY       2
+#define JE_TAPE_END         3
+#define JE_TAPE_STRING      4
+#define JE_TAPE_NUMBER      5
+#define JE_TAPE_TRUE        6
+#define JE_TAPE_FALSE       7
+#define JE_TAPE_NULL        8
+
+#define JE_TAPE_NONE        0xffffffff          // No open container
+#define JE_TAPE_CHILDREN    8                   // Trie children on stack
+
+// End item data of big objects, then the key array start + 2
+#define JE_TAPE_UNSEEN      0
+#define JE_TAPE_SCANNED     1                   // Walked once
+#define JE_TAPE_UNSORTED    0xffffffff          // Escaped keys, no memory
+#define JE_TAPE_ESCAPED     0x8000000000000000ULL
+
+#define je_tape_type(t)     ((t)->head >> 56)
+#define je_tape_offset(t)   ((t)->head & 0x00ffffffffffffffULL)
+#define je_tape_count(t)    ((t)->data & 0xffffffff)
+#define je_tape_end(t)      ((t)->data >> 32)
+#define je_tape_len(t)      ((t)->data & ~JE_TAPE_ESCAPED)
+
+typedef struct {
+    uint64_t        head;                   // Type << 56 | source offset
+    uint64_t        data;                   // Length, for containers the
+                                            // next sibling << 32 | count
+} je_tape_item_t;
+
+// Key of an indexed object, sorted by length, bytes and member order
+typedef struct {
+    u_char         *key;
+    uint32_t        len;
+    uint32_t        value;                  // Item of the value
+} je_tape_key_t;
+
+struct je_tape_s {
+    je_tape_item_t *items;
+    ngx_uint_t      n;
+    ngx_uint_t      nalloc;
+    je_tape_key_t  *keys;                   // Arrays of indexed objects
+    ngx_uint_t      nkeys;
+    ngx_uint_t      nkeysalloc;
+    u_char         *src;
+};
+
+static je_tape_item_t *je_tape_push(je_tape_t *tape, ngx_uint_t type,
+    u_char *p);
+static u_char *je_tape_string(je_tape_item_t *t, u_char *p, u_char *last);
+static ngx_int_t je_tape_index(je_tape_t *tape, ngx_uint_t i);
+static int ngx_libc_cdecl je_tape_key_cmp(const void *one, const void *two);
+static ngx_uint_t je_tape_find(je_tape_t *tape, ngx_uint_t i, ngx_str_t *key);
+static void je_tape_walk(je_stream_t *st, je_node_t *node, je_tape_t *tape,
+    ngx_uint_t i);
+static ngx_uint_t je_tape_next(je_tape_t *tape, ngx_uint_t i);
+static void je_tape_value(je_stream_t *st, je_tape_t *tape, ngx_uint_t i,
+    ngx_str_t *out);
+static void je_tape_cleanup(void *data);
+
+/**
+ * Parse document into the tape
+ * @param pool - the tape is released with it
+ * @param doc
+ * @param tape
+ * @param pos - offset of the invalid byte
+ * @return NGX_OK, NGX_DECLINED for invalid document or NGX_ERROR
+ */
+ngx_int_t
+ngx_json_extractor_tape_parse(ngx_pool_t *pool, ngx_str_t *doc,
+    je_tape_t **tape, size_t *pos)
+{
+    u_char              *p, *last;
+    uint64_t             open, parent;
+    ngx_uint_t           type;
+    je_tape_t           *tp;
+    je_tape_item_t      *t;
+    ngx_pool_cleanup_t  *cln;
+
+    tp = ngx_palloc(pool, sizeof(je_tape_t));
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (NULL==tp || NULL==cln)
+        return NGX_ERROR;
+
+    // Short documents fit the first tape, long ones copy log2 times
+    ngx_memzero(tp, sizeof(je_tape_t));
+    tp->nalloc = NGX_JSON_EXTRACTOR_TAPE_ITEMS;
+    tp->src = doc->data;
+    tp->items = ngx_alloc(tp->nalloc * sizeof(je_tape_item_t), pool->log);
+    if (NULL==tp->items)
+        return NGX_ERROR;
+
+    cln->handler = je_tape_cleanup;
+    cln->data = tp;
+
+    p = doc->data;
+    last = p + doc->len;
+    open = JE_TAPE_NONE;
+
+value:
+
+    p = ngx_json_extractor_space(p, last);
+    if (p==last)
+        goto invalid;
+
+    switch (*p) {
+
+    case '{':
+    case '[':
+        type = '{'==*p ? JE_TAPE_OBJECT : JE_TAPE_ARRAY;
+
+        t = je_tape_push(tp, type, p);
+        if (NULL==t)
+            return NGX_ERROR;
+
+        t->data = open << 32;
+        open = tp->n - 1;
+
+        p = ngx_json_extractor_space(p + 1, last);
+        if (p<last && (JE_TAPE_OBJECT==type ? '}' : ']')==*p)
+            goto close;
+
+        if (JE_TAPE_ARRAY==type)
+            goto value;
+
+        goto key;
+
+    case '"':
+        t = je_tape_push(tp, JE_TAPE_STRING, p + 1);
+        if (NULL==t)
+            return NGX_ERROR;
+
+        p = je_tape_string(t, p + 1, last);
+        break;
+
+    case 't':
+    case 'f':
+    case 'n':
+        type = 't'==*p ? JE_TAPE_TRUE : 'f'==*p ? JE_TAPE_FALSE : JE_TAPE_NULL;
+
+        t = je_tape_push(tp, type, p);
+        if (NULL==t)
+            return NGX_ERROR;
+
+        t->data = JE_TAPE_FALSE==type ? 5 : 4;
+
+        if ((size_t) (last - p)<t->data
+            || 0!=ngx_strncmp(p, (JE_TAPE_TRUE==type ? "true"
+                                  : JE_TAPE_FALSE==type ? "false" : "null"),
+                              t->data))
+            goto invalid;
+
+        p += t->data;
+        break;
+
+    default:
+        t = je_tape_push(tp, JE_TAPE_NUMBER, p);
+        if (NULL==t)
+            return NGX_ERROR;
+
+        p = ngx_json_extractor_number(p, last);
+        if (NULL!=p)
+            t->data = p - tp->src - je_tape_offset(t);
+        break;
+    }
+
+    if (NULL==p)
+        goto invalid;
+
+next:
+
+    p = ngx_json_extractor_space(p, last);
+
+    if (JE_TAPE_NONE==open) {
+        if (p!=last)
+            goto invalid;
+
+        *tape = tp;
+        return NGX_OK;
+    }
+
+    if (p==last)
+        goto invalid;
+
+    t = &tp->items[open];
+    t->data++;
+
+    if (','==*p) {
+        p++;
+        if (JE_TAPE_ARRAY==je_tape_type(t))
+            goto value;
+        goto key;
+    }
+
+    if ((JE_TAPE_OBJECT==je_tape_type(t) && '}'==*p)
+        || (JE_TAPE_ARRAY==je_tape_type(t) && ']'==*p))
+        goto close;
+
+    goto invalid;
+
+close:
+
+    if (NULL==je_tape_push(tp, JE_TAPE_END, p))
+        return NGX_ERROR;
+
+    t = &tp->items[open];
+    parent = je_tape_end(t);
+    t->data = (uint64_t) tp->n << 32 | je_tape_count(t);
+
+    open = parent;
+
+    p++;
+    goto next;
+
+key:
+
+    p = ngx_json_extractor_space(p, last);
+    if (p==last || '"'!=*p)
+        goto invalid;
+
+    t = je_tape_push(tp, JE_TAPE_STRING, p + 1);
+    if (NULL==t)
+        return NGX_ERROR;
+
+    p = je_tape_string(t, p + 1, last);
+    if (NULL==p)
+        goto invalid;
+
+    p = ngx_json_extractor_space(p, last);
+    if (p==last || ':'!=*p)
+        goto invalid;
+
+    p++;
+    goto value;
+
+invalid:
+
+    *pos = (NULL==p ? last : p) - doc->data;
+    return NGX_DECLINED;
+}
+
+/**
+ * Get values of all selectors of the trie in one forward walk
+ * @param st - values by slot
+ * @param node - trie root
+ * @param tape
+ */
+void
+ngx_json_extractor_tape_walk(je_stream_t *st, je_node_t *node,
+    je_tape_t *tape)
+{
+    if (tape->n>0)
+        je_tape_walk(st, node, tape, 0);
+}
+
+/**
+ * Memory of the document
+ * @param tape
+ * @return bytes
+ */
+size_t
+ngx_json_extractor_tape_size(je_tape_t *tape)
+{
+    return sizeof(je_tape_t) + tape->nalloc * sizeof(je_tape_item_t)
+           + tape->nkeysalloc * sizeof(je_tape_key_t);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Append item, the tape grows twice
+ * @param tape
+ * @param type
+ * @param p - item start in the source
+ * @return item or NULL
+ */
+static je_tape_item_t *
+je_tape_push(je_tape_t *tape, ngx_uint_t type, u_char *p)
+{
+    je_tape_item_t *items, *t;
+
+    if (tape->n==tape->nalloc) {
+        items = ngx_alloc(2 * tape->nalloc * sizeof(je_tape_item_t),
+                          ngx_cycle->log);
+        if (NULL==items)
+            return NULL;
+
+        ngx_memcpy(items, tape->items, tape->n * sizeof(je_tape_item_t));
+        ngx_free(tape->items);
+
+        tape->items = items;
+        tape->nalloc *= 2;
+    }
+
+    t = &tape->items[tape->n++];
+    t->head = (uint64_t) type << 56 | (uint64_t) (p - tape->src);
+    t->data = 0;
+
+    return t;
+}
+
+/**
+ * Read string, escapes are checked and decoded on use only
+ * @param t - string item
+ * @param p - after the opening quote
+ * @param last
+ * @return after the closing quote or NULL
+ */
+static u_char *
+je_tape_string(je_tape_item_t *t, u_char *p, u_char *last)
+{
+    u_char      *end;
+    ngx_uint_t   esc;
+
+    end = ngx_json_extractor_string(p, last, &esc);
+    if (NULL==end)
+        return NULL;
+
+    t->data = (uint64_t) (end - 1 - p) | (esc ? JE_TAPE_ESCAPED : 0);
+
+    return end;
+}
+
+/**
+ * Build sorted key array of the object
+ * @param tape
+ * @param i - object item
+ * @return NGX_OK, NGX_DECLINED for escaped keys or NGX_ERROR
+ */
+static ngx_int_t
+je_tape_index(je_tape_t *tape, ngx_uint_t i)
+{
+    ngx_uint_t       k, m, n, start;
+    je_tape_key_t   *keys;
+    je_tape_item_t  *t, *kt;
+
+    t = &tape->items[i];
+    n = je_tape_count(t);
+
+    if (tape->nkeys + n>tape->nkeysalloc) {
+        m = ngx_max(2 * tape->nkeysalloc, tape->nkeys + n);
+
+        keys = ngx_alloc(m * sizeof(je_tape_key_t), ngx_cycle->log);
+        if (NULL==keys)
+            return NGX_ERROR;
+
+        if (NULL!=tape->keys) {
+            ngx_memcpy(keys, tape->keys, tape->nkeys * sizeof(je_tape_key_t));
+            ngx_free(tape->keys);
+        }
+
+        tape->keys = keys;
+        tape->nkeysalloc = m;
+    }
+
+    start = tape->nkeys;
+    keys = &tape->keys[start];
+
+    for (m=0, k=i+1 ; m<n ; m++, k=je_tape_next(tape, k + 1)) {
+        kt = &tape->items[k];
+
+        // Bytes of escaped keys are not the keys
+        if (kt->data & JE_TAPE_ESCAPED)
+            return NGX_DECLINED;
+
+        keys[m].key = tape->src + je_tape_offset(kt);
+        keys[m].len = (uint32_t) je_tape_len(kt);
+        keys[m].value = (uint32_t) (k + 1);
+    }
+
+    ngx_qsort(keys, n, sizeof(je_tape_key_t), je_tape_key_cmp);
+
+    tape->nkeys += n;
+
+    // End item is just before the next sibling
+    tape->items[je_tape_end(t) - 1].data = start + 2;
+
+    return NGX_OK;
+}
+
+/**
+ * Order of keys in the array, duplicates by member order
+ * @param one
+ * @param two
+ * @return difference
+ */
+static int ngx_libc_cdecl
+je_tape_key_cmp(const void *one, const void *two)
+{
+    int                   rc;
+    const je_tape_key_t  *a = one, *b = two;
+
+    if (a->len!=b->len)
+        return a->len<b->len ? -1 : 1;
+
+    rc = ngx_memcmp(a->key, b->key, a->len);
+    if (0!=rc)
+        return rc;
+
+    return a->value<b->value ? -1 : 1;
+}
+
+/**
+ * Find value of the key in the sorted key array of the object
+ * @param tape
+ * @param i - object item
+ * @param key
+ * @return value item of the last duplicate or 0
+ */
+static ngx_uint_t
+je_tape_find(je_tape_t *tape, ngx_uint_t i, ngx_str_t *key)
+{
+    int              rc;
+    ngx_uint_t       lo, hi, mid;
+    je_tape_key_t   *keys;
+
+    keys = &tape->keys[tape->items[je_tape_end(&tape->items[i]) - 1].data - 2];
+
+    // First key greater than the searched one
+    lo = 0;
+    hi = je_tape_count(&tape->items[i]);
+
+    while (lo<hi) {
+        mid = lo + (hi - lo) / 2;
+
+        rc = keys[mid].len!=key->len
+           ? (keys[mid].len<key->len ? -1 : 1)
+           : ngx_memcmp(keys[mid].key, key->data, key->len);
+
+        if (rc<=0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (0==lo || keys[lo - 1].len!=key->len
+        || 0!=ngx_memcmp(keys[lo - 1].key, key->data, key->len))
+        return 0;
+
+    return keys[lo - 1].value;
+}
+
+/**
+ * Walk value of the trie node
+ * @param st
+ * @param node
+ * @param tape
+ * @param i - value item
+ */
+static void
+je_tape_walk(je_stream_t *st, je_node_t *node, je_tape_t *tape,
+    ngx_uint_t i)
+{
+    u_char          *key, *dst, *end;
+    size_t           len;
+    ngx_int_t        idx, rc;
+    ngx_uint_t       k, m, n, c, nc, *last;
+    ngx_uint_t       buf[JE_TAPE_CHILDREN];
+    je_node_t       *child, *found;
+    je_tape_item_t  *t, *kt, *et;
+
+    if (node->slot>=0 && NULL==st->values[node->slot].data)
+        je_tape_value(st, tape, i, &st->values[node->slot]);
+
+    if (0==node->children.nelts)
+        return;
+
+    t = &tape->items[i];
+    n = je_tape_count(t);
+    child = node->children.elts;
+
+    // Members are key and value, the last of duplicate keys wins
+    if (JE_TAPE_OBJECT==je_tape_type(t)) {
+        nc = node->children.nelts;
+
+        last = nc<=JE_TAPE_CHILDREN ? buf
+             : ngx_palloc(st->pool, nc * sizeof(ngx_uint_t));
+        if (NULL==last)
+            return;
+
+        // Big objects are sorted when they are walked again
+        et = &tape->items[je_tape_end(t) - 1];
+
+        if (n>NGX_JSON_EXTRACTOR_TAPE_KEYS && JE_TAPE_SCANNED==et->data) {
+            rc = je_tape_index(tape, i);
+            if (NGX_OK!=rc)
+                et->data = JE_TAPE_UNSORTED;
+        }
+
+        if (JE_TAPE_SCANNED<et->data && JE_TAPE_UNSORTED!=et->data) {
+            for (c=0 ; c<nc ; c++)
+                last[c] = je_tape_find(tape, i, &child[c].key);
+
+            goto walk;
+        }
+
+        if (n>NGX_JSON_EXTRACTOR_TAPE_KEYS && JE_TAPE_UNSEEN==et->data)
+            et->data = JE_TAPE_SCANNED;
+
+        ngx_memzero(last, nc * sizeof(ngx_uint_t));
+
+        for (m=0, k=i+1 ; m<n ; m++, k=je_tape_next(tape, k + 1)) {
+            kt = &tape->items[k];
+            key = tape->src + je_tape_offset(kt);
+            len = je_tape_len(kt);
+
+            if (kt->data & JE_TAPE_ESCAPED) {
+                dst = ngx_pnalloc(st->pool, len);
+                end = NULL==dst ? NULL
+                    : ngx_json_extractor_unescape(dst, key, len);
+                if (NULL==end)
+                    continue;
+
+                key = dst;
+                len = end - dst;
+            }
+
+            found = ngx_json_extractor_node_find(node, key, len);
+
+            if (NULL!=found)
+                last[found - child] = k + 1;
+        }
+
+    walk:
+
+        for (c=0 ; c<nc ; c++) {
+            if (0!=last[c])
+                je_tape_walk(st, &child[c], tape, last[c]);
+        }
+        return;
+    }
+
+    if (!node->elems || JE_TAPE_ARRAY!=je_tape_type(t))
+        return;
+
+    // Elements are visited once for all index selectors
+    for (m=0, k=i+1 ; m<n ; m++, k=je_tape_next(tape, k)) {
+        for (c=0 ; c<node->children.nelts ; c++) {
+            if (child[c].any) {
+                je_tape_walk(st, &child[c], tape, k);
+                continue;
+            }
+
+            if (!child[c].isindex)
+                continue;
+
+            idx = child[c].index<0 ? (ngx_int_t) n + child[c].index
+                                   : child[c].index;
+
+            if (idx>=0 && (ngx_uint_t) idx==m)
+                je_tape_walk(st, &child[c], tape, k);
+        }
+    }
+}
+
+/**
+ * Get item of the next sibling
+ * @param tape
+ * @param i
+ * @return item index
+ */
+static ngx_uint_t
+je_tape_next(je_tape_t *tape, ngx_uint_t i)
+{
+    je_tape_item_t *t;
+
+    t = &tape->items[i];
+
+    if (JE_TAPE_OBJECT==je_tape_type(t) || JE_TAPE_ARRAY==je_tape_type(t))
+        return je_tape_end(t);
+
+    return i + 1;
+}
+
+/**
+ * Convert value to string the way the DOM walk does, numbers, objects
+ * and arrays are returned as they are written in the source
+ * @param st
+ * @param tape
+ * @param i - value item
+ * @param out - not changed if the string is invalid
+ */
+static void
+je_tape_value(je_stream_t *st, je_tape_t *tape, ngx_uint_t i,
+    ngx_str_t *out)
+{
+    u_char          *p, *dst, *end;
+    je_tape_item_t  *t;
+
+    t = &tape->items[i];
+    p = tape->src + je_tape_offset(t);
+
+    switch (je_tape_type(t)) {
+
+    case JE_TAPE_STRING:
+        if (0==(t->data & JE_TAPE_ESCAPED)) {
+            out->data = p;
+            out->len = je_tape_len(t);
+            return;
+        }
+
+        dst = ngx_pnalloc(st->pool, je_tape_len(t));
+        if (NULL==dst)
+            return;
+
+        end = ngx_json_extractor_unescape(dst, p, je_tape_len(t));
+        if (NULL==end)
+            return;
+
+        out->data = dst;
+        out->len = end - dst;
+        return;
+
+    case JE_TAPE_TRUE:
+        ngx_str_set(out, "1");
+        return;
+
+    case JE_TAPE_FALSE:
+        ngx_str_set(out, "0");
+        return;
+
+    case JE_TAPE_NULL:
+        ngx_str_set(out, "");
+        return;
+
+    case JE_TAPE_NUMBER:
+        out->data = p;
+        out->len = t->data;
+        return;
+
+    default:
+        break;
+    }
+
+    // End item is just before the next sibling
+    out->data = p;
+    out->len = je_tape_offset(&tape->items[je_tape_end(t) - 1]) + 1
+             - je_tape_offset(t);
+}
+
+/**
+ * Release the tape with the pool
+ * @param data je_tape_t*
+ */
+static void
+je_tape_cleanup(void *data)
+{
+    je_tape_t *tape = data;
+
+    ngx_free(tape->items);
+
+    if (NULL!=tape->keys)
+        ngx_free(tape->keys);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2012 Dmitry Ponomarev <demdxx@gmail.com>
+ *
+ * Nginx JSON extractor is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <jansson.h>
+
+#include "ngx_json_extractor_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Parsing of large request bodies by a thread pool.
+ *
+ * The body is read completely, then the streams of all body sources of
+ * the location walk it in one task while the request is blocked, as
+ * with aio threads. Streams allocate only from their own pool which
+ * the event loop does not touch meanwhile, file parts are read by the
+ * task. Errors of the task are kept by the streams and logged by the
+ * event loop, the request log is not used by the thread. The request
+ * goes on with the next phase when the task is done.
+ */
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_http_request_t  *request;
+    je_stream_t        **streams;
+    ngx_uint_t           nstreams;
+    ngx_chain_t         *in;
+} je_thread_ctx_t;
+
+static void je_thread_handler(void *data, ngx_log_t *log);
+static void je_thread_event_handler(ngx_event_t *ev);
+
+/**
+ * Post parsing of the body to the pool, the request is blocked
+ * until the task is done
+ * @param r
+ * @param tp
+ * @param streams - streams of the body sources
+ * @param n - streams count
+ * @param in - request body
+ * @return NGX_OK or NGX_ERROR if the task is not posted
+ */
+ngx_int_t
+ngx_json_extractor_thread_parse(ngx_http_request_t *r, ngx_thread_pool_t *tp,
+    je_stream_t **streams, ngx_uint_t n, ngx_chain_t *in)
+{
+    ngx_uint_t          i;
+    ngx_thread_task_t  *task;
+    je_thread_ctx_t    *tc;
+
+    task = ngx_thread_task_alloc(r->pool, sizeof(je_thread_ctx_t));
+    if (NULL==task)
+        return NGX_ERROR;
+
+    tc = task->ctx;
+    tc->request = r;
+    tc->streams = streams;
+    tc->nstreams = n;
+    tc->in = in;
+
+    for (i=0 ; i<n ; i++)
+        streams[i]->deferred = 1;
+
+    task->handler = je_thread_handler;
+    task->event.handler = je_thread_event_handler;
+    task->event.data = tc;
+
+    if (NGX_OK!=ngx_thread_task_post(tp, task))
+        return NGX_ERROR;
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Helpers ///////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Parse the body by every stream, runs in a thread
+ * @param data - je_thread_ctx_t
+ * @param log
+ */
+static void
+je_thread_handler(void *data, ngx_log_t *log)
+{
+    uint64_t          t;
+    ngx_uint_t        i;
+    je_stream_t      *st;
+    je_thread_ctx_t  *tc = data;
+
+    for (i=0 ; i<tc->nstreams ; i++) {
+        st = tc->streams[i];
+        t = ngx_json_extractor_stat_time();
+
+        if (NGX_AGAIN==ngx_json_extractor_stream_chain(st, tc->in))
+            st->rc = ngx_json_extractor_stream_finish(st);
+
+        st->nsec = ngx_json_extractor_stat_time() - t;
+
+        // Counters are atomic
+        ngx_json_extractor_stat_parse(st->item, st->offset, st->nsec,
+                                      st->rc);
+    }
+}
+
+/**
+ * Log errors of the task and resume the request when the task is done,
+ * runs in the event loop
+ * @param ev
+ */
+static void
+je_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_uint_t           i;
+    je_stream_t         *st;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+    je_thread_ctx_t     *tc;
+
+    tc = ev->data;
+    r = tc->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    for (i=0 ; i<tc->nstreams ; i++) {
+        st = tc->streams[i];
+        st->deferred = 0;
+
+        if (NULL!=st->limit) {
+            ngx_log_error_core(NGX_LOG_WARN, c->log, 0,
+                "JSON %s limit exceeded: position[%O]", st->limit,
+                st->limitpos);
+        }
+
+        if (NGX_ERROR==st->rc && 0!=st->err) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, st->err,
+                          "JSON body read failed");
+        }
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    // Next phase, or finalization if the client is gone
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif